@@ -0,0 +1,107 @@
+//分隔符扫描微基准：用simple-client.py发送的数据测试每种实现的单核吞吐量
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+//每次交给frame_next的缓冲区大小，模拟一次recv
+#define CHUNK_SIZE (64 * 1024)
+//每种实现至少运行的时间（秒）
+#define MIN_SECONDS 1.0
+
+//构造与simple-client.py相同的三段数据
+static uint8_t *build_payload(size_t *len)
+{
+  const char *head = "^abc$de^abte$f" "xyz^";
+  const char *body = "abcdzfghijkilovefudaniloveunixprogramming";
+  const char *tail = "25$^ab0000$abab";
+  size_t body_len = strlen(body);
+  size_t total = strlen(head) + 100000 * body_len + strlen(tail);
+
+  uint8_t *buf = xmalloc(total);
+  uint8_t *p = buf;
+  memcpy(p, head, strlen(head));
+  p += strlen(head);
+  for (int i = 0; i < 100000; ++i)
+  {
+    memcpy(p, body, body_len);
+    p += body_len;
+  }
+  memcpy(p, tail, strlen(tail));
+  *len = total;
+  return buf;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//扫描一遍数据，返回消息内字节数与校验和，用于比较各实现结果是否一致
+static uint64_t scan_once(const uint8_t *buf, size_t len, uint64_t *sum)
+{
+  ProcessingState state = WAIT_FOR_MSG;
+  uint64_t in_msg = 0;
+  for (size_t off = 0; off < len; off += CHUNK_SIZE)
+  {
+    size_t n = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+    const uint8_t *pos = buf + off, *span;
+    size_t spanlen;
+    while ((spanlen = frame_next(&state, &pos, buf + off + n, &span)) > 0)
+    {
+      in_msg += spanlen;
+      *sum += span[0] + span[spanlen - 1];
+    }
+  }
+  return in_msg;
+}
+
+int main(void)
+{
+  size_t len;
+  uint8_t *payload = build_payload(&len);
+  printf("payload: %zu bytes, chunk: %d bytes\n", len, CHUNK_SIZE);
+
+  const scan_impl_t impls[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+  uint64_t expect_bytes = 0, expect_sum = 0;
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i)
+  {
+    if (frame_scan_select(impls[i]) < 0)
+    {
+      continue;
+    }
+
+    uint64_t sum = 0;
+    uint64_t bytes = scan_once(payload, len, &sum);
+    if (i == 0)
+    {
+      expect_bytes = bytes;
+      expect_sum = sum;
+    }
+    else if (bytes != expect_bytes || sum != expect_sum)
+    {
+      die("%s: result mismatch", frame_scan_name());
+    }
+
+    int rounds = 0;
+    double start = now(), elapsed;
+    do
+    {
+      scan_once(payload, len, &sum);
+      ++rounds;
+      elapsed = now() - start;
+    } while (elapsed < MIN_SECONDS);
+
+    printf("%-8s %8.2f GB/s  (%llu in-message bytes per pass)\n",
+           frame_scan_name(), (double)len * rounds / elapsed / 1e9,
+           (unsigned long long)bytes);
+  }
+
+  free(payload);
+  return 0;
+}
@@ -0,0 +1,396 @@
+# 基准测试矩阵：依次启动四个模块服务器和/code/system的server，
+# 在不同的文件大小和客户数下测量响应时间，同时从/proc采样服务器的CPU占用和磁盘写入速率，
+# 输出CSV，安装了matplotlib时同时画图
+# 使用Python 3.6
+import argparse
+import csv
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MODULE_DIR = os.path.dirname(HERE)
+SYSTEM_DIR = os.path.join(os.path.dirname(MODULE_DIR), 'system')
+
+MODULE_SERVERS = ['sequential', 'threaded', 'select', 'epoll']
+MODULE_PORT = 9090
+# client-test/client的默认端口（--port）
+SYSTEM_PORT = 10000
+
+SUMMARY_FIELDS = [
+    'server', 'payload_bytes', 'clients', 'finished', 'failed',
+    'elapsed_s', 'resp_p50_ms', 'resp_p90_ms', 'resp_p99_ms', 'resp_max_ms',
+    'throughput_mbps', 'cpu_avg_pct', 'cpu_peak_pct',
+    'write_avg_mbps', 'write_peak_mbps', 'write_total_mb',
+]
+SAMPLE_FIELDS = [
+    'server', 'payload_bytes', 'clients', 't', 'cpu_pct', 'write_mbps',
+]
+
+
+def parse_size(text):
+    """200K、4M或字节数"""
+    m = re.match(r'^(\d+)([KkMm]?)[Bb]?$', text)
+    if not m:
+        raise argparse.ArgumentTypeError('bad size: ' + text)
+    unit = {'': 1, 'k': 1024, 'm': 1024 * 1024}[m.group(2).lower()]
+    return int(m.group(1)) * unit
+
+
+def size_label(n):
+    if n % (1024 * 1024) == 0:
+        return '{0}Mb'.format(n // (1024 * 1024))
+    if n % 1024 == 0:
+        return '{0}Kb'.format(n // 1024)
+    return '{0}b'.format(n)
+
+
+def quantile(values, q):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(q * len(values)))]
+
+
+class Sampler(threading.Thread):
+    """按固定间隔读取/proc/<pid>/stat与/proc/<pid>/io，
+    记录服务器进程（含所有线程）的CPU占用与写入存储层的字节数"""
+
+    def __init__(self, pid, interval):
+        super().__init__()
+        self.pid = pid
+        self.interval = interval
+        self.ticks = os.sysconf('SC_CLK_TCK')
+        self.samples = []
+        self.first = None
+        self.last = None
+        self.stopped = threading.Event()
+
+    def read(self):
+        with open('/proc/{0}/stat'.format(self.pid)) as f:
+            # comm中可能有空格，从最后一个')'之后开始数字段
+            fields = f.read().rsplit(')', 1)[1].split()
+        cpu = (int(fields[11]) + int(fields[12])) / self.ticks
+        written = 0
+        try:
+            with open('/proc/{0}/io'.format(self.pid)) as f:
+                for line in f:
+                    if line.startswith('write_bytes:'):
+                        written = int(line.split()[1])
+        except (IOError, OSError):
+            pass
+        return time.time(), cpu, written
+
+    def sample(self):
+        try:
+            cur = self.read()
+        except (IOError, OSError):
+            return False
+        if self.last is None:
+            self.first = cur
+        else:
+            dt = cur[0] - self.last[0]
+            if dt > 0:
+                self.samples.append((cur[0] - self.first[0],
+                                     100.0 * (cur[1] - self.last[1]) / dt,
+                                     (cur[2] - self.last[2]) / dt / 1e6))
+        self.last = cur
+        return True
+
+    def run(self):
+        if not self.sample():
+            return
+        while not self.stopped.wait(self.interval):
+            if not self.sample():
+                break
+
+    def stop(self):
+        """停止采样，服务器退出前再读一次，运行时间短于采样间隔时也有结果"""
+        self.stopped.set()
+        self.join()
+        self.sample()
+
+    def summary(self):
+        """整次运行的平均值与采样间隔内的峰值"""
+        if self.first is None or self.last[0] <= self.first[0]:
+            return {}
+        dt = self.last[0] - self.first[0]
+        written = self.last[2] - self.first[2]
+        return {
+            'cpu_avg_pct': round(100.0 * (self.last[1] - self.first[1]) / dt,
+                                 1),
+            'cpu_peak_pct': round(max(s[1] for s in self.samples), 1),
+            'write_avg_mbps': round(written / dt / 1e6, 2),
+            'write_peak_mbps': round(max(s[2] for s in self.samples), 2),
+            'write_total_mb': round(written / 1e6, 2),
+        }
+
+
+def listening(port):
+    """/proc/net/tcp中是否有该端口的LISTEN socket（状态0A）；
+    不用connect探测，探测连接对顺序服务器也是一个客户"""
+    for path in ('/proc/net/tcp', '/proc/net/tcp6'):
+        try:
+            with open(path) as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if (fields[3] == '0A' and
+                            int(fields[1].rsplit(':', 1)[1], 16) == port):
+                        return True
+        except (IOError, OSError):
+            pass
+    return False
+
+
+def wait_port(port, timeout=10):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if listening(port):
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def start_server(argv, cwd, port):
+    proc = subprocess.Popen(argv, cwd=cwd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    if not wait_port(port):
+        proc.kill()
+        raise RuntimeError('{0} did not start listening on {1}'.format(
+            argv[0], port))
+    time.sleep(0.2)
+    return proc
+
+
+def stop_server(proc):
+    if proc.poll() is None:
+        proc.send_signal(signal.SIGTERM)
+        try:
+            proc.wait(2)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+
+
+def run_module(name, size, clients, args, workdir):
+    """模块服务器：loadgen的每个连接发送一条size字节的消息后关闭，
+    每个客户的用时从开始计算到收完全部回显"""
+    server = start_server([os.path.join(MODULE_DIR, name + '-server'),
+                           str(MODULE_PORT)], workdir, MODULE_PORT)
+    sampler = Sampler(server.pid, args.interval)
+    sampler.start()
+    out = subprocess.run(
+        [os.path.join(MODULE_DIR, 'loadgen'), '-c', str(clients), '-n', '1',
+         '-s', str(size), '-t', str(args.threads), '-d', str(args.timeout),
+         '127.0.0.1', str(MODULE_PORT)],
+        stdout=subprocess.PIPE, universal_newlines=True).stdout
+    sampler.stop()
+    alive = server.poll() is None
+    stop_server(server)
+
+    row = {'finished': 0, 'failed': clients}
+    m = re.search(r'client time \(ms\): (\d+) finished\s+p50 ([\d.]+)\s+'
+                  r'p90 ([\d.]+)\s+p99 ([\d.]+)\s+max ([\d.]+)', out)
+    if m:
+        finished = int(m.group(1))
+        row.update(finished=finished, failed=clients - finished,
+                   resp_p50_ms=float(m.group(2)),
+                   resp_p90_ms=float(m.group(3)),
+                   resp_p99_ms=float(m.group(4)),
+                   resp_max_ms=float(m.group(5)))
+    if not alive:
+        print('    {0}-server exited during the run'.format(name))
+    return row, sampler
+
+
+def make_sources(srcdir, size, clients):
+    """system的客户端各发送一个自己的文件，文件名不同，避免被当作同一次续传"""
+    names = []
+    block = os.urandom(min(size, 1024 * 1024))
+    for i in range(clients):
+        name = 'm{0}-{1}'.format(size_label(size), i)
+        path = os.path.join(srcdir, name)
+        if not os.path.exists(path) or os.path.getsize(path) != size:
+            with open(path, 'wb') as f:
+                left = size
+                while left > 0:
+                    f.write(block[:left])
+                    left -= len(block)
+        names.append(name)
+    return names
+
+
+def run_system(size, clients, args, workdir, srcdir):
+    """system：同时启动clients个client-test/client进程，每个上传一个文件，
+    以进程从启动到收到Server确认后退出的时间作为响应时间"""
+    names = make_sources(srcdir, size, clients)
+    server = start_server([os.path.join(SYSTEM_DIR, 'server')] +
+                          args.system_args + [str(SYSTEM_PORT)],
+                          workdir, SYSTEM_PORT)
+    sampler = Sampler(server.pid, args.interval)
+    sampler.start()
+    client = os.path.join(SYSTEM_DIR, 'client-test', 'client')
+    start = time.time()
+    procs = [(subprocess.Popen([client, n], cwd=srcdir,
+                               stdout=subprocess.DEVNULL,
+                               stderr=subprocess.DEVNULL), n)
+             for n in names]
+    times = []
+    failed = 0
+    deadline = start + args.timeout
+    pending = list(procs)
+    while pending and time.time() < deadline:
+        for p in list(pending):
+            ret = p[0].poll()
+            if ret is not None:
+                pending.remove(p)
+                if ret == 0:
+                    times.append((time.time() - start) * 1e3)
+                else:
+                    failed += 1
+        time.sleep(0.005)
+    for p in pending:
+        p[0].kill()
+        p[0].wait()
+        failed += 1
+    sampler.stop()
+    stop_server(server)
+
+    row = {'finished': len(times), 'failed': failed}
+    if times:
+        row.update(resp_p50_ms=quantile(times, 0.5),
+                   resp_p90_ms=quantile(times, 0.9),
+                   resp_p99_ms=quantile(times, 0.99),
+                   resp_max_ms=max(times))
+    return row, sampler
+
+
+def plot(rows, outdir):
+    try:
+        import matplotlib
+        matplotlib.use('Agg')
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print('matplotlib not installed, skipping plots')
+        return
+    metrics = [('resp_max_ms', 'response time (ms)', 'time'),
+               ('cpu_avg_pct', 'server cpu (%)', 'cpu-use'),
+               ('write_avg_mbps', 'disk write (MB/s)', 'io-use')]
+    for size in sorted(set(r['payload_bytes'] for r in rows)):
+        for key, label, suffix in metrics:
+            plt.figure(figsize=(6, 4))
+            for server in sorted(set(r['server'] for r in rows)):
+                pts = sorted((r['clients'], r[key]) for r in rows
+                             if r['server'] == server and
+                             r['payload_bytes'] == size and r[key] != '')
+                if pts:
+                    plt.plot([p[0] for p in pts], [p[1] for p in pts],
+                             marker='o', label=server)
+            plt.xlabel('clients')
+            plt.ylabel(label)
+            plt.title('{0} per client'.format(size_label(size)))
+            plt.legend()
+            plt.grid(True, alpha=0.3)
+            path = os.path.join(outdir, '{0}-{1}.png'.format(
+                size_label(size), suffix))
+            plt.savefig(path, dpi=100, bbox_inches='tight')
+            plt.close()
+            print('wrote', path)
+
+
+def main():
+    argparser = argparse.ArgumentParser('Benchmark matrix')
+    argparser.add_argument('-s', '--sizes', default='200K,4M',
+                           help='Payload sizes per client (default 200K,4M)')
+    argparser.add_argument('-c', '--clients', default='10,20,50,100,200,400',
+                           help='Client counts')
+    argparser.add_argument('--servers',
+                           default=','.join(MODULE_SERVERS + ['system']),
+                           help='Servers to run')
+    argparser.add_argument('-o', '--out', default='bench-results',
+                           help='Output directory for CSV and plots')
+    argparser.add_argument('-i', '--interval', type=float, default=0.1,
+                           help='/proc sampling interval in seconds')
+    argparser.add_argument('-t', '--threads', type=int, default=1,
+                           help='loadgen threads')
+    argparser.add_argument('--timeout', type=float, default=600,
+                           help='Per-run timeout in seconds')
+    argparser.add_argument('--system-args', default='',
+                           help='Extra options for code/system/server')
+    args = argparser.parse_args()
+    sizes = [parse_size(s) for s in args.sizes.split(',')]
+    clients = [int(c) for c in args.clients.split(',')]
+    servers = args.servers.split(',')
+    args.system_args = args.system_args.split()
+
+    for s in servers:
+        exe = (os.path.join(SYSTEM_DIR, 'server') if s == 'system' else
+               os.path.join(MODULE_DIR, s + '-server'))
+        if s not in MODULE_SERVERS + ['system'] or not os.path.exists(exe):
+            sys.exit('unknown or unbuilt server: ' + s)
+
+    os.makedirs(args.out, exist_ok=True)
+    summary_path = os.path.join(args.out, 'summary.csv')
+    samples_path = os.path.join(args.out, 'samples.csv')
+    rows = []
+    srcdir = tempfile.mkdtemp(prefix='bench-src-')
+    with open(summary_path, 'w', newline='') as sf, \
+            open(samples_path, 'w', newline='') as tf:
+        summary = csv.DictWriter(sf, SUMMARY_FIELDS)
+        summary.writeheader()
+        samples = csv.writer(tf)
+        samples.writerow(SAMPLE_FIELDS)
+        for server in servers:
+            for size in sizes:
+                for n in clients:
+                    print('{0}: {1} x {2} clients'.format(
+                        server, size_label(size), n))
+                    # 服务器在自己的临时目录中写文件，每次运行后删除
+                    workdir = tempfile.mkdtemp(prefix='bench-' + server + '-')
+                    start = time.time()
+                    try:
+                        if server == 'system':
+                            row, sampler = run_system(size, n, args, workdir,
+                                                      srcdir)
+                        else:
+                            row, sampler = run_module(server, size, n, args,
+                                                      workdir)
+                    finally:
+                        shutil.rmtree(workdir, ignore_errors=True)
+                    elapsed = time.time() - start
+                    row.update(sampler.summary())
+                    row.update(server=server, payload_bytes=size, clients=n,
+                               elapsed_s=round(elapsed, 3))
+                    if row.get('resp_max_ms'):
+                        row['throughput_mbps'] = round(
+                            row['finished'] * size / row['resp_max_ms'] / 1e3,
+                            2)
+                    for k in ('resp_p50_ms', 'resp_p90_ms', 'resp_p99_ms',
+                              'resp_max_ms'):
+                        if k in row:
+                            row[k] = round(row[k], 1)
+                    full = dict((k, row.get(k, '')) for k in SUMMARY_FIELDS)
+                    summary.writerow(full)
+                    sf.flush()
+                    for t, c, w in sampler.samples:
+                        samples.writerow([server, size, n, round(t, 3),
+                                          round(c, 1), round(w, 2)])
+                    rows.append(full)
+                    print('    {0}/{1} finished, max {2} ms, cpu avg {3}%, '
+                          'write avg {4} MB/s'.format(
+                              row['finished'], n, full['resp_max_ms'],
+                              full['cpu_avg_pct'], full['write_avg_mbps']))
+    shutil.rmtree(srcdir, ignore_errors=True)
+    print('wrote', summary_path, 'and', samples_path)
+    plot(rows, args.out)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,10 +1,17 @@
 //I/O多路复用技术（事件驱动编程）：epoll服务器
+//每个reactor线程独占一个epoll实例和一个SO_REUSEPORT监听socket
+//-e 选项使用边缘触发：每个连接只注册一次，读写直到EAGAIN
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
@@ -13,31 +20,51 @@
 
 #include "utils.h"
 
-//监听的fd数量上限
+//epoll_wait一次最多返回的事件数量
 #define MAXFDS 16 * 1024
 
-//协议状态机
-typedef enum
-{
-  INITIAL_ACK,
-  WAIT_FOR_MSG,
-  IN_MSG
-} ProcessingState;
-
-#define SENDBUF_SIZE 1024
+//一次recv的大小
+#define RECVBUF_SIZE 1024
+//边缘触发模式下一次recv的最大长度，读到EAGAIN前尽量少调用recv
+#define ET_RECVBUF_SIZE (64 * 1024)
+//回显缓冲区的初始大小和默认容量上限
+#define ECHOBUF_INIT 1024
+#define ECHOBUF_MAX (256 * 1024)
 
+//连接状态，由接受该连接的reactor分配，只有这个reactor会访问它
 typedef struct
 {
+  int sockfd;
   //协议状态机
   ProcessingState state;
-  // sendbuf中存放了客户端发送给服务器的信息
-  uint8_t sendbuf[SENDBUF_SIZE];
-  int sendbuf_end;
-  int sendptr;
+  // sendbuf中存放了待回复给客户端的信息
+  ringbuf_t sendbuf;
+  //对端已关闭（recv返回0）：不再读取，sendbuf发完后关闭
+  bool eof;
+  //水平触发模式下当前在epoll中注册的事件
+  uint32_t events;
+  //边缘触发模式下，在用户态记录socket是否可读/可写（直到遇到EAGAIN为止）
+  bool readable;
+  bool writable;
+  //该连接的输出文件，连接建立时打开，断开时关闭
+  file_writer_t writer;
 } peer_state_t;
 
-//连接状态
-peer_state_t global_state[MAXFDS];
+//是否使用边缘触发模式
+bool edge_triggered = false;
+//输出文件的刷新策略
+flush_policy_t flush_policy = FLUSH_BUFFERED;
+//回显缓冲区的容量上限，待发送数据超过高水位（上限减去一次recv的大小）时暂停读取
+size_t echobuf_max = ECHOBUF_MAX;
+
+//reactor：一个线程、一个epoll实例、一个监听socket
+typedef struct
+{
+  int id;
+  int epollfd;
+  int listener_sockfd;
+  pthread_t thread;
+} reactor_t;
 
 //当want_read是true时，说明fd待读取
 //当want_write是true时，说明fd待写入
@@ -54,46 +81,63 @@ const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
 const fd_status_t fd_status_RW = {.want_read = true, .want_write = true};
 const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
 
-fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in *peer_addr,
+fd_status_t on_peer_connected(peer_state_t *peerstate,
+                              const struct sockaddr_in *peer_addr,
                               socklen_t peer_addr_len)
 {
-  assert(sockfd < MAXFDS);
   report_peer_connected(peer_addr, peer_addr_len);
 
   // 初始化fd的状态
-  peer_state_t *peerstate = &global_state[sockfd];
   peerstate->state = INITIAL_ACK;
-  peerstate->sendbuf[0] = '*';
-  peerstate->sendptr = 0;
-  peerstate->sendbuf_end = 1;
+  ringbuf_init(&peerstate->sendbuf, ECHOBUF_INIT, echobuf_max);
+  ringbuf_push(&peerstate->sendbuf, (const uint8_t *)"*", 1);
+  peerstate->eof = false;
+  peerstate->events = 0;
+  peerstate->readable = false;
+  peerstate->writable = false;
+
+  //打开该连接的输出文件，之后每次recv只追加数据
+  char filename[20];
+  sprintf(filename, "%s%d", "client", peerstate->sockfd);
+  writer_open(&peerstate->writer, filename, O_APPEND, flush_policy);
 
   return fd_status_W;
 }
 
-fd_status_t on_peer_ready_recv(int sockfd)
+//待发送数据低于高水位时继续读取，有待发送数据时等待可写
+fd_status_t peer_status(const peer_state_t *peerstate)
 {
-  assert(sockfd < MAXFDS);
-  peer_state_t *peerstate = &global_state[sockfd];
+  size_t pending = peerstate->sendbuf.len;
+  return (fd_status_t){.want_read = !peerstate->eof &&
+                                    peerstate->state != INITIAL_ACK &&
+                                    pending + RECVBUF_SIZE <= echobuf_max,
+                       .want_write = pending > 0};
+}
 
-  if (peerstate->state == INITIAL_ACK ||
-      peerstate->sendptr < peerstate->sendbuf_end)
-  {
-    //若状态为刚初始化，则没有可以接收的，直接返回
-    return fd_status_W;
-  }
+//用buf接收一次至多size字节的数据并处理，返回值大于0为接收的字节数，0为对端关闭，-1为EAGAIN
+//对端关闭后不再读取，还有待回显的数据时继续发送，发完后peer_status()返回两者都不需要
+int peer_recv(peer_state_t *peerstate, uint8_t *buf, size_t size)
+{
+  int sockfd = peerstate->sockfd;
 
-  uint8_t buf[1024];
-  int nbytes = recv(sockfd, buf, sizeof buf, 0);
+  int nbytes = recv(sockfd, buf, size, 0);
   if (nbytes == 0)
   {
-    //若没有可以接收的数据，则返回
-    return fd_status_NORW;
+    peerstate->eof = true;
+    return 0;
   }
   else if (nbytes < 0)
   {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
     {
-      return fd_status_R;
+      return -1;
+    }
+    else if (errno == ECONNRESET)
+    {
+      //对端已重置连接，待回显的数据无法送达
+      ringbuf_consume(&peerstate->sendbuf, peerstate->sendbuf.len);
+      peerstate->eof = true;
+      return 0;
     }
     else
     {
@@ -101,126 +145,249 @@ fd_status_t on_peer_ready_recv(int sockfd)
     }
   }
   //接受客户端发送的数据，并写入服务器端文件中
-  bool ready_to_send = false;
-  char filename[20] = "client";
-  sprintf(filename, "%s%d", "client", sockfd);
-  FILE *fp = fopen(filename, "a+");
-  //循环遍历客户端发送的文件的所有数据
-  for (int i = 0; i < nbytes; ++i)
-  {
-    //根据协议状态机执行操作
-    switch (peerstate->state)
+  //按协议状态机取出^与$之间的每一段数据
+  assert(peerstate->state != INITIAL_ACK);
+  const uint8_t *pos = buf, *span;
+  size_t len;
+  while ((len = frame_next(&peerstate->state, &pos, buf + nbytes, &span)) > 0)
+  {
+    //整段追加到输出文件
+    writer_append(&peerstate->writer, span, len);
+    //回复的数据放入回显缓冲区，只在低于高水位时读取，所以不会超过上限
+    if (ringbuf_reserve(&peerstate->sendbuf, len) < 0)
     {
-    case INITIAL_ACK:
-      assert(0 && "can't reach here");
-      break;
-    //若是等待信息且收到^，则开始接收信息
-    case WAIT_FOR_MSG:
-      if (buf[i] == '^')
-      {
-        peerstate->state = IN_MSG;
-      }
-      break;
-    //若在接收信息而收到了$，则停止接受信息
-    case IN_MSG:
-      if (buf[i] == '$')
-      {
-        peerstate->state = WAIT_FOR_MSG;
-      }
-      //否则，写入文件，用标准I/O
-      else
+      die("socket %d: echo buffer overflow", sockfd);
+    }
+    while (len > 0)
+    {
+      uint8_t *p;
+      size_t n = ringbuf_tail(&peerstate->sendbuf, &p);
+      if (n > len)
       {
-        assert(peerstate->sendbuf_end < SENDBUF_SIZE);
-        fputc(buf[i], fp);
-        peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] + 1;
-        ready_to_send = true;
+        n = len;
       }
-      break;
+      echo_transform(p, span, n);
+      ringbuf_commit(&peerstate->sendbuf, n);
+      span += n;
+      len -= n;
     }
   }
-  fclose(fp);
-  // Report reading readiness iff there's nothing to send to the peer as a
-  // result of the latest recv.
-  return (fd_status_t){.want_read = !ready_to_send,
-                       .want_write = ready_to_send};
+  return nbytes;
 }
 
-fd_status_t on_peer_ready_send(int sockfd)
+//用一次writev发送sendbuf中的数据，返回值为剩余未发送的字节数，-1为EAGAIN
+int peer_send(peer_state_t *peerstate)
 {
-  assert(sockfd < MAXFDS);
-  peer_state_t *peerstate = &global_state[sockfd];
+  int sockfd = peerstate->sockfd;
 
-  if (peerstate->sendptr >= peerstate->sendbuf_end)
-  {
-    // 没东西等待发送，直接返回
-    return fd_status_RW;
-  }
   //回复客户端
-  int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
-  int nsent = send(sockfd, &peerstate->sendbuf[peerstate->sendptr], sendlen, 0);
+  struct iovec iov[2];
+  int iovcnt = ringbuf_peek(&peerstate->sendbuf, iov);
+  ssize_t nsent = writev(sockfd, iov, iovcnt);
   if (nsent == -1)
   {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
     {
-      return fd_status_W;
+      return -1;
+    }
+    else if (errno == EPIPE || errno == ECONNRESET)
+    {
+      //对端已完全关闭，丢弃待回显的数据
+      ringbuf_consume(&peerstate->sendbuf, peerstate->sendbuf.len);
+      peerstate->eof = true;
+      return 0;
     }
     else
     {
       perror_die("send");
     }
   }
-  if (nsent < sendlen)
+  ringbuf_consume(&peerstate->sendbuf, nsent);
+  if (peerstate->sendbuf.len > 0)
   {
-    peerstate->sendptr += nsent;
-    return fd_status_W;
+    return peerstate->sendbuf.len;
   }
-  else
+
+  // 成功发送，初始的*发送完后开始接收消息
+  if (peerstate->state == INITIAL_ACK)
   {
-    // 成功发送，则重置状态值
-    peerstate->sendptr = 0;
-    peerstate->sendbuf_end = 0;
+    peerstate->state = WAIT_FOR_MSG;
+  }
+  return 0;
+}
 
-    if (peerstate->state == INITIAL_ACK)
-    {
-      peerstate->state = WAIT_FOR_MSG;
-    }
+fd_status_t on_peer_ready_recv(peer_state_t *peerstate)
+{
+  fd_status_t status = peer_status(peerstate);
+  if (!status.want_read)
+  {
+    //若状态为刚初始化或待发送数据已超过高水位，则暂不接收
+    return status;
+  }
+
+  uint8_t buf[RECVBUF_SIZE];
+  peer_recv(peerstate, buf, sizeof buf);
+  return peer_status(peerstate);
+}
 
-    return fd_status_R;
+fd_status_t on_peer_ready_send(peer_state_t *peerstate)
+{
+  if (peerstate->sendbuf.len > 0)
+  {
+    peer_send(peerstate);
   }
+  return peer_status(peerstate);
 }
 
-int main(int argc, const char **argv)
+//边缘触发模式：先接收到EAGAIN或高水位，再把积累的回显批量写到写完或EAGAIN，
+//腾出空间后继续接收，直到读遇到EAGAIN，或者写遇到EAGAIN且待发送数据超过高水位
+//返回值只用于判断连接是否应该关闭，监听的事件不需要修改
+fd_status_t on_peer_ready_et(peer_state_t *peerstate, uint32_t events)
 {
-  setvbuf(stdout, NULL, _IONBF, 0);
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+  {
+    peerstate->readable = true;
+  }
+  if (events & EPOLLOUT)
+  {
+    peerstate->writable = true;
+  }
 
-  //默认在9090端口监听
-  int portnum = 9090;
-  if (argc >= 2)
+  uint8_t buf[ET_RECVBUF_SIZE];
+  while (1)
   {
-    portnum = atoi(argv[1]);
+    //每次recv不超过回显缓冲区的剩余容量，回显的数据不会超过上限
+    while (peerstate->readable && peer_status(peerstate).want_read)
+    {
+      size_t room = echobuf_max - peerstate->sendbuf.len;
+      //对端关闭后peer_status()不再要求读取，继续把积累的回显写完
+      if (peer_recv(peerstate, buf, room < sizeof buf ? room : sizeof buf) <= 0)
+      {
+        peerstate->readable = false;
+      }
+    }
+    //部分写入时继续写，只有EAGAIN才说明发送缓冲区已满，等待下一次EPOLLOUT
+    while (peerstate->sendbuf.len > 0 && peerstate->writable)
+    {
+      if (peer_send(peerstate) < 0)
+      {
+        peerstate->writable = false;
+      }
+    }
+    if (!peerstate->readable || !peer_status(peerstate).want_read)
+    {
+      break;
+    }
   }
-  printf("Serving on port %d\n", portnum);
 
-  //初始化socket，绑定并监听
-  int listener_sockfd = listen_inet_socket(portnum);
+  return peer_status(peerstate);
+}
 
-  //epoll函数可能返回不可读的fd，因此设置nonblock模式可以避免永远阻塞
-  make_socket_non_blocking(listener_sockfd);
+//关闭连接，释放连接状态
+void reactor_close(reactor_t *reactor, peer_state_t *peerstate)
+{
+  int fd = peerstate->sockfd;
+  printf("socket %d closing\n", fd);
+  if (epoll_ctl(reactor->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+  {
+    perror_die("epoll_ctl EPOLL_CTL_DEL");
+  }
+  close(fd);
+  writer_close(&peerstate->writer);
+  ringbuf_free(&peerstate->sendbuf);
+  free(peerstate);
+}
 
-  int epollfd = epoll_create1(0);
-  if (epollfd < 0)
+//根据fd最新的状态修改epoll监听的事件，两者都不需要时关闭连接
+void reactor_update(reactor_t *reactor, peer_state_t *peerstate,
+                    fd_status_t status)
+{
+  int fd = peerstate->sockfd;
+  struct epoll_event event = {0};
+  event.data.ptr = peerstate;
+  //若fd等待读取，则监听EPOLLIN事件
+  if (status.want_read)
   {
-    perror_die("epoll_create1");
+    event.events |= EPOLLIN;
+  }
+  //若fd等待写入，则监听EPOLLOUT事件
+  if (status.want_write)
+  {
+    event.events |= EPOLLOUT;
+  }
+  //若已完成，则关闭描述符并释放连接状态
+  if (event.events == 0)
+  {
+    reactor_close(reactor, peerstate);
+  }
+  //监听的事件没有变化时不需要epoll_ctl
+  else if (event.events != peerstate->events)
+  {
+    if (epoll_ctl(reactor->epollfd, EPOLL_CTL_MOD, fd, &event) < 0)
+    {
+      perror_die("epoll_ctl EPOLL_CTL_MOD");
+    }
+    peerstate->events = event.events;
   }
+}
 
-  //设置epoll等待的事件，最初时只有监听描述符
-  struct epoll_event accept_event;
-  accept_event.data.fd = listener_sockfd;
-  accept_event.events = EPOLLIN;
-  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listener_sockfd, &accept_event) < 0)
+//监听描述符已经准备好，则说明有客户端发送请求
+void reactor_accept(reactor_t *reactor)
+{
+  struct sockaddr_in peer_addr;
+  socklen_t peer_addr_len = sizeof(peer_addr);
+  //使用accept函数接收客户端发送的请求
+  int newsockfd = accept(reactor->listener_sockfd,
+                         (struct sockaddr *)&peer_addr, &peer_addr_len);
+  if (newsockfd < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      printf("accept returned EAGAIN or EWOULDBLOCK\n");
+    }
+    else
+    {
+      perror_die("accept");
+    }
+    return;
+  }
+
+  //设置fd为非阻塞模式，防止永久阻塞
+  make_socket_non_blocking(newsockfd);
+
+  //初始化fd的服务器内部状态，该状态归本reactor所有
+  peer_state_t *peerstate = xmalloc(sizeof(*peerstate));
+  peerstate->sockfd = newsockfd;
+  fd_status_t status = on_peer_connected(peerstate, &peer_addr, peer_addr_len);
+  struct epoll_event event = {0};
+  //将新的fd加入epoll监听的event集合
+  event.data.ptr = peerstate;
+  //若fd等待读取，则监听EPOLLIN事件
+  if (status.want_read)
+  {
+    event.events |= EPOLLIN;
+  }
+  //若fd等待写入，则监听EPOLLOUT事件
+  if (status.want_write)
+  {
+    event.events |= EPOLLOUT;
+  }
+  //边缘触发模式下读写事件一次性全部注册，之后不再修改
+  if (edge_triggered)
+  {
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  }
+  if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, newsockfd, &event) < 0)
   {
     perror_die("epoll_ctl EPOLL_CTL_ADD");
   }
+  peerstate->events = event.events;
+}
+
+//reactor线程：独立运行一个完整的事件循环
+void *reactor_run(void *arg)
+{
+  reactor_t *reactor = (reactor_t *)arg;
 
   //分配一个就绪事件缓冲区，以便于传递给epoll进行修改
   struct epoll_event *events = calloc(MAXFDS, sizeof(struct epoll_event));
@@ -233,143 +400,176 @@ int main(int argc, const char **argv)
   while (1)
   {
     //使用epoll_wait等待至少有一个事件准备好
-    int nready = epoll_wait(epollfd, events, MAXFDS, -1);
+    int nready = epoll_wait(reactor->epollfd, events, MAXFDS, -1);
+    if (nready < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror_die("epoll_wait");
+    }
     //遍历所有准备好的事件，准备好的事件数量为nready，存放在之前分配的event中
     for (int i = 0; i < nready; i++)
     {
-      if (events[i].events & EPOLLERR)
+      //监听描述符的data.ptr为NULL
+      peer_state_t *peerstate = events[i].data.ptr;
+      //连接上的错误由之后的recv、writev返回，关闭该连接
+      if ((events[i].events & EPOLLERR) && peerstate == NULL)
       {
         perror_die("epoll_wait returned EPOLLERR");
       }
-
-      //监听描述符已经准备好，则说明有客户端发送请求
-      if (events[i].data.fd == listener_sockfd)
+      if (peerstate == NULL)
       {
-        struct sockaddr_in peer_addr;
-        socklen_t peer_addr_len = sizeof(peer_addr);
-        //使用accept函数接收客户端发送的请求
-        int newsockfd = accept(listener_sockfd, (struct sockaddr *)&peer_addr,
-                               &peer_addr_len);
-        if (newsockfd < 0)
-        {
-          if (errno == EAGAIN || errno == EWOULDBLOCK)
-          {
-            printf("accept returned EAGAIN or EWOULDBLOCK\n");
-          }
-          else
-          {
-            perror_die("accept");
-          }
-        }
-        else
+        reactor_accept(reactor);
+      }
+      //边缘触发模式：一次处理完读写，只有连接结束时才需要epoll_ctl
+      else if (edge_triggered)
+      {
+        fd_status_t status = on_peer_ready_et(peerstate, events[i].events);
+        if (!status.want_read && !status.want_write)
         {
-          //设置fd为非阻塞模式，防止永久阻塞
-          make_socket_non_blocking(newsockfd);
-          if (newsockfd >= MAXFDS)
-          {
-            die("socket fd (%d) >= MAXFDS (%d)", newsockfd, MAXFDS);
-          }
-
-          //初始化fd的服务器内部状态
-          fd_status_t status =
-              on_peer_connected(newsockfd, &peer_addr, peer_addr_len);
-          struct epoll_event event = {0};
-          //将新的fd加入epoll监听的event集合
-          event.data.fd = newsockfd;
-          //若fd等待读取，则监听EPOLLIN事件
-          if (status.want_read)
-          {
-            event.events |= EPOLLIN;
-          }
-          //若fd等待写入，则监听EPOLLOUT事件
-          if (status.want_write)
-          {
-            event.events |= EPOLLOUT;
-          }
-          //将新的fd加入epoll监听的event集合
-          if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &event) < 0)
-          {
-            perror_die("epoll_ctl EPOLL_CTL_ADD");
-          }
+          reactor_close(reactor, peerstate);
         }
       }
-      //如果不是监听描述符已经准备好，而是其他描述符准备好
       else
       {
-        //如果是读取准备好
-        if (events[i].events & EPOLLIN)
+        fd_status_t status = peer_status(peerstate);
+        //如果是读取准备好，接收信息，设置并获得fd最新的状态（待读取/待写入等）
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
         {
-          //获得描述符
-          int fd = events[i].data.fd;
-          //接收信息，设置并获得fd最新的状态（待读取/待写入等）
-          fd_status_t status = on_peer_ready_recv(fd);
-          //重置event中的监听内容
-          struct epoll_event event = {0};
-          event.data.fd = fd;
-          //若fd等待读取，则监听EPOLLIN事件
-          if (status.want_read)
-          {
-            event.events |= EPOLLIN;
-          }
-          //若fd等待写入，则监听EPOLLOUT事件
-          if (status.want_write)
-          {
-            event.events |= EPOLLOUT;
-          }
-          //若已完成，则关闭描述符
-          if (event.events == 0)
-          {
-            printf("socket %d closing\n", fd);
-            if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0)
-            {
-              perror_die("epoll_ctl EPOLL_CTL_DEL");
-            }
-            close(fd);
-          }
-          else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0)
-          {
-            perror_die("epoll_ctl EPOLL_CTL_MOD");
-          }
+          status = on_peer_ready_recv(peerstate);
         }
-        //如果是写入准备好
-        else if (events[i].events & EPOLLOUT)
+        //如果是写入准备好，或者刚收到需要回复的数据，则在同一轮循环中直接发送
+        if ((status.want_read || status.want_write) &&
+            ((events[i].events & EPOLLOUT) || status.want_write))
         {
-          //获得描述符
-          int fd = events[i].data.fd;
-          //发送信息，设置并获得fd最新的状态（待读取/待写入等）
-          fd_status_t status = on_peer_ready_send(fd);
-          //重置event中的监听内容
-          struct epoll_event event = {0};
-          event.data.fd = fd;
-
-          //若fd等待读取，则监听EPOLLIN事件
-          if (status.want_read)
-          {
-            event.events |= EPOLLIN;
-          }
-          //若fd等待写入，则监听EPOLLOUT事件
-          if (status.want_write)
-          {
-            event.events |= EPOLLOUT;
-          }
-          //若已完成，则关闭描述符
-          if (event.events == 0)
-          {
-            printf("socket %d closing\n", fd);
-            if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0)
-            {
-              perror_die("epoll_ctl EPOLL_CTL_DEL");
-            }
-            close(fd);
-          }
-          else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0)
-          {
-            perror_die("epoll_ctl EPOLL_CTL_MOD");
-          }
+          status = on_peer_ready_send(peerstate);
         }
+        reactor_update(reactor, peerstate, status);
       }
     }
   }
 
+  return NULL;
+}
+
+//初始化一个reactor：独立的监听socket和epoll实例
+void reactor_init(reactor_t *reactor, int id, int portnum)
+{
+  reactor->id = id;
+
+  //所有reactor的监听socket都绑定同一端口，由内核做负载均衡
+  reactor->listener_sockfd = listen_inet_socket_reuseport(portnum);
+
+  //epoll函数可能返回不可读的fd，因此设置nonblock模式可以避免永远阻塞
+  make_socket_non_blocking(reactor->listener_sockfd);
+
+  reactor->epollfd = epoll_create1(0);
+  if (reactor->epollfd < 0)
+  {
+    perror_die("epoll_create1");
+  }
+
+  //设置epoll等待的事件，最初时只有监听描述符
+  struct epoll_event accept_event;
+  accept_event.data.ptr = NULL;
+  accept_event.events = EPOLLIN;
+  if (epoll_ctl(reactor->epollfd, EPOLL_CTL_ADD, reactor->listener_sockfd,
+                &accept_event) < 0)
+  {
+    perror_die("epoll_ctl EPOLL_CTL_ADD");
+  }
+}
+
+//将reactor线程绑定到一个核上，避免线程在核之间迁移
+void reactor_pin(reactor_t *reactor, int ncpus)
+{
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(reactor->id % ncpus, &cpuset);
+  pthread_setaffinity_np(reactor->thread, sizeof(cpuset), &cpuset);
+}
+
+int main(int argc, char **argv)
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  //对端关闭后继续回显时writev返回EPIPE，不能被SIGPIPE终止
+  signal(SIGPIPE, SIG_IGN);
+
+  //reactor数量，默认与核数相同
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nreactors = ncpus > 0 ? ncpus : 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:ef:n:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      echobuf_max = strtoul(optarg, NULL, 10);
+      break;
+    case 'e':
+      edge_triggered = true;
+      break;
+    case 'f':
+      flush_policy = flush_policy_parse(optarg);
+      break;
+    case 'n':
+      nreactors = atoi(optarg);
+      break;
+    default:
+      die("usage: %s [-b echobuf-max] [-e] [-f buffered|write|sync] "
+          "[-n reactors] [port]",
+          argv[0]);
+    }
+  }
+  if (echobuf_max < 2 * RECVBUF_SIZE)
+  {
+    die("echo buffer cap must be at least %d bytes", 2 * RECVBUF_SIZE);
+  }
+  if (nreactors < 1)
+  {
+    die("reactor count must be positive");
+  }
+
+  //默认在9090端口监听
+  int portnum = 9090;
+  if (optind < argc)
+  {
+    portnum = atoi(argv[optind]);
+  }
+  printf("Serving on port %d with %d reactor(s)%s\n", portnum, nreactors,
+         edge_triggered ? ", edge-triggered" : "");
+
+  //所有监听socket在启动任何线程之前创建好，保证端口已被完全占用
+  reactor_t *reactors = calloc(nreactors, sizeof(reactor_t));
+  if (reactors == NULL)
+  {
+    die("Unable to allocate memory for reactors");
+  }
+  for (int i = 0; i < nreactors; i++)
+  {
+    reactor_init(&reactors[i], i, portnum);
+  }
+
+  //reactor 0 在主线程上运行，其余的各自一个线程
+  reactors[0].thread = pthread_self();
+  for (int i = 1; i < nreactors; i++)
+  {
+    if (pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]) !=
+        0)
+    {
+      die("pthread_create failed");
+    }
+  }
+  if (nreactors > 1 && ncpus > 0)
+  {
+    for (int i = 0; i < nreactors; i++)
+    {
+      reactor_pin(&reactors[i], ncpus);
+    }
+  }
+  reactor_run(&reactors[0]);
+
   return 0;
 }
@@ -0,0 +1,879 @@
+// 负载生成器：用epoll维持大量并发连接，按simple-client.py的协议发送消息并记录每条消息的延迟
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+//每个连接最多排队的消息数，开环模式下超过时该消息记为overrun
+#define PENDING_MAX 128
+//一次recv/send的缓冲区大小
+#define IO_CHUNK (64 * 1024)
+//同时处于握手中的连接数上限，不超过服务器的监听队列（N_BACKLOG 64）
+//否则溢出监听队列的连接在客户端看来已建立，却永远等不到*
+#define CONNECT_INFLIGHT 64
+//测试开始前等待所有连接收到*的最长时间（秒）
+#define CONNECT_SECONDS 10
+//测试时间结束后等待未完成消息与0000/1111收尾的时间（秒）
+#define DRAIN_SECONDS 5
+#define MAX_EVENTS 256
+
+//延迟直方图：值小于HIST_SUB时逐纳秒计数，之后每个2的幂区间分为HIST_SUB/2格
+//相对误差不超过1/64，与HdrHistogram取两位有效数字的做法相同
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_MAX_BITS 40 //最大记录约1100秒
+#define HIST_LEN ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF)
+
+typedef struct
+{
+  uint64_t counts[HIST_LEN];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+} hist_t;
+
+//连接状态
+typedef enum
+{
+  CONN_IDLE,       //还没有发起连接
+  CONN_CONNECTING, //非阻塞connect尚未完成
+  CONN_HANDSHAKE,  //等待服务器发来的*
+  CONN_ACTIVE,     //收发消息
+  CONN_CLOSING,    //已发送^0000$，等待1111
+  CONN_DONE        //已关闭或出错
+} conn_state_t;
+
+typedef struct
+{
+  int fd;
+  conn_state_t state;
+  bool want_out;      //是否注册了EPOLLOUT
+  uint32_t unsent;    //还没有完整发出的消息数
+  size_t sendoff;     //当前消息已发出的字节数
+  size_t recvoff;     //当前回复已收到的字节数
+  uint32_t head;      //pending中最早的消息
+  uint32_t count;     //已排队但还没有收到完整回复的消息数
+  uint32_t total;     //已排队的消息总数
+  uint64_t pending[PENDING_MAX]; //每条消息的计划发送时间（纳秒）
+} conn_t;
+
+typedef struct
+{
+  int id;
+  pthread_t thread;
+  int epollfd;
+  int timerfd;
+  conn_t *conns;
+  int nconns;
+  uint8_t *rbuf;
+  int started;        //已发起连接的数量
+  int connecting;     //正在握手（还没有收到*）的连接数
+  int inflight_max;
+  bool stopping;      //测试时间已结束，不再发起新连接
+  double rate;        //本线程每秒发送的消息数，0为闭环
+  uint64_t next_send; //开环模式下一条消息的计划时间
+  uint64_t next_index;
+  hist_t hist;
+  hist_t client_hist; //-n时每个连接从开始到收完全部回复的时间
+  int closed;         //已关闭的连接数
+  uint64_t queued;    //测试时间内排队的消息数（scheduled）
+  uint64_t completed;
+  uint64_t overrun;
+  uint64_t bad_replies;
+  uint64_t ready;     //收到*的连接数
+  uint64_t failed;    //连接失败或被断开的连接数
+} worker_t;
+
+//命令行参数
+static struct addrinfo *target;
+static int nconns = 100;
+static int nthreads;
+static size_t payload = 64;
+static double rate;
+static int pipeline = 1;
+static double duration = 10;
+static int per_conn; //每个连接发送的消息数，0为不限
+
+//所有线程共用的只读数据：连续多条消息与对应的回复
+static uint8_t *msgbuf;
+static size_t msg_len; //一条消息的长度，payload加^与$
+static size_t msgbuf_len;
+static uint8_t *replybuf;
+static size_t replybuf_len;
+
+static uint64_t start_ns;
+static uint64_t stop_ns;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v)
+{
+  if (v < HIST_SUB)
+  {
+    return v;
+  }
+  if (v >= 1ull << HIST_MAX_BITS)
+  {
+    v = (1ull << HIST_MAX_BITS) - 1;
+  }
+  int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+  return shift * HIST_HALF + (v >> shift);
+}
+
+//下标对应区间内的最大值
+static uint64_t hist_value(int index)
+{
+  if (index < HIST_SUB)
+  {
+    return index;
+  }
+  int shift = index / HIST_HALF - 1;
+  return (((uint64_t)(index - shift * HIST_HALF) + 1) << shift) - 1;
+}
+
+static void hist_record(hist_t *h, uint64_t v)
+{
+  h->counts[hist_index(v)]++;
+  if (h->total == 0 || v < h->min)
+  {
+    h->min = v;
+  }
+  if (v > h->max)
+  {
+    h->max = v;
+  }
+  h->total++;
+}
+
+static void hist_merge(hist_t *dst, const hist_t *src)
+{
+  if (src->total == 0)
+  {
+    return;
+  }
+  for (int i = 0; i < HIST_LEN; ++i)
+  {
+    dst->counts[i] += src->counts[i];
+  }
+  if (dst->total == 0 || src->min < dst->min)
+  {
+    dst->min = src->min;
+  }
+  if (src->max > dst->max)
+  {
+    dst->max = src->max;
+  }
+  dst->total += src->total;
+}
+
+//分位数q（0-1）对应的值
+static uint64_t hist_quantile(const hist_t *h, double q)
+{
+  uint64_t rank = (uint64_t)(q * h->total);
+  if (rank >= h->total)
+  {
+    rank = h->total - 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_LEN; ++i)
+  {
+    seen += h->counts[i];
+    if (seen > rank)
+    {
+      uint64_t v = hist_value(i);
+      return v > h->max ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+//构造消息缓冲区：n条连续的^payload$，以及对应的回复（每个字节加1）
+static void build_buffers(void)
+{
+  msg_len = payload + 2;
+  size_t copies = IO_CHUNK / msg_len + 1;
+  msgbuf_len = copies * msg_len;
+  msgbuf = xmalloc(msgbuf_len);
+  //消息内容只用小写字母，不会出现^、$和0000
+  uint8_t *text = xmalloc(payload);
+  for (size_t i = 0; i < payload; ++i)
+  {
+    text[i] = 'a' + i % 26;
+  }
+  for (size_t i = 0; i < copies; ++i)
+  {
+    uint8_t *p = msgbuf + i * msg_len;
+    p[0] = '^';
+    memcpy(p + 1, text, payload);
+    p[msg_len - 1] = '$';
+  }
+
+  //一次recv最多IO_CHUNK字节，可能从回复的任意位置开始
+  copies = IO_CHUNK / payload + 2;
+  replybuf_len = copies * payload;
+  replybuf = xmalloc(replybuf_len);
+  for (size_t i = 0; i < replybuf_len; ++i)
+  {
+    replybuf[i] = text[i % payload] + 1;
+  }
+  free(text);
+}
+
+static void conn_events(worker_t *w, conn_t *c, bool out)
+{
+  struct epoll_event ev;
+  ev.data.ptr = c;
+  ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+  if (epoll_ctl(w->epollfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+  {
+    perror_die("epoll_ctl EPOLL_CTL_MOD");
+  }
+  c->want_out = out;
+}
+
+static void conn_close(worker_t *w, conn_t *c, bool failed)
+{
+  if (c->state == CONN_DONE)
+  {
+    return;
+  }
+  w->closed++;
+  if (c->state == CONN_IDLE)
+  {
+    c->state = CONN_DONE;
+    return;
+  }
+  if (c->state == CONN_CONNECTING || c->state == CONN_HANDSHAKE)
+  {
+    w->connecting--;
+  }
+  if (failed)
+  {
+    w->failed++;
+  }
+  else
+  {
+    //读完未读的数据再关闭，避免内核发送RST
+    while (recv(c->fd, w->rbuf, IO_CHUNK, MSG_DONTWAIT) > 0)
+    {
+    }
+  }
+  epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->state = CONN_DONE;
+}
+
+//在连接上排队一条消息，t为其计划发送时间
+static void conn_queue(worker_t *w, conn_t *c, uint64_t t)
+{
+  if (c->state == CONN_DONE || c->count == PENDING_MAX)
+  {
+    w->overrun++;
+    return;
+  }
+  c->pending[(c->head + c->count) % PENDING_MAX] = t;
+  c->count++;
+  c->total++;
+  c->unsent++;
+  w->queued++;
+}
+
+//闭环模式：排队下一条消息，-n条消息都已排队时不再发送
+static void conn_next(worker_t *w, conn_t *c, uint64_t t)
+{
+  if (per_conn == 0 || c->total < (uint32_t)per_conn)
+  {
+    conn_queue(w, c, t);
+  }
+}
+
+//发送^0000$，收到1111后关闭连接
+static void conn_shutdown(worker_t *w, conn_t *c)
+{
+  if (send(c->fd, "^0000$", 6, MSG_NOSIGNAL) != 6)
+  {
+    conn_close(w, c, true);
+    return;
+  }
+  c->state = CONN_CLOSING;
+  c->recvoff = 0;
+}
+
+//尽量发出排队的消息，发送缓冲区满时注册EPOLLOUT
+static void conn_flush(worker_t *w, conn_t *c)
+{
+  while (c->state == CONN_ACTIVE && c->unsent > 0)
+  {
+    size_t want = (size_t)c->unsent * msg_len - c->sendoff;
+    if (want > msgbuf_len - c->sendoff)
+    {
+      want = msgbuf_len - c->sendoff;
+    }
+    ssize_t n = send(c->fd, msgbuf + c->sendoff, want, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (!c->want_out)
+        {
+          conn_events(w, c, true);
+        }
+        return;
+      }
+      conn_close(w, c, true);
+      return;
+    }
+    c->sendoff += n;
+    c->unsent -= c->sendoff / msg_len;
+    c->sendoff %= msg_len;
+  }
+  if (c->want_out && c->state == CONN_ACTIVE)
+  {
+    conn_events(w, c, false);
+  }
+}
+
+//收到一段回复：校验内容，每收满payload字节完成一条消息
+static void conn_reply(worker_t *w, conn_t *c, const uint8_t *buf, size_t len,
+                       uint64_t now)
+{
+  if (c->count == 0 || memcmp(buf, replybuf + c->recvoff, len) != 0)
+  {
+    w->bad_replies++;
+    conn_close(w, c, true);
+    return;
+  }
+  c->recvoff += len;
+  while (c->recvoff >= payload && c->count > 0)
+  {
+    c->recvoff -= payload;
+    uint64_t t = c->pending[c->head];
+    c->head = (c->head + 1) % PENDING_MAX;
+    c->count--;
+    //只统计计划时间落在测试时间内的消息
+    if (t >= start_ns && t < stop_ns)
+    {
+      hist_record(&w->hist, now - t);
+      w->completed++;
+    }
+    //闭环模式：收到回复后立即发送下一条
+    if (rate == 0 && now < stop_ns)
+    {
+      conn_next(w, c, now);
+    }
+  }
+  if (c->recvoff > 0 && c->count == 0)
+  {
+    w->bad_replies++;
+    conn_close(w, c, true);
+    return;
+  }
+  //-n：全部消息完成，记录这个客户的用时后收尾
+  if (per_conn > 0 && c->count == 0 && c->total >= (uint32_t)per_conn)
+  {
+    hist_record(&w->client_hist, now - start_ns);
+    conn_shutdown(w, c);
+  }
+}
+
+static void conn_readable(worker_t *w, conn_t *c)
+{
+  while (c->state != CONN_DONE)
+  {
+    ssize_t n = recv(c->fd, w->rbuf, IO_CHUNK, 0);
+    uint64_t now = now_ns();
+    if (n < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        conn_close(w, c, true);
+      }
+      return;
+    }
+    if (n == 0)
+    {
+      conn_close(w, c, c->state != CONN_CLOSING);
+      return;
+    }
+
+    const uint8_t *p = w->rbuf;
+    if (c->state == CONN_HANDSHAKE)
+    {
+      if (p[0] != '*')
+      {
+        w->bad_replies++;
+        conn_close(w, c, true);
+        return;
+      }
+      c->state = CONN_ACTIVE;
+      w->connecting--;
+      w->ready++;
+      p++;
+      n--;
+      //测试开始后才就绪的连接（例如顺序服务器上排队的连接）在此开始闭环发送
+      if (rate == 0 && now >= start_ns && now < stop_ns)
+      {
+        for (int i = 0; i < pipeline; ++i)
+        {
+          conn_next(w, c, now);
+        }
+      }
+      conn_flush(w, c);
+    }
+    if (n == 0)
+    {
+      continue;
+    }
+    if (c->state == CONN_CLOSING)
+    {
+      //^0000$的回复为1111
+      for (ssize_t i = 0; i < n; ++i)
+      {
+        if (p[i] != '1')
+        {
+          w->bad_replies++;
+          conn_close(w, c, true);
+          return;
+        }
+      }
+      c->recvoff += n;
+      if (c->recvoff >= 4)
+      {
+        conn_close(w, c, false);
+      }
+      continue;
+    }
+    conn_reply(w, c, p, n, now);
+    conn_flush(w, c);
+  }
+}
+
+static void conn_writable(worker_t *w, conn_t *c)
+{
+  if (c->state == CONN_CONNECTING)
+  {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0)
+    {
+      conn_close(w, c, true);
+      return;
+    }
+    c->state = CONN_HANDSHAKE;
+    conn_events(w, c, false);
+    return;
+  }
+  conn_flush(w, c);
+}
+
+//发起非阻塞连接，保持最多inflight_max个连接在握手中
+static void worker_connect(worker_t *w)
+{
+  while (!w->stopping && w->started < w->nconns &&
+         w->connecting < w->inflight_max)
+  {
+    conn_t *c = &w->conns[w->started++];
+    if (c->state != CONN_IDLE)
+    {
+      continue;
+    }
+    c->fd = socket(target->ai_family, SOCK_STREAM, 0);
+    if (c->fd < 0)
+    {
+      perror_die("socket");
+    }
+    make_socket_non_blocking(c->fd);
+    if (connect(c->fd, target->ai_addr, target->ai_addrlen) < 0 &&
+        errno != EINPROGRESS)
+    {
+      close(c->fd);
+      c->state = CONN_DONE;
+      w->failed++;
+      continue;
+    }
+    c->state = CONN_CONNECTING;
+    w->connecting++;
+    struct epoll_event ev;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN | EPOLLOUT;
+    c->want_out = true;
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+    {
+      perror_die("epoll_ctl EPOLL_CTL_ADD");
+    }
+  }
+}
+
+//开环模式：把到期的消息轮流分给各个连接，并把定时器设到下一条消息的时间
+static void worker_schedule(worker_t *w, uint64_t now)
+{
+  while (w->next_send <= now && w->next_send < stop_ns)
+  {
+    conn_t *c = &w->conns[w->next_index % w->nconns];
+    conn_queue(w, c, w->next_send);
+    conn_flush(w, c);
+    w->next_index++;
+    w->next_send = start_ns + (uint64_t)(w->next_index * 1e9 / w->rate);
+  }
+  uint64_t next = w->next_send < stop_ns ? w->next_send : stop_ns;
+  struct itimerspec its = {0};
+  its.it_value.tv_sec = next / 1000000000ull;
+  its.it_value.tv_nsec = next % 1000000000ull;
+  timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+//测试时间结束后：还没有收到*的连接直接关闭，没有未完成消息的连接发送^0000$收尾
+static int worker_drain(worker_t *w)
+{
+  int open = 0;
+  for (int i = 0; i < w->nconns; ++i)
+  {
+    conn_t *c = &w->conns[i];
+    if (c->state == CONN_IDLE || c->state == CONN_CONNECTING ||
+        c->state == CONN_HANDSHAKE)
+    {
+      conn_close(w, c, false);
+    }
+    else if (c->state == CONN_ACTIVE && c->count == 0)
+    {
+      conn_shutdown(w, c);
+    }
+    if (c->state != CONN_DONE)
+    {
+      open++;
+    }
+  }
+  return open;
+}
+
+//处理一轮epoll事件，timeout为毫秒
+static void worker_poll(worker_t *w, int timeout)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int nready = epoll_wait(w->epollfd, events, MAX_EVENTS, timeout);
+  if (nready < 0 && errno != EINTR)
+  {
+    perror_die("epoll_wait");
+  }
+  for (int i = 0; i < nready; ++i)
+  {
+    conn_t *c = events[i].data.ptr;
+    if (c == NULL)
+    {
+      uint64_t expirations;
+      if (read(w->timerfd, &expirations, sizeof(expirations)) > 0 &&
+          w->rate > 0)
+      {
+        worker_schedule(w, now_ns());
+      }
+      continue;
+    }
+    if (events[i].events & EPOLLOUT)
+    {
+      conn_writable(w, c);
+    }
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+      if (c->state == CONN_CONNECTING)
+      {
+        conn_writable(w, c);
+      }
+      conn_readable(w, c);
+    }
+  }
+  worker_connect(w);
+}
+
+static void *worker_run(void *arg)
+{
+  worker_t *w = arg;
+  w->rbuf = xmalloc(IO_CHUNK);
+  w->epollfd = epoll_create1(0);
+  w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (w->epollfd < 0 || w->timerfd < 0)
+  {
+    perror_die("epoll_create1/timerfd_create");
+  }
+  struct epoll_event ev;
+  ev.data.ptr = NULL;
+  ev.events = EPOLLIN;
+  epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+
+  //建立连接并等待服务器的*，最多CONNECT_SECONDS秒，不计入测试时间
+  //-n时客户的用时包含建立连接，不等待
+  worker_connect(w);
+  uint64_t connect_end = now_ns() + CONNECT_SECONDS * 1000000000ull;
+  while (per_conn == 0 && w->ready + w->failed < (uint64_t)w->nconns &&
+         now_ns() < connect_end)
+  {
+    worker_poll(w, 100);
+  }
+  //所有线程的连接阶段结束后由主线程设置开始时间，再同时开始
+  pthread_barrier_wait(&start_barrier);
+  pthread_barrier_wait(&start_barrier);
+  w->next_send = start_ns;
+  w->next_index = 0;
+  if (w->rate > 0)
+  {
+    worker_schedule(w, now_ns());
+  }
+  else
+  {
+    for (int i = 0; i < w->nconns; ++i)
+    {
+      conn_t *c = &w->conns[i];
+      for (int j = 0; j < pipeline && c->state == CONN_ACTIVE; ++j)
+      {
+        conn_next(w, c, start_ns);
+      }
+      conn_flush(w, c);
+    }
+  }
+
+  uint64_t drain_end = stop_ns + DRAIN_SECONDS * 1000000000ull;
+  while (1)
+  {
+    uint64_t now = now_ns();
+    w->stopping = now >= stop_ns;
+    if (w->stopping && (worker_drain(w) == 0 || now >= drain_end))
+    {
+      break;
+    }
+    if (per_conn > 0 && w->closed == w->nconns)
+    {
+      break;
+    }
+    worker_poll(w, 100);
+  }
+
+  for (int i = 0; i < w->nconns; ++i)
+  {
+    conn_close(w, &w->conns[i], false);
+  }
+  close(w->timerfd);
+  close(w->epollfd);
+  free(w->rbuf);
+  return NULL;
+}
+
+//连接数多于文件描述符上限时提高软上限
+static void raise_nofile(int need)
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)need)
+  {
+    rl.rlim_cur = rl.rlim_max < (rlim_t)need ? rl.rlim_max : (rlim_t)need;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)need)
+    {
+      fprintf(stderr, "warning: open file limit %lu is below %d\n",
+              (unsigned long)rl.rlim_cur, need);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  nthreads = ncpus > 1 ? ncpus / 2 : 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:d:n:p:r:s:t:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      nconns = atoi(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'n':
+      per_conn = atoi(optarg);
+      break;
+    case 'p':
+      pipeline = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 's':
+      payload = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      die("usage: %s [-c connections] [-t threads] [-s payload-bytes] "
+          "[-r msgs-per-sec | -p pipeline] [-n msgs-per-conn] [-d seconds] "
+          "[host] [port]",
+          argv[0]);
+    }
+  }
+  if (nconns < 1 || payload < 1 || duration <= 0 || rate < 0 ||
+      pipeline < 1 || pipeline > PENDING_MAX || per_conn < 0)
+  {
+    die("invalid arguments");
+  }
+  if (per_conn > 0 && rate > 0)
+  {
+    die("-n only applies to the closed loop");
+  }
+  if (nthreads < 1)
+  {
+    nthreads = 1;
+  }
+  if (nthreads > nconns)
+  {
+    nthreads = nconns;
+  }
+
+  //默认连接本机9090端口
+  const char *host = optind < argc ? argv[optind] : "127.0.0.1";
+  const char *port = optind + 1 < argc ? argv[optind + 1] : "9090";
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host, port, &hints, &target);
+  if (err != 0)
+  {
+    die("getaddrinfo: %s", gai_strerror(err));
+  }
+
+  raise_nofile(nconns + nthreads * 2 + 16);
+  build_buffers();
+
+  if (rate > 0)
+  {
+    printf("target %s:%s, %d connections, %d threads, payload %zu bytes, "
+           "open loop %.0f msg/s, %.1f s\n",
+           host, port, nconns, nthreads, payload, rate, duration);
+  }
+  else
+  {
+    printf("target %s:%s, %d connections, %d threads, payload %zu bytes, "
+           "closed loop pipeline %d, %.1f s\n",
+           host, port, nconns, nthreads, payload, pipeline, duration);
+  }
+  if (per_conn > 0)
+  {
+    printf("each connection sends %d message(s), then closes\n", per_conn);
+  }
+
+  //连接按线程平均分配
+  worker_t *workers = calloc(nthreads, sizeof(worker_t));
+  conn_t *conns = calloc(nconns, sizeof(conn_t));
+  if (workers == NULL || conns == NULL)
+  {
+    die("Unable to allocate memory for connections");
+  }
+  pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+  int assigned = 0;
+  for (int i = 0; i < nthreads; ++i)
+  {
+    worker_t *w = &workers[i];
+    w->id = i;
+    w->nconns = nconns / nthreads + (i < nconns % nthreads);
+    w->conns = conns + assigned;
+    assigned += w->nconns;
+    w->rate = rate * w->nconns / nconns;
+    w->inflight_max = CONNECT_INFLIGHT / nthreads;
+    if (w->inflight_max < 1)
+    {
+      w->inflight_max = 1;
+    }
+    if (pthread_create(&w->thread, NULL, worker_run, w) != 0)
+    {
+      die("pthread_create failed");
+    }
+  }
+  double connect_start = now_ns() / 1e9;
+  pthread_barrier_wait(&start_barrier);
+  start_ns = now_ns();
+  stop_ns = start_ns + (uint64_t)(duration * 1e9);
+  double connect_time = start_ns / 1e9 - connect_start;
+  pthread_barrier_wait(&start_barrier);
+
+  hist_t *hist = calloc(1, sizeof(hist_t));
+  hist_t *client_hist = calloc(1, sizeof(hist_t));
+  uint64_t queued = 0, completed = 0, overrun = 0, bad = 0, ready = 0,
+           failed = 0;
+  for (int i = 0; i < nthreads; ++i)
+  {
+    worker_t *w = &workers[i];
+    pthread_join(w->thread, NULL);
+    hist_merge(hist, &w->hist);
+    hist_merge(client_hist, &w->client_hist);
+    queued += w->queued;
+    completed += w->completed;
+    overrun += w->overrun;
+    bad += w->bad_replies;
+    ready += w->ready;
+    failed += w->failed;
+  }
+
+  printf("connections: %llu ready, %llu failed, connect phase %.2f s\n",
+         (unsigned long long)ready, (unsigned long long)failed, connect_time);
+  printf("messages: %llu scheduled, %llu completed, %llu incomplete, %llu "
+         "overrun, %llu bad replies\n",
+         (unsigned long long)queued, (unsigned long long)completed,
+         (unsigned long long)(queued - completed), (unsigned long long)overrun,
+         (unsigned long long)bad);
+  //-n时以最后一个客户完成的时间计算吞吐量
+  double elapsed = duration;
+  if (per_conn > 0 && client_hist->total > 0)
+  {
+    elapsed = client_hist->max / 1e9;
+  }
+  printf("throughput: %.0f msg/s, %.2f MB/s\n", completed / elapsed,
+         completed * payload / elapsed / 1e6);
+  if (hist->total > 0)
+  {
+    printf("latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  "
+           "max %.1f\n",
+           hist->min / 1e3, hist_quantile(hist, 0.5) / 1e3,
+           hist_quantile(hist, 0.9) / 1e3, hist_quantile(hist, 0.99) / 1e3,
+           hist_quantile(hist, 0.999) / 1e3, hist->max / 1e3);
+  }
+  if (client_hist->total > 0)
+  {
+    printf("client time (ms): %llu finished  p50 %.1f  p90 %.1f  p99 %.1f  "
+           "max %.1f\n",
+           (unsigned long long)client_hist->total,
+           hist_quantile(client_hist, 0.5) / 1e6,
+           hist_quantile(client_hist, 0.9) / 1e6,
+           hist_quantile(client_hist, 0.99) / 1e6, client_hist->max / 1e6);
+  }
+
+  free(hist);
+  free(client_hist);
+  free(conns);
+  free(workers);
+  free(msgbuf);
+  free(replybuf);
+  freeaddrinfo(target);
+  return 0;
+}
@@ -1,10 +1,12 @@
 //I/O多路复用技术（事件驱动编程）：select服务器
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -14,31 +16,35 @@
 #include "utils.h"
 
 //select可以监听的fd数量上限就是1024,这也是我为什么要选用epoll的原因之一
-#define MAXFDS 1000
+//每个连接还要打开一个输出文件，fd编号增长得更快，连接状态按FD_SETSIZE分配，超过的连接直接拒绝
+#define MAXFDS FD_SETSIZE
 
-//协议状态机
-typedef enum
-{
-  INITIAL_ACK,
-  WAIT_FOR_MSG,
-  IN_MSG
-} ProcessingState;
-
-#define SENDBUF_SIZE 1024
+//一次recv的大小
+#define RECVBUF_SIZE 1024
+//回显缓冲区的初始大小和默认容量上限
+#define ECHOBUF_INIT 1024
+#define ECHOBUF_MAX (256 * 1024)
 
 typedef struct
 {
   //协议状态机
   ProcessingState state;
-  // sendbuf中存放了客户端发送给服务器的信息
-  uint8_t sendbuf[SENDBUF_SIZE];
-  int sendbuf_end;
-  int sendptr;
+  // sendbuf中存放了待回复给客户端的信息
+  ringbuf_t sendbuf;
+  //对端已关闭（recv返回0）：不再读取，sendbuf发完后关闭
+  bool eof;
+  //该连接的输出文件，连接建立时打开，断开时关闭
+  file_writer_t writer;
 } peer_state_t;
 
 //连接状态
 peer_state_t global_state[MAXFDS];
 
+//输出文件的刷新策略
+flush_policy_t flush_policy = FLUSH_BUFFERED;
+//回显缓冲区的容量上限，待发送数据超过高水位（上限减去一次recv的大小）时暂停读取
+size_t echobuf_max = ECHOBUF_MAX;
+
 //当want_read是true时，说明fd待读取
 //当want_write是true时，说明fd待写入
 //若两个都是false，则该fd应该被释放
@@ -62,36 +68,67 @@ fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in *peer_addr,
   // 初始化fd的状态
   peer_state_t *peerstate = &global_state[sockfd];
   peerstate->state = INITIAL_ACK;
-  peerstate->sendbuf[0] = '*';
-  peerstate->sendptr = 0;
-  peerstate->sendbuf_end = 1;
+  ringbuf_init(&peerstate->sendbuf, ECHOBUF_INIT, echobuf_max);
+  ringbuf_push(&peerstate->sendbuf, (const uint8_t *)"*", 1);
+  peerstate->eof = false;
+
+  //打开该连接的输出文件，之后每次recv只追加数据
+  char filename[20];
+  sprintf(filename, "%s%d", "client", sockfd);
+  writer_open(&peerstate->writer, filename, O_APPEND, flush_policy);
 
   return fd_status_W;
 }
 
+//连接断开，关闭该连接的输出文件，释放回显缓冲区
+void on_peer_closed(int sockfd)
+{
+  writer_close(&global_state[sockfd].writer);
+  ringbuf_free(&global_state[sockfd].sendbuf);
+  close(sockfd);
+}
+
+//待发送数据低于高水位时继续读取，有待发送数据时等待可写
+fd_status_t peer_status(int sockfd)
+{
+  const peer_state_t *peerstate = &global_state[sockfd];
+  size_t pending = peerstate->sendbuf.len;
+  return (fd_status_t){.want_read = !peerstate->eof &&
+                                    peerstate->state != INITIAL_ACK &&
+                                    pending + RECVBUF_SIZE <= echobuf_max,
+                       .want_write = pending > 0};
+}
+
 fd_status_t on_peer_ready_recv(int sockfd)
 {
   peer_state_t *peerstate = &global_state[sockfd];
 
-  if (peerstate->state == INITIAL_ACK ||
-      peerstate->sendptr < peerstate->sendbuf_end)
+  fd_status_t status = peer_status(sockfd);
+  if (!status.want_read)
   {
-    //若状态为刚初始化，则没有可以接收的，直接返回
-    return fd_status_W;
+    //若状态为刚初始化或待发送数据已超过高水位，则暂不接收
+    return status;
   }
 
-  uint8_t buf[1024];
+  uint8_t buf[RECVBUF_SIZE];
   int nbytes = recv(sockfd, buf, sizeof buf, 0);
   if (nbytes == 0)
   {
-    //若没有可以接收的数据，则返回
-    return fd_status_NORW;
+    //对端已关闭连接，还有待回显的数据时继续等待可写，发完后再关闭
+    peerstate->eof = true;
+    return peer_status(sockfd);
   }
   else if (nbytes < 0)
   {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
     {
-      return fd_status_R;
+      return status;
+    }
+    else if (errno == ECONNRESET)
+    {
+      //对端已重置连接，待回显的数据无法送达
+      ringbuf_consume(&peerstate->sendbuf, peerstate->sendbuf.len);
+      return fd_status_NORW;
     }
     else
     {
@@ -99,101 +136,110 @@ fd_status_t on_peer_ready_recv(int sockfd)
     }
   }
   //接受客户端发送的数据，并写入服务器端文件中
-  bool ready_to_send = false;
-  char filename[20] = "client";
-  sprintf(filename, "%s%d", "client", sockfd);
-  FILE *fp = fopen(filename, "a+");
-  //循环遍历客户端发送的文件的所有数据
-  for (int i = 0; i < nbytes; ++i)
+  //按协议状态机取出^与$之间的每一段数据
+  assert(peerstate->state != INITIAL_ACK);
+  const uint8_t *pos = buf, *span;
+  size_t len;
+  while ((len = frame_next(&peerstate->state, &pos, buf + nbytes, &span)) > 0)
   {
-    //根据协议状态机执行操作
-    switch (peerstate->state)
+    //整段追加到输出文件
+    writer_append(&peerstate->writer, span, len);
+    //回复的数据放入回显缓冲区，只在低于高水位时读取，所以不会超过上限
+    if (ringbuf_reserve(&peerstate->sendbuf, len) < 0)
     {
-    case INITIAL_ACK:
-      assert(0 && "can't reach here");
-      break;
-    //若是等待信息且收到^，则开始接收信息
-    case WAIT_FOR_MSG:
-      if (buf[i] == '^')
-      {
-        peerstate->state = IN_MSG;
-      }
-      break;
-    //若在接收信息而收到了$，则停止接受信息
-    case IN_MSG:
-      if (buf[i] == '$')
-      {
-        peerstate->state = WAIT_FOR_MSG;
-      }
-      //否则，写入文件，用标准I/O
-      else
+      die("socket %d: echo buffer overflow", sockfd);
+    }
+    while (len > 0)
+    {
+      uint8_t *p;
+      size_t n = ringbuf_tail(&peerstate->sendbuf, &p);
+      if (n > len)
       {
-        assert(peerstate->sendbuf_end < SENDBUF_SIZE);
-        fputc(buf[i], fp);
-        peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] + 1;
-        ready_to_send = true;
+        n = len;
       }
-      break;
+      echo_transform(p, span, n);
+      ringbuf_commit(&peerstate->sendbuf, n);
+      span += n;
+      len -= n;
     }
   }
-  fclose(fp);
 
-  return (fd_status_t){.want_read = !ready_to_send,
-                       .want_write = ready_to_send};
+  return peer_status(sockfd);
 }
 
 fd_status_t on_peer_ready_send(int sockfd)
 {
   peer_state_t *peerstate = &global_state[sockfd];
 
-  if (peerstate->sendptr >= peerstate->sendbuf_end)
+  if (peerstate->sendbuf.len == 0)
   {
     // 没东西等待发送，直接返回
-    return fd_status_RW;
+    return peer_status(sockfd);
   }
-  //回复客户端
-  int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
-  int nsent = send(sockfd, &peerstate->sendbuf[peerstate->sendptr], sendlen, 0);
+  //回复客户端，环形缓冲区中的数据最多分两段，用一次writev发送
+  struct iovec iov[2];
+  int iovcnt = ringbuf_peek(&peerstate->sendbuf, iov);
+  ssize_t nsent = writev(sockfd, iov, iovcnt);
   if (nsent == -1)
   {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
     {
-      return fd_status_W;
+      return peer_status(sockfd);
+    }
+    else if (errno == EPIPE || errno == ECONNRESET)
+    {
+      //对端已完全关闭，丢弃待回显的数据并关闭连接
+      ringbuf_consume(&peerstate->sendbuf, peerstate->sendbuf.len);
+      peerstate->eof = true;
+      return fd_status_NORW;
     }
     else
     {
       perror_die("send");
     }
   }
-  if (nsent < sendlen)
-  {
-    peerstate->sendptr += nsent;
-    return fd_status_W;
-  }
-  else
-  {
-    // 成功发送，则重置状态值
-    peerstate->sendptr = 0;
-    peerstate->sendbuf_end = 0;
-
-    if (peerstate->state == INITIAL_ACK)
-    {
-      peerstate->state = WAIT_FOR_MSG;
-    }
+  ringbuf_consume(&peerstate->sendbuf, nsent);
 
-    return fd_status_R;
+  // 初始的*发送完后开始接收消息
+  if (peerstate->sendbuf.len == 0 && peerstate->state == INITIAL_ACK)
+  {
+    peerstate->state = WAIT_FOR_MSG;
   }
+  return peer_status(sockfd);
 }
 
 int main(int argc, char **argv)
 {
   setvbuf(stdout, NULL, _IONBF, 0);
+  //对端关闭后继续回显时writev返回EPIPE，不能被SIGPIPE终止
+  signal(SIGPIPE, SIG_IGN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      echobuf_max = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      flush_policy = flush_policy_parse(optarg);
+      break;
+    default:
+      die("usage: %s [-b echobuf-max] [-f buffered|write|sync] [port]",
+          argv[0]);
+    }
+  }
+  if (echobuf_max < 2 * RECVBUF_SIZE)
+  {
+    die("echo buffer cap must be at least %d bytes", 2 * RECVBUF_SIZE);
+  }
 
   //默认在9090端口监听
   int portnum = 9090;
-  if (argc >= 2)
+  if (optind < argc)
   {
-    portnum = atoi(argv[1]);
+    portnum = atoi(argv[optind]);
   }
   printf("Serving on port %d\n", portnum);
 
@@ -263,15 +309,17 @@ int main(int argc, char **argv)
           }
           else
           {
+            //保证fd数量不超过限制，超过时拒绝这个连接，已有的连接不受影响
+            if (newsockfd >= MAXFDS)
+            {
+              printf("socket fd (%d) >= MAXFDS (%d), connection refused\n", newsockfd, MAXFDS);
+              close(newsockfd);
+              continue;
+            }
             //设置fd为非阻塞模式，防止永久阻塞
             make_socket_non_blocking(newsockfd);
-            //保证fd数量不超过限制
             if (newsockfd > fdset_max)
             {
-              if (newsockfd >= FD_SETSIZE)
-              {
-                die("socket fd (%d) >= FD_SETSIZE (%d)", newsockfd, FD_SETSIZE);
-              }
               fdset_max = newsockfd;
             }
 
@@ -303,6 +351,11 @@ int main(int argc, char **argv)
         {
           //接收信息，设置并获得fd最新的状态（待读取/待写入等）
           fd_status_t status = on_peer_ready_recv(fd);
+          //刚收到需要回复的数据时直接发送，不必等到下一轮select
+          if (status.want_write && !FD_ISSET(fd, &writefds))
+          {
+            status = on_peer_ready_send(fd);
+          }
           //若fd等待读取，则将其将如待读取的集合，用select监听其读取I/O是否准备好
           if (status.want_read)
           {
@@ -325,7 +378,7 @@ int main(int argc, char **argv)
           if (!status.want_read && !status.want_write)
           {
             printf("socket %d closing\n", fd);
-            close(fd);
+            on_peer_closed(fd);
           }
         }
       }
@@ -335,6 +388,11 @@ int main(int argc, char **argv)
       {
         //准备好-1,可以减少循环的次数，优化性能
         nready--;
+        //fd可能在上面接收时已经关闭
+        if (!FD_ISSET(fd, &readfds_master) && !FD_ISSET(fd, &writefds_master))
+        {
+          continue;
+        }
         //发送信息，设置并获得fd最新的状态（待读取/待写入等）
         fd_status_t status = on_peer_ready_send(fd);
         //若fd等待读取，则将其将如待读取的集合，用select监听其读取I/O是否准备好
@@ -359,7 +417,7 @@ int main(int argc, char **argv)
         if (!status.want_read && !status.want_write)
         {
           printf("socket %d closing\n", fd);
-          close(fd);
+          on_peer_closed(fd);
         }
       }
     }
@@ -1,20 +1,21 @@
 // 单线程顺序服务器
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "utils.h"
 
-//协议状态机
-typedef enum
-{
-  WAIT_FOR_MSG,
-  IN_MSG
-} ProcessingState;
+//输出文件的刷新策略
+flush_policy_t flush_policy = FLUSH_BUFFERED;
+//是否用TCP_CORK合并回复
+bool coalesce = false;
 
 //接收客户端的文件内容并写入服务器端
 void serve_connection(int sockfd)
@@ -31,7 +32,9 @@ void serve_connection(int sockfd)
   //创建文件
   char filename[20] = "client";
   sprintf(filename, "%s%d", "client", sockfd);
-  FILE *fp = fopen(filename, "w+");
+  file_writer_t writer;
+  writer_open(&writer, filename, O_TRUNC, flush_policy);
+  bool corked = false;
   //循环接收客户端的文件内容并写入指定文件
   while (1)
   {
@@ -47,39 +50,39 @@ void serve_connection(int sockfd)
       break;
     }
 
-    for (int i = 0; i < len; ++i)
+    //根据协议状态机取出^与$之间的每一段数据
+    //本次recv的所有回复先放在reply中，最后用一次send发出
+    uint8_t reply[sizeof buf];
+    size_t replylen = 0;
+    const uint8_t *pos = buf, *span;
+    size_t n;
+    while ((n = frame_next(&state, &pos, buf + len, &span)) > 0)
+    {
+      //整段追加到输出文件
+      writer_append(&writer, span, n);
+      echo_transform(reply + replylen, span, n);
+      replylen += n;
+    }
+    //还有数据等待读取时打开TCP_CORK，让多次回复合并成完整的报文；读完时关闭，立即发出
+    if (coalesce)
     {
-      //根据文件内的参数，更改协议状态机的状态
-      switch (state)
+      int avail = 0;
+      ioctl(sockfd, FIONREAD, &avail);
+      if ((avail > 0) != corked)
       {
-      case WAIT_FOR_MSG:
-        if (buf[i] == '^')
-        {
-          state = IN_MSG;
-        }
-        break;
-      case IN_MSG:
-        if (buf[i] == '$')
-        {
-          state = WAIT_FOR_MSG;
-        }
-        else
-        {
-          //写入文件，用标准I/O
-          fputc(buf[i], fp);
-          buf[i] += 1;
-          if (send(sockfd, &buf[i], 1, 0) < 1)
-          {
-            perror("send error");
-            close(sockfd);
-            return;
-          }
-        }
-        break;
+        corked = avail > 0;
+        set_tcp_cork(sockfd, corked);
       }
     }
+    if (replylen > 0 && send_all(sockfd, reply, replylen, 0) < 0)
+    {
+      perror("send error");
+      writer_close(&writer);
+      close(sockfd);
+      return;
+    }
   }
-  fclose(fp);
+  writer_close(&writer);
 
   close(sockfd);
 }
@@ -88,11 +91,27 @@ int main(int argc, char **argv)
 {
   setvbuf(stdout, NULL, _IONBF, 0);
 
+  int opt;
+  while ((opt = getopt(argc, argv, "cf:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      coalesce = true;
+      break;
+    case 'f':
+      flush_policy = flush_policy_parse(optarg);
+      break;
+    default:
+      die("usage: %s [-c] [-f buffered|write|sync] [port]", argv[0]);
+    }
+  }
+
   //默认在9090端口进行监听
   int portnum = 9090;
-  if (argc >= 2)
+  if (optind < argc)
   {
-    portnum = atoi(argv[1]);
+    portnum = atoi(argv[optind]);
   }
   printf("Serving on port %d\n", portnum);
 
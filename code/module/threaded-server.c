@@ -1,9 +1,12 @@
 //多线程并发服务器
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -16,12 +19,9 @@ typedef struct
   int sockfd;
 } thread_config_t;
 
-//协议状态机
-typedef enum
-{
-  WAIT_FOR_MSG,
-  IN_MSG
-} ProcessingState;
+//输出文件的刷新策略和是否用TCP_CORK合并回复，与sequential-server.c相同
+flush_policy_t flush_policy = FLUSH_BUFFERED;
+bool coalesce = false;
 
 //与单线程顺序服务器中的实现完全相同，详见sequential-server.c中的注释
 void serve_connection(int sockfd)
@@ -34,7 +34,9 @@ void serve_connection(int sockfd)
   ProcessingState state = WAIT_FOR_MSG;
   char filename[20] = "client";
   sprintf(filename, "%s%d", "client", sockfd);
-  FILE *fp = fopen(filename, "w+");
+  file_writer_t writer;
+  writer_open(&writer, filename, O_TRUNC, flush_policy);
+  bool corked = false;
   while (1)
   {
     uint8_t buf[1024];
@@ -48,38 +50,36 @@ void serve_connection(int sockfd)
       break;
     }
 
-    for (int i = 0; i < len; ++i)
+    //本次recv的所有回复先放在reply中，最后用一次send发出
+    uint8_t reply[sizeof buf];
+    size_t replylen = 0;
+    const uint8_t *pos = buf, *span;
+    size_t n;
+    while ((n = frame_next(&state, &pos, buf + len, &span)) > 0)
+    {
+      writer_append(&writer, span, n);
+      echo_transform(reply + replylen, span, n);
+      replylen += n;
+    }
+    if (coalesce)
     {
-      switch (state)
+      int avail = 0;
+      ioctl(sockfd, FIONREAD, &avail);
+      if ((avail > 0) != corked)
       {
-      case WAIT_FOR_MSG:
-        if (buf[i] == '^')
-        {
-          state = IN_MSG;
-        }
-        break;
-      case IN_MSG:
-        if (buf[i] == '$')
-        {
-          state = WAIT_FOR_MSG;
-        }
-        else
-        {
-          // putchar(buf[i]);
-          fputc(buf[i], fp);
-          buf[i] += 1;
-          if (send(sockfd, &buf[i], 1, 0) < 1)
-          {
-            perror("send error");
-            close(sockfd);
-            return;
-          }
-        }
-        break;
+        corked = avail > 0;
+        set_tcp_cork(sockfd, corked);
       }
     }
+    if (replylen > 0 && send_all(sockfd, reply, replylen, 0) < 0)
+    {
+      perror("send error");
+      writer_close(&writer);
+      close(sockfd);
+      return;
+    }
   }
-  fclose(fp);
+  writer_close(&writer);
 
   close(sockfd);
 }
@@ -106,11 +106,27 @@ int main(int argc, char **argv)
 {
   setvbuf(stdout, NULL, _IONBF, 0);
 
+  int opt;
+  while ((opt = getopt(argc, argv, "cf:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      coalesce = true;
+      break;
+    case 'f':
+      flush_policy = flush_policy_parse(optarg);
+      break;
+    default:
+      die("usage: %s [-c] [-f buffered|write|sync] [port]", argv[0]);
+    }
+  }
+
   //默认在9090端口监听请求
   int portnum = 9090;
-  if (argc >= 2)
+  if (optind < argc)
   {
-    portnum = atoi(argv[1]);
+    portnum = atoi(argv[optind]);
   }
   printf("Serving on port %d\n", portnum);
   fflush(stdout);
@@ -1,5 +1,7 @@
 #include "utils.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -7,8 +9,15 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #define _GNU_SOURCE
 #include <netdb.h>
+#include <netinet/tcp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define N_BACKLOG 64
 
@@ -53,8 +62,7 @@ void report_peer_connected(const struct sockaddr_in *sa, socklen_t salen)
   }
 }
 
-//初始化socket，绑定并监听
-int listen_inet_socket(int portnum)
+static int listen_inet_socket_opt(int portnum, int reuseport)
 {
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0)
@@ -68,6 +76,13 @@ int listen_inet_socket(int portnum)
     perror_die("setsockopt");
   }
 
+  //多个socket绑定同一端口，由内核在它们之间分发新连接
+  if (reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+  {
+    perror_die("setsockopt SO_REUSEPORT");
+  }
+
   struct sockaddr_in serv_addr;
   memset(&serv_addr, 0, sizeof(serv_addr));
   serv_addr.sin_family = AF_INET;
@@ -87,6 +102,18 @@ int listen_inet_socket(int portnum)
   return sockfd;
 }
 
+//初始化socket，绑定并监听
+int listen_inet_socket(int portnum)
+{
+  return listen_inet_socket_opt(portnum, 0);
+}
+
+//初始化带SO_REUSEPORT的socket，同一端口可以有多个监听socket
+int listen_inet_socket_reuseport(int portnum)
+{
+  return listen_inet_socket_opt(portnum, 1);
+}
+
 //设置socket为不阻塞
 void make_socket_non_blocking(int sockfd)
 {
@@ -101,3 +128,465 @@ void make_socket_non_blocking(int sockfd)
     perror_die("fcntl F_SETFL O_NONBLOCK");
   }
 }
+
+//用户态缓冲区大小
+#define WRITER_BUF_SIZE (64 * 1024)
+
+flush_policy_t flush_policy_parse(const char *name)
+{
+  if (strcmp(name, "buffered") == 0)
+  {
+    return FLUSH_BUFFERED;
+  }
+  if (strcmp(name, "write") == 0)
+  {
+    return FLUSH_WRITE;
+  }
+  if (strcmp(name, "sync") == 0)
+  {
+    return FLUSH_SYNC;
+  }
+  die("unknown flush policy: %s (buffered, write or sync)", name);
+  return FLUSH_BUFFERED;
+}
+
+void writer_open(file_writer_t *w, const char *filename, int oflags,
+                 flush_policy_t policy)
+{
+  w->fd = open(filename, O_WRONLY | O_CREAT | oflags, 0644);
+  if (w->fd < 0)
+  {
+    perror_die("open");
+  }
+  w->policy = policy;
+  w->buf = policy == FLUSH_BUFFERED ? xmalloc(WRITER_BUF_SIZE) : NULL;
+  w->buflen = 0;
+}
+
+//写完iov中的全部数据，处理write只写了一部分的情况
+static void writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0)
+  {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror_die("writev");
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+void writer_append(file_writer_t *w, const uint8_t *data, size_t len)
+{
+  if (len == 0)
+  {
+    return;
+  }
+  if (w->policy == FLUSH_BUFFERED && w->buflen + len <= WRITER_BUF_SIZE)
+  {
+    memcpy(w->buf + w->buflen, data, len);
+    w->buflen += len;
+    return;
+  }
+  //缓冲区放不下时，缓冲区中的数据与新数据用一次writev写出
+  struct iovec iov[2] = {{w->buf, w->buflen}, {(void *)data, len}};
+  if (w->buflen > 0)
+  {
+    writev_all(w->fd, iov, 2);
+  }
+  else
+  {
+    writev_all(w->fd, &iov[1], 1);
+  }
+  w->buflen = 0;
+}
+
+void writer_flush(file_writer_t *w)
+{
+  if (w->buflen > 0)
+  {
+    struct iovec iov = {w->buf, w->buflen};
+    writev_all(w->fd, &iov, 1);
+    w->buflen = 0;
+  }
+}
+
+void writer_close(file_writer_t *w)
+{
+  writer_flush(w);
+  if (w->policy == FLUSH_SYNC && fdatasync(w->fd) < 0)
+  {
+    perror("fdatasync");
+  }
+  close(w->fd);
+  free(w->buf);
+  w->fd = -1;
+  w->buf = NULL;
+}
+
+void ringbuf_init(ringbuf_t *rb, size_t initial, size_t max)
+{
+  rb->buf = xmalloc(initial);
+  rb->cap = initial;
+  rb->head = 0;
+  rb->len = 0;
+  rb->max = max;
+}
+
+void ringbuf_free(ringbuf_t *rb)
+{
+  free(rb->buf);
+  rb->buf = NULL;
+  rb->cap = rb->head = rb->len = 0;
+}
+
+int ringbuf_reserve(ringbuf_t *rb, size_t len)
+{
+  if (rb->len + len <= rb->cap)
+  {
+    return 0;
+  }
+  if (rb->len + len > rb->max)
+  {
+    return -1;
+  }
+
+  //容量翻倍直到放得下，同时把数据整理为从0开始的连续一段
+  size_t cap = rb->cap;
+  while (cap < rb->len + len)
+  {
+    cap *= 2;
+  }
+  if (cap > rb->max)
+  {
+    cap = rb->max;
+  }
+  uint8_t *buf = xmalloc(cap);
+  struct iovec iov[2];
+  int n = ringbuf_peek(rb, iov);
+  size_t off = 0;
+  for (int i = 0; i < n; ++i)
+  {
+    memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  free(rb->buf);
+  rb->buf = buf;
+  rb->cap = cap;
+  rb->head = 0;
+  return 0;
+}
+
+size_t ringbuf_tail(ringbuf_t *rb, uint8_t **p)
+{
+  size_t tail = (rb->head + rb->len) % rb->cap;
+  *p = rb->buf + tail;
+  //尾部在头部之后时可以写到缓冲区末尾，否则只能写到头部之前
+  if (tail >= rb->head && rb->len < rb->cap)
+  {
+    return rb->cap - tail;
+  }
+  return rb->cap - rb->len;
+}
+
+void ringbuf_commit(ringbuf_t *rb, size_t n)
+{
+  assert(rb->len + n <= rb->cap);
+  rb->len += n;
+}
+
+int ringbuf_push(ringbuf_t *rb, const uint8_t *data, size_t len)
+{
+  if (ringbuf_reserve(rb, len) < 0)
+  {
+    return -1;
+  }
+  while (len > 0)
+  {
+    uint8_t *p;
+    size_t n = ringbuf_tail(rb, &p);
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(p, data, n);
+    ringbuf_commit(rb, n);
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int ringbuf_peek(const ringbuf_t *rb, struct iovec iov[2])
+{
+  if (rb->len == 0)
+  {
+    return 0;
+  }
+  size_t first = rb->cap - rb->head;
+  if (first >= rb->len)
+  {
+    iov[0].iov_base = rb->buf + rb->head;
+    iov[0].iov_len = rb->len;
+    return 1;
+  }
+  iov[0].iov_base = rb->buf + rb->head;
+  iov[0].iov_len = first;
+  iov[1].iov_base = rb->buf;
+  iov[1].iov_len = rb->len - first;
+  return 2;
+}
+
+void ringbuf_consume(ringbuf_t *rb, size_t n)
+{
+  assert(n <= rb->len);
+  rb->head = (rb->head + n) % rb->cap;
+  rb->len -= n;
+  //缓冲区空了就从头开始，尽量让数据保持连续
+  if (rb->len == 0)
+  {
+    rb->head = 0;
+  }
+}
+
+//逐字节查找c，找不到时返回end
+static const uint8_t *scan_byte_scalar(const uint8_t *p, const uint8_t *end,
+                                       uint8_t c)
+{
+  while (p < end && *p != c)
+  {
+    ++p;
+  }
+  return p;
+}
+
+#ifdef HAVE_X86_SIMD
+//每次比较16个字节，用movemask取出第一个相等的位置
+__attribute__((target("sse2"))) static const uint8_t *
+scan_byte_sse2(const uint8_t *p, const uint8_t *end, uint8_t c)
+{
+  const __m128i needle = _mm_set1_epi8((char)c);
+  while (end - p >= 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask)
+    {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+  return scan_byte_scalar(p, end, c);
+}
+
+//每次比较32个字节
+__attribute__((target("avx2"))) static const uint8_t *
+scan_byte_avx2(const uint8_t *p, const uint8_t *end, uint8_t c)
+{
+  const __m256i needle = _mm256_set1_epi8((char)c);
+  while (end - p >= 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    unsigned mask =
+        (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask)
+    {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  return scan_byte_sse2(p, end, c);
+}
+#endif
+
+static void echo_transform_scalar(uint8_t *dst, const uint8_t *src,
+                                  size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+  {
+    dst[i] = src[i] + 1;
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2"))) static void
+echo_transform_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+  const __m128i one = _mm_set1_epi8(1);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(chunk, one));
+  }
+  echo_transform_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2"))) static void
+echo_transform_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi8(chunk, one));
+  }
+  echo_transform_sse2(dst + i, src + i, len - i);
+}
+#endif
+
+static void (*echo_transform_impl)(uint8_t *, const uint8_t *,
+                                   size_t) = echo_transform_scalar;
+
+void echo_transform(uint8_t *dst, const uint8_t *src, size_t len)
+{
+  echo_transform_impl(dst, src, len);
+}
+
+int send_all(int sockfd, const void *buf, size_t len, int flags)
+{
+  const uint8_t *p = buf;
+  while (len > 0)
+  {
+    ssize_t n = send(sockfd, p, len, flags);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+void set_tcp_cork(int sockfd, int on)
+{
+  if (setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0)
+  {
+    perror("setsockopt TCP_CORK");
+  }
+}
+
+static const uint8_t *(*scan_byte)(const uint8_t *, const uint8_t *,
+                                   uint8_t) = scan_byte_scalar;
+static const char *scan_name = "scalar";
+
+int frame_scan_select(scan_impl_t impl)
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (impl == SCAN_AUTO)
+  {
+    impl = __builtin_cpu_supports("avx2")   ? SCAN_AVX2
+           : __builtin_cpu_supports("sse2") ? SCAN_SSE2
+                                            : SCAN_SCALAR;
+  }
+  if (impl == SCAN_AVX2 && __builtin_cpu_supports("avx2"))
+  {
+    scan_byte = scan_byte_avx2;
+    scan_name = "avx2";
+    return 0;
+  }
+  if (impl == SCAN_SSE2 && __builtin_cpu_supports("sse2"))
+  {
+    scan_byte = scan_byte_sse2;
+    scan_name = "sse2";
+    return 0;
+  }
+#else
+  if (impl == SCAN_AUTO)
+  {
+    impl = SCAN_SCALAR;
+  }
+#endif
+  if (impl == SCAN_SCALAR)
+  {
+    scan_byte = scan_byte_scalar;
+    scan_name = "scalar";
+    return 0;
+  }
+  return -1;
+}
+
+const char *frame_scan_name(void)
+{
+  return scan_name;
+}
+
+//程序启动时按CPU支持情况选择扫描实现和回显变换实现
+__attribute__((constructor)) static void frame_scan_init(void)
+{
+  frame_scan_select(SCAN_AUTO);
+#ifdef HAVE_X86_SIMD
+  if (__builtin_cpu_supports("avx2"))
+  {
+    echo_transform_impl = echo_transform_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    echo_transform_impl = echo_transform_sse2;
+  }
+#endif
+}
+
+size_t frame_next(ProcessingState *state, const uint8_t **pos,
+                  const uint8_t *end, const uint8_t **span)
+{
+  assert(*state != INITIAL_ACK);
+  const uint8_t *p = *pos;
+  while (p < end)
+  {
+    //等待消息时跳过^之前的所有字节
+    if (*state == WAIT_FOR_MSG)
+    {
+      p = scan_byte(p, end, '^');
+      if (p == end)
+      {
+        break;
+      }
+      ++p;
+      *state = IN_MSG;
+    }
+    //消息内的字节一直到$（或缓冲区末尾）为止作为一段返回
+    else
+    {
+      const uint8_t *q = scan_byte(p, end, '$');
+      if (q == end)
+      {
+        *span = p;
+        *pos = end;
+        return end - p;
+      }
+      *state = WAIT_FOR_MSG;
+      if (q > p)
+      {
+        *span = p;
+        *pos = q + 1;
+        return q - p;
+      }
+      p = q + 1;
+    }
+  }
+  *pos = end;
+  return 0;
+}
@@ -2,8 +2,28 @@
 #define UTILS_H
 
 #include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+//协议状态机
+typedef enum
+{
+  INITIAL_ACK,
+  WAIT_FOR_MSG,
+  IN_MSG
+} ProcessingState;
+
+//查找^和$分隔符所用的实现
+typedef enum
+{
+  SCAN_AUTO,
+  SCAN_SCALAR,
+  SCAN_SSE2,
+  SCAN_AVX2
+} scan_impl_t;
 
 void die(char *fmt, ...);
 void *xmalloc(size_t size);
@@ -11,7 +31,78 @@ void perror_die(char *msg);
 void report_peer_connected(const struct sockaddr_in *sa, socklen_t salen);
 //初始化socket，绑定并监听
 int listen_inet_socket(int portnum);
+//初始化带SO_REUSEPORT的socket，同一端口可以有多个监听socket
+int listen_inet_socket_reuseport(int portnum);
 //设置socket为不阻塞
 void make_socket_non_blocking(int sockfd);
 
+//写入文件的刷新策略
+typedef enum
+{
+  FLUSH_BUFFERED, //在用户态攒满WRITER_BUF_SIZE后再write
+  FLUSH_WRITE,    //每段数据立即write进页缓存
+  FLUSH_SYNC      //同FLUSH_WRITE，关闭时再fdatasync
+} flush_policy_t;
+
+//每个连接的输出文件，连接建立时打开一次，断开时关闭
+typedef struct
+{
+  int fd;
+  flush_policy_t policy;
+  uint8_t *buf;
+  size_t buflen;
+} file_writer_t;
+
+//解析刷新策略名称：buffered、write、sync
+flush_policy_t flush_policy_parse(const char *name);
+//打开输出文件，oflags为O_APPEND或O_TRUNC
+void writer_open(file_writer_t *w, const char *filename, int oflags,
+                 flush_policy_t policy);
+//追加一段数据
+void writer_append(file_writer_t *w, const uint8_t *data, size_t len);
+//写出用户态缓冲区中的数据
+void writer_flush(file_writer_t *w);
+//写出剩余数据并关闭文件
+void writer_close(file_writer_t *w);
+
+//待发送数据的环形缓冲区，按需增长，容量不超过max
+typedef struct
+{
+  uint8_t *buf;
+  size_t cap;
+  size_t head; //第一个待发送字节的位置
+  size_t len;  //待发送字节数
+  size_t max;
+} ringbuf_t;
+
+void ringbuf_init(ringbuf_t *rb, size_t initial, size_t max);
+void ringbuf_free(ringbuf_t *rb);
+//保证至少还能追加len个字节，必要时增长；超过max返回-1
+int ringbuf_reserve(ringbuf_t *rb, size_t len);
+//尾部连续可写的空间，写入后用ringbuf_commit提交
+size_t ringbuf_tail(ringbuf_t *rb, uint8_t **p);
+void ringbuf_commit(ringbuf_t *rb, size_t n);
+//追加数据，超过max返回-1
+int ringbuf_push(ringbuf_t *rb, const uint8_t *data, size_t len);
+//待发送的数据，最多分为两段，返回段数
+int ringbuf_peek(const ringbuf_t *rb, struct iovec iov[2]);
+//丢弃已发送的n个字节
+void ringbuf_consume(ringbuf_t *rb, size_t n);
+
+//发送全部len个字节，处理只发送了一部分的情况，出错时返回-1
+int send_all(int sockfd, const void *buf, size_t len, int flags);
+//打开或关闭TCP_CORK，关闭时立即发出已缓存的数据
+void set_tcp_cork(int sockfd, int on);
+//回显变换：dst[i] = src[i] + 1，按CPU支持情况使用AVX2/SSE2
+void echo_transform(uint8_t *dst, const uint8_t *src, size_t len);
+
+//选择分隔符扫描实现，SCAN_AUTO按CPU支持情况自动选择，不支持时返回-1
+int frame_scan_select(scan_impl_t impl);
+//当前使用的扫描实现名称
+const char *frame_scan_name(void);
+//从[*pos, end)中取出下一段^与$之间的消息内容，span指向其起始位置，返回其长度
+//返回0表示缓冲区已扫描完；state跨缓冲区保持，消息可以跨越多次recv
+size_t frame_next(ProcessingState *state, const uint8_t **pos,
+                  const uint8_t *end, const uint8_t **span);
+
 #endif
@@ -0,0 +1,214 @@
+/*
+ * epoll线程到线程池的基准：与server.c的epoll引擎相同的路径（EPOLLONESHOT，epoll线程提交step，
+ * step按预算接收到EAGAIN），同一份代码分别与tpool.c、tpool_fifo.c链接；
+ * 预算用完时经epoll重新打开连接（rearm），或在工作线程上重新提交step（resubmit）。
+ */
+#include "tpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef POOL_NAME
+#define POOL_NAME "tpool"
+#endif
+
+#define CONNS 32                         //连接数
+#define CONN_BYTES (32 * 1024 * 1024)    //每个连接发送的数据量
+#define CHUNK (256 * 1024)               //一次send、recv的长度
+#define SENDERS 4                        //发送线程数
+#define STEP_BUDGET (4 * 1024 * 1024)    //与server.c相同
+#define LOCAL_STEPS 8                    //与server.c相同
+#define EPOLL_EVENTS 64
+
+struct conn
+{
+    int fd;   //接收端，非阻塞
+    int peer; //发送端
+};
+
+static struct conn conns[CONNS];
+static int epfd;
+static int resubmit;     //预算用完时是否在工作线程上重新提交
+static long done_count;  //已经收完的连接数
+static long epoll_steps; //epoll线程提交的step数
+static long local_steps_total; //工作线程重新提交的step数
+static __thread int local_steps;
+static __thread char *rbuf;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void rearm(struct conn *c)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*与session_step相同：接收到EAGAIN或预算用完，对端关闭时结束*/
+static void *step(void *arg)
+{
+    struct conn *c = (struct conn *)arg;
+    int budget = STEP_BUDGET, drained = 0;
+    if (!rbuf && !(rbuf = malloc(CHUNK)))
+    {
+        printf("malloc failed\n");
+        exit(-1);
+    }
+    while (budget > 0)
+    {
+        int n = recv(c->fd, rbuf, CHUNK, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            drained = 1;
+            break;
+        }
+        if (n <= 0)
+        {
+            close(c->fd);
+            __atomic_add_fetch(&done_count, 1, __ATOMIC_ACQ_REL);
+            return NULL;
+        }
+        budget -= n;
+    }
+    if (resubmit && !drained && local_steps < LOCAL_STEPS)
+    {
+        local_steps++;
+        __atomic_add_fetch(&local_steps_total, 1, __ATOMIC_RELAXED);
+        tpool_add_work_prio(step, c, TPOOL_PRIO_DATA);
+        return NULL;
+    }
+    local_steps = 0;
+    rearm(c);
+    return NULL;
+}
+
+/*发送线程：轮流向自己负责的连接发送，发完后关闭发送端*/
+static void *sender(void *arg)
+{
+    long id = (long)arg;
+    char *buf = calloc(1, CHUNK);
+    long sent[CONNS] = {0};
+    int left = 1;
+    while (left)
+    {
+        left = 0;
+        int i;
+        for (i = id; i < CONNS; i += SENDERS)
+        {
+            if (sent[i] >= CONN_BYTES)
+                continue;
+            int n = send(conns[i].peer, buf, CHUNK, 0);
+            if (n < 0)
+            {
+                perror("send");
+                exit(-1);
+            }
+            sent[i] += n;
+            if (sent[i] >= CONN_BYTES)
+                close(conns[i].peer);
+            else
+                left = 1;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void run(int nthreads, int mode)
+{
+    tpool_create(nthreads);
+    resubmit = mode;
+    done_count = epoll_steps = local_steps_total = 0;
+
+    /*本机TCP连接，与server相同，接收缓冲区可以自动增长到几MB，step的预算才会用完*/
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listenfd, CONNS) != 0 || getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) != 0)
+    {
+        perror("listen");
+        exit(-1);
+    }
+
+    epfd = epoll_create1(0);
+    int i;
+    for (i = 0; i < CONNS; i++)
+    {
+        int peer = socket(AF_INET, SOCK_STREAM, 0);
+        int fd;
+        if (peer < 0 || connect(peer, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            (fd = accept(listenfd, NULL, NULL)) < 0)
+        {
+            perror("connect");
+            exit(-1);
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        conns[i].fd = fd;
+        conns[i].peer = peer;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    close(listenfd);
+
+    double start = now();
+    pthread_t tids[SENDERS];
+    for (i = 0; i < SENDERS; i++)
+        pthread_create(&tids[i], NULL, sender, (void *)(long)i);
+
+    /*epoll线程：可读的连接交给线程池*/
+    struct epoll_event events[EPOLL_EVENTS];
+    while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) < CONNS)
+    {
+        int n = epoll_wait(epfd, events, EPOLL_EVENTS, 10);
+        for (i = 0; i < n; i++)
+        {
+            epoll_steps++;
+            tpool_add_work_prio(step, events[i].data.ptr, TPOOL_PRIO_DATA);
+        }
+    }
+    double elapsed = now() - start;
+    for (i = 0; i < SENDERS; i++)
+        pthread_join(tids[i], NULL);
+    close(epfd);
+
+    printf("%-14s %3d threads  %-8s  %6.2f GB/s  steps from epoll %7ld  from workers %7ld\n",
+           POOL_NAME, nthreads, mode ? "resubmit" : "rearm",
+           (double)CONNS * CONN_BYTES / elapsed / (1 << 30), epoll_steps, local_steps_total);
+
+    tpool_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    int threads[] = {4, 16};
+    int i;
+    for (i = 0; i < 2; i++)
+    {
+        run(threads[i], 0);
+        run(threads[i], 1);
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*文件块写入方式的基准：比较mmap、splice与O_DIRECT接收一个大文件块时每字节消耗的CPU时间*/
+#include "work.h"
+#include <sys/resource.h>
+#include <time.h>
+
+#define BENCH_FILE "bench-ingest.tmp"
+#define SEND_CHUNK 1048576 //发送线程一次send的大小
+#define DEFAULT_MB 512     //默认文件块大小
+
+static char sendbuf[SEND_CHUNK];
+static int block_size;
+static char *ingest_name[] = {"mmap", "splice", "direct"};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*本线程消耗的用户态+内核态CPU时间（秒）*/
+static double thread_cpu()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*发送线程：连接回环地址，发送block_size字节*/
+static void *sender(void *arg)
+{
+    struct sockaddr_in addr = *(struct sockaddr_in *)arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror("connect");
+        exit(-1);
+    }
+    int remain = block_size;
+    while (remain > 0)
+    {
+        int n = send(fd, sendbuf, remain < SEND_CHUNK ? remain : SEND_CHUNK, 0);
+        if (n <= 0)
+        {
+            perror("send");
+            exit(-1);
+        }
+        remain -= n;
+    }
+    close(fd);
+    return NULL;
+}
+
+/*检查文件内容与发送的数据一致*/
+static int verify(int fd)
+{
+    static char buf[SEND_CHUNK];
+    int off;
+    for (off = 0; off < block_size; off += SEND_CHUNK)
+    {
+        int len = block_size - off < SEND_CHUNK ? block_size - off : SEND_CHUNK;
+        if (pread(fd, buf, len, off) != len || memcmp(buf, sendbuf, len) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void run(int ingest)
+{
+    /*回环地址上的监听socket，端口由内核分配*/
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listenfd, 1) == -1)
+    {
+        perror("bind/listen");
+        exit(-1);
+    }
+    getsockname(listenfd, (struct sockaddr *)&addr, &addrlen);
+
+    /*与register_file()一样创建填充文件并映射*/
+    unlink(BENCH_FILE);
+    createfile(BENCH_FILE, block_size);
+    int fd = open(BENCH_FILE, O_RDWR);
+    char *map = (char *)mmap(NULL, block_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    if (fd == -1 || map == MAP_FAILED)
+    {
+        perror("open/mmap");
+        exit(-1);
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, sender, &addr);
+    int sockfd = accept(listenfd, NULL, NULL);
+
+    /*O_DIRECT不可用时direct_fd为-1，经页缓存写入*/
+    int direct_fd = ingest == INGEST_DIRECT ? open(BENCH_FILE, O_RDWR | O_DIRECT) : -1;
+
+    double t0 = now(), c0 = thread_cpu();
+    int ret;
+    if (ingest == INGEST_SPLICE)
+        ret = ingest_splice(sockfd, fd, 0, block_size);
+    else if (ingest == INGEST_DIRECT)
+        ret = ingest_direct(sockfd, direct_fd, fd, 0, block_size);
+    else
+        ret = ingest_mmap(sockfd, map, block_size);
+    double wall = now() - t0, cpu = thread_cpu() - c0;
+
+    pthread_join(tid, NULL);
+    close(sockfd);
+    close(listenfd);
+    munmap(map, block_size);
+    if (direct_fd >= 0)
+        close(direct_fd);
+
+    if (ret < 0 || verify(fd) < 0)
+    {
+        printf("%s: data mismatch\n", ingest_name[ingest]);
+        exit(-1);
+    }
+    close(fd);
+    unlink(BENCH_FILE);
+
+    printf("%-6s  %8.2f MB/s  cpu %6.3f s  %6.3f ns/byte\n",
+           ingest_name[ingest],
+           block_size / wall / 1e6, cpu, cpu * 1e9 / block_size);
+}
+
+int main(int argc, char **argv)
+{
+    int mb = DEFAULT_MB;
+    if (argc > 1)
+        mb = atoi(argv[1]);
+    if (mb <= 0 || mb > 2047)
+    {
+        printf("usage: %s [block-MB]\n", argv[0]);
+        exit(-1);
+    }
+    block_size = mb * 1024 * 1024;
+
+    int i;
+    for (i = 0; i < SEND_CHUNK; i++)
+        sendbuf[i] = i * 131 + (i >> 12);
+
+    /*接收线程的CPU时间，不包含发送线程与页缓存回写*/
+    printf("block: %d MB, receiver cpu time only (excluding writeback)\n", mb);
+    run(INGEST_MMAP);
+    run(INGEST_SPLICE);
+    run(INGEST_DIRECT);
+    return 0;
+}
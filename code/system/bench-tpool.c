@@ -0,0 +1,155 @@
+/*线程池基准：同一份代码分别与tpool.c、tpool_fifo.c链接，比较任务吞吐量、唤醒延迟与混合负载下的握手延迟*/
+#include "tpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef POOL_NAME
+#define POOL_NAME "tpool"
+#endif
+
+#define THROUGHPUT_TASKS 1000000 //吞吐量测试的任务数
+#define LATENCY_SAMPLES 2000     //唤醒延迟测试的次数
+#define LATENCY_GAP_US 200       //两次唤醒之间的间隔，保证线程已经休眠
+#define MIXED_SAMPLES 1000       //混合负载下握手任务的次数
+#define MIXED_GAP_US 1000        //两次握手之间的间隔
+#define BULK_PER_THREAD 4        //每个线程对应的未完成文件块任务数
+#define BULK_SPIN 200000         //一个文件块任务的计算量
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static long done_count;
+static long done_target;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*完成一个任务，完成数达到目标时通知主线程*/
+static void task_done()
+{
+    if (__atomic_add_fetch(&done_count, 1, __ATOMIC_ACQ_REL) == done_target)
+    {
+        pthread_mutex_lock(&done_lock);
+        pthread_cond_signal(&done_cond);
+        pthread_mutex_unlock(&done_lock);
+    }
+}
+
+static void wait_done(long target)
+{
+    pthread_mutex_lock(&done_lock);
+    while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) < target)
+        pthread_cond_wait(&done_cond, &done_lock);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void *empty_task(void *arg)
+{
+    task_done();
+    return NULL;
+}
+
+/*记录从提交到开始执行的时间*/
+static void *latency_task(void *arg)
+{
+    double *sample = (double *)arg;
+    *sample = now() - *sample;
+    task_done();
+    return NULL;
+}
+
+/*混合负载：文件块任务不断重新提交自己，直到bulk_stop*/
+static int bulk_stop;
+static long bulk_running;
+
+static void *bulk_task(void *arg)
+{
+    volatile unsigned x = 0;
+    int i;
+    for (i = 0; i < BULK_SPIN; i++)
+        x += i;
+    if (__atomic_load_n(&bulk_stop, __ATOMIC_ACQUIRE))
+        __atomic_sub_fetch(&bulk_running, 1, __ATOMIC_ACQ_REL);
+    else
+        tpool_add_work_prio(bulk_task, NULL, TPOOL_PRIO_DATA);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int nthreads)
+{
+    tpool_create(nthreads);
+
+    /*吞吐量：一个线程外的提交者（模拟epoll线程）连续提交空任务*/
+    done_count = 0;
+    done_target = THROUGHPUT_TASKS;
+    double start = now();
+    long i;
+    for (i = 0; i < THROUGHPUT_TASKS; i++)
+        tpool_add_work(empty_task, NULL);
+    wait_done(THROUGHPUT_TASKS);
+    double elapsed = now() - start;
+
+    /*唤醒延迟：线程池空闲时提交一个任务*/
+    static double samples[LATENCY_SAMPLES];
+    done_count = 0;
+    for (i = 0; i < LATENCY_SAMPLES; i++)
+    {
+        usleep(LATENCY_GAP_US);
+        done_target = i + 1;
+        samples[i] = now();
+        tpool_add_work(latency_task, &samples[i]);
+        wait_done(i + 1);
+    }
+    qsort(samples, LATENCY_SAMPLES, sizeof(double), cmp_double);
+
+    printf("%-14s %3d threads  %10.0f tasks/s  wakeup p50 %7.1f us  p99 %7.1f us\n",
+           POOL_NAME, nthreads, THROUGHPUT_TASKS / elapsed,
+           samples[LATENCY_SAMPLES / 2] * 1e6, samples[LATENCY_SAMPLES * 99 / 100] * 1e6);
+
+    /*握手延迟：线程池被文件块任务占满时提交控制面任务*/
+    static double handshakes[MIXED_SAMPLES];
+    bulk_stop = 0;
+    bulk_running = nthreads * BULK_PER_THREAD;
+    for (i = 0; i < bulk_running; i++)
+        tpool_add_work_prio(bulk_task, NULL, TPOOL_PRIO_DATA);
+    done_count = 0;
+    for (i = 0; i < MIXED_SAMPLES; i++)
+    {
+        usleep(MIXED_GAP_US);
+        done_target = i + 1;
+        handshakes[i] = now();
+        tpool_add_work_prio(latency_task, &handshakes[i], TPOOL_PRIO_CTRL);
+        wait_done(i + 1);
+    }
+    __atomic_store_n(&bulk_stop, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&bulk_running, __ATOMIC_ACQUIRE) > 0)
+        usleep(1000);
+    qsort(handshakes, MIXED_SAMPLES, sizeof(double), cmp_double);
+
+    printf("%-14s %3d threads  handshake under bulk load  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us\n",
+           POOL_NAME, nthreads, handshakes[MIXED_SAMPLES / 2] * 1e6,
+           handshakes[MIXED_SAMPLES * 99 / 100] * 1e6, handshakes[MIXED_SAMPLES * 999 / 1000] * 1e6);
+
+    tpool_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    int threads[] = {8, 16, 64};
+    int i;
+    for (i = 0; i < 3; i++)
+        run(threads[i]);
+    return 0;
+}
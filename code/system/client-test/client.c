@@ -1,105 +1,466 @@
 #include "tpool.h"
 #include "work.h"
+#include "../config.h"
+#include <getopt.h>
 
-int port = PORT; //默认Port
-char *mbegin;    //map起始地址
+char *server_ip = SERVER_IP;       //Server IP
+int port = PORT;                   //默认Port
+int64_t blocksize = 0;             //分块大小，0表示按文件大小自动选择
+int nstreams = 0;                  //发送线程数，0表示按核数自动选择
+int send_size = 0;                 //copy方式一次send的长度，0表示按tcp_wmem自动选择
+int upload_mode = UPLOAD_SENDFILE; //文件块发送方式
+int persistent = 1;                //发送线程复用数据连接，-C时每个文件块新建连接
+int ack_timeout = ACK_TIMEOUT;     //等待确认的秒数，超时后查询缺少的分块
 
-int main(int argc, char **argv)
+/*一个待发送的文件*/
+struct upload
+{
+    char *filename;
+    int fd;                //源文件fd，sendfile使用
+    char *mbegin;          //map起始地址，zerocopy/copy使用
+    struct stat filestat;
+    struct fileinfo finfo;
+    int64_t last_bs;       //最后一个分块的大小，0表示是标准分块
+    int freeid;            //Server分配的id
+    int info_fd;           //信息交换socket
+    int missing;           //Server缺少的分块数
+    unsigned char *bitmap; //Server已接收分块的位图，续传时只发送位为0的分块
+    int failed;            //有文件块重发后仍然失败，立即查询缺少的分块
+    int done;              //1：已确认，-1：失败，0：等待确认或需要重发
+};
+
+static void usage(char *prog)
+{
+    printf("usage: %s [--config=file] [-j streams] [-b blocksize] [-u sendfile|zerocopy|copy] [-C]\n"
+           "       [--send-size=size] [--ack-timeout=secs] [--server=ip] [--port=port] [--tune] file...\n",
+           prog);
+    exit(-1);
+}
+
+/*长选项，配置文件中的key与长选项同名*/
+#define OPT_SEND_SIZE 256
+#define OPT_SERVER 257
+#define OPT_PORT 258
+#define OPT_CONFIG 259
+#define OPT_TUNE 260
+#define OPT_ACK_TIMEOUT 261
+
+static struct option long_options[] = {
+    {"streams", required_argument, NULL, 'j'},
+    {"block-size", required_argument, NULL, 'b'},
+    {"upload", required_argument, NULL, 'u'},
+    {"per-block", no_argument, NULL, 'C'},
+    {"send-size", required_argument, NULL, OPT_SEND_SIZE},
+    {"server", required_argument, NULL, OPT_SERVER},
+    {"port", required_argument, NULL, OPT_PORT},
+    {"config", required_argument, NULL, OPT_CONFIG},
+    {"tune", no_argument, NULL, OPT_TUNE},
+    {"ack-timeout", required_argument, NULL, OPT_ACK_TIMEOUT},
+    {NULL, 0, NULL, 0}};
+
+/*-b未指定时的分块大小：分块数取nstreams的整数倍，每个发送线程分到同样多的数据，每块不超过BLOCKSIZE*/
+static int64_t auto_blocksize(char **files, int nfiles)
 {
-    //初始化Client
-    int info_fd = Client_init(SERVER_IP);
+    int64_t total = 0;
+    int i;
+    for (i = 0; i < nfiles; i++)
+    {
+        struct stat st;
+        if (stat(files[i], &st) == -1)
+        {
+            perror(files[i]);
+            exit(-1);
+        }
+        total += st.st_size;
+    }
+    if (total == 0)
+        return BLOCK_ALIGN;
 
-    char *filename = argv[1];
-    printf("BLOCKSIZE=  %d\n", BLOCKSIZE);
-    int fd = 0;
+    int64_t round = (int64_t)nstreams * BLOCKSIZE; //一轮每个线程发送一个最大分块
+    int64_t nblocks = (total + round - 1) / round * nstreams;
+    int64_t bs = (total + nblocks - 1) / nblocks;
+    return (bs + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+}
 
-    if ((fd = open(filename, O_RDWR)) == -1)
+/*打开文件，发送文件信息，接收Server分配的ID*/
+static void upload_open(struct upload *u, char *filename)
+{
+    u->filename = filename;
+    if ((u->fd = open(filename, O_RDONLY)) == -1)
     {
         printf("open erro ！\n");
         exit(-1);
     }
+    fstat(u->fd, &u->filestat);
 
-    //计时器
-    printf("Timer start!\n");
-    time_t t_start, t_end;
-    t_start = time(NULL);
+    //sendfile直接使用fd，其余方式从map内存发送
+    if (upload_mode != UPLOAD_SENDFILE)
+    {
+        u->mbegin = (char *)mmap(NULL, u->filestat.st_size, PROT_READ, MAP_SHARED, u->fd, 0);
+        if (u->mbegin == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(-1);
+        }
+    }
 
-    //发送文件信息
-    struct stat filestat;
-    fstat(fd, &filestat);
-    int last_bs = 0;
-    struct fileinfo finfo;
-    send_fileinfo(info_fd, filename, &filestat, &finfo, &last_bs);
+    //发送文件信息，info_fd由Server在文件接收完毕时关闭；Server没有响应时读取超时，不会永远阻塞
+    u->info_fd = Client_init(server_ip);
+    struct timeval tv = {ack_timeout, 0};
+    setsockopt(u->info_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    u->last_bs = 0;
+    send_fileinfo(u->info_fd, filename, &u->filestat, &u->finfo, &u->last_bs);
 
     //接收Server分配的ID
     char id_buf[INT_SIZE] = {0};
-    int n = 0;
-    for (n = 0; n < INT_SIZE; n++)
+    if (recv_all(u->info_fd, id_buf, INT_SIZE) < 0)
     {
-        read(info_fd, &id_buf[n], 1);
+        printf("recv id erro !\n");
+        exit(-1);
+    }
+    u->freeid = *((int *)id_buf);
+    printf("freeid = %d\n", u->freeid);
+    if (u->freeid == ID_BADVERSION)
+    {
+        printf("server does not speak protocol version %d\n", PROTO_VERSION);
+        exit(-1);
+    }
+    if (u->freeid == ID_INVALID)
+    {
+        printf("%s: server rejected the file info (size %lld, %d blocks of %lld)\n",
+               filename, (long long)u->finfo.filesize, u->finfo.count, (long long)u->finfo.bs);
+        exit(-1);
+    }
+    if (u->freeid < 0)
+    {
+        printf("server is busy, try again later\n");
+        exit(-1);
     }
-    int freeid = *((int *)id_buf);
-    printf("freeid = %d\n", freeid);
 
-    //map，关闭fd
-    mbegin = (char *)mmap(NULL, filestat.st_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
-    close(fd);
+    //接收缺少的分块数，Server已有部分分块时是一次续传
+    if (recv_all(u->info_fd, (char *)&u->missing, INT_SIZE) < 0)
+    {
+        printf("recv missing blocks erro !\n");
+        exit(-1);
+    }
+    int bitmap_len = (u->finfo.count + 7) / 8;
+    u->bitmap = (unsigned char *)calloc(bitmap_len, 1);
+    if (u->missing > 0 && recv_all(u->info_fd, (char *)u->bitmap, bitmap_len) < 0)
+    {
+        printf("recv bitmap erro !\n");
+        exit(-1);
+    }
+    printf("%s: %d of %d blocks to send\n", filename, u->missing, u->finfo.count);
+}
 
-    //向任务队列添加任务
-    int j = 0, num = finfo.count, offset = 0;
-    pthread_t pid[num];
-    memset(pid, 0, num * sizeof(pthread_t));
-    int head_len = sizeof(struct head);
-    //文件可以被标准分块
-    if (last_bs == 0)
+/*把Server缺少的分块加入任务队列*/
+static void upload_queue(struct upload *u)
+{
+    int j = 0, num = u->finfo.count;
+    int64_t offset = 0;
+    for (j = 0; j < num; j++)
     {
-        for (j = 0; j < num; j++)
+        struct block *b = new_block(u->filename, u->freeid, &offset, u->fd, u->mbegin, &u->failed);
+        if (u->bitmap[j / 8] & (1 << (j % 8)))
+        {
+            free(b);
+            continue;
+        }
+        //最后一个分块可能不足一个标准分块
+        if (j == num - 1 && u->last_bs != 0)
+            b->fhead.bs = u->last_bs;
+        if (tpool_add_work(send_filedata, (void *)b) != 0)
+        {
+            printf("tpool_add_work failed\n");
+            exit(-1);
+        }
+    }
+}
+
+/*
+ * 等待Server的确认。没有文件块失败时最多等待ack_timeout秒，超时或有文件块失败时在info_fd上查询缺少的分块：
+ * 确认与查询的回复在同一连接上按顺序到达，已经接收完毕的文件先收到确认，不会重发。
+ * 收到确认返回1；Server缺少分块时更新位图返回0，由调用者重发；Server断开或确认失败返回-1。
+ */
+static int upload_wait(struct upload *u)
+{
+    int query = __atomic_exchange_n(&u->failed, 0, __ATOMIC_ACQ_REL);
+    while (1)
+    {
+        if (!query)
+        {
+            struct pollfd pfd = {u->info_fd, POLLIN, 0};
+            int n = poll(&pfd, 1, ack_timeout * 1000);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == 0)
+                printf("%s: no ack in %ds, query missing blocks\n", u->filename, ack_timeout);
+            query = n == 0;
+        }
+        /*Server已经确认并关闭info_fd时查询发送失败，确认仍在接收缓冲区中*/
+        if (query)
+        {
+            int frame[2] = {FRAME_TYPE(TYPE_QUERY), u->freeid};
+            send_all(u->info_fd, (char *)frame, sizeof(frame));
+            query = 0;
+        }
+
+        struct file_ack ack;
+        if (recv_all(u->info_fd, (char *)&ack, sizeof(ack)) < 0)
+            return -1;
+        if (ack.status != ACK_MISSING)
         {
-            struct head *p_fhead = new_fb_head(filename, freeid, &offset);
-            if (pthread_create(&pid[j], NULL, send_filedata, (void *)p_fhead) != 0)
+            if (ack.status != 0)
             {
-                printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
-                exit(-1);
+                printf("%s: not acknowledged by server\n", u->filename);
+                return -1;
             }
+            printf("%s: stored%s\n", u->filename, ack.durable ? " (durable)" : "");
+            return 1;
+        }
+
+        /*查询的回复；缺少0块时Server正在同步，继续等待确认*/
+        if (recv_all(u->info_fd, (char *)&u->missing, INT_SIZE) < 0 ||
+            (u->missing > 0 && recv_all(u->info_fd, (char *)u->bitmap, (u->finfo.count + 7) / 8) < 0))
+            return -1;
+        if (u->missing > 0)
+        {
+            printf("%s: server is missing %d block(s), resend\n", u->filename, u->missing);
+            return 0;
         }
     }
-    //文件不能被标准分块
-    else
+}
+
+/*上传所有文件并等待Server确认，返回用时（秒），失败返回-1；total返回需要发送的字节数*/
+static double upload_files(char **files, int nfiles, int64_t *total)
+{
+    printf("BLOCKSIZE=  %lld, streams= %d, %s connections\n", (long long)blocksize, nstreams, persistent ? "persistent" : "per-block");
+
+    //计时器
+    printf("Timer start!\n");
+    struct timespec t_start, t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    //注册所有文件
+    int i;
+    *total = 0; //按标准分块估算
+    struct upload *uploads = (struct upload *)calloc(nfiles, sizeof(struct upload));
+    for (i = 0; i < nfiles; i++)
+    {
+        upload_open(&uploads[i], files[i]);
+        *total += uploads[i].missing * blocksize;
+    }
+
+    //nstreams个发送线程依次取出文件块发送，文件块再多也不增加线程和连接
+    if (tpool_create(nstreams) != 0)
+    {
+        printf("tpool_create failed\n");
+        exit(-1);
+    }
+    for (i = 0; i < nfiles; i++)
+        upload_queue(&uploads[i]);
+
+    /*
+     * 等待所有文件块发送完毕，回收线程；再等待Server确认每个文件。Server缺少分块时
+     * （文件块重发后仍然失败，或者发出的文件块被Server丢弃）按查询到的位图重发，最多UPLOAD_ROUNDS轮；
+     * 仍然失败时关闭info_fd，Server中止传输并保留续传文件。
+     */
+    int failed = 0, round;
+    for (round = 0;; round++)
     {
-        for (j = 0; j < num - 1; j++)
+        tpool_destroy();
+        int resend = 0;
+        for (i = 0; i < nfiles; i++)
         {
-            struct head *p_fhead = new_fb_head(filename, freeid, &offset);
-            if (pthread_create(&pid[j], NULL, send_filedata, (void *)p_fhead) != 0)
+            struct upload *u = &uploads[i];
+            if (u->done)
+                continue;
+            int ret = upload_wait(u);
+            if (ret == 0 && round < UPLOAD_ROUNDS)
             {
-                printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
-                exit(-1);
+                resend = 1;
+                *total += u->missing * blocksize;
+                continue;
+            }
+            u->done = ret == 1 ? 1 : -1;
+            if (u->done < 0)
+            {
+                printf("%s: upload failed, run again to resume\n", u->filename);
+                failed = 1;
             }
+            close(u->info_fd);
         }
-        //最后一个分块
-        struct head *p_fhead = (struct head *)malloc(head_len);
-        bzero(p_fhead, head_len);
-        strcpy(p_fhead->filename, filename);
-        p_fhead->id = freeid;
-        p_fhead->offset = offset;
-        p_fhead->bs = last_bs;
-
-        if (pthread_create(&pid[j], NULL, send_filedata, (void *)p_fhead) != 0)
+        if (!resend)
+            break;
+
+        if (tpool_create(nstreams) != 0)
         {
-            printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
+            printf("tpool_create failed\n");
             exit(-1);
         }
+        for (i = 0; i < nfiles; i++)
+        {
+            if (!uploads[i].done)
+                upload_queue(&uploads[i]);
+        }
     }
 
-    //回收线程
-    for (j = 0; j < num; ++j)
+    //释放源文件
+    for (i = 0; i < nfiles; i++)
     {
-        pthread_join(pid[j], NULL);
+        if (upload_mode != UPLOAD_SENDFILE)
+            munmap(uploads[i].mbegin, uploads[i].filestat.st_size);
+        close(uploads[i].fd);
+        free(uploads[i].bitmap);
     }
+    free(uploads);
 
     //终止计时器
-    t_end = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double secs = t_end.tv_sec - t_start.tv_sec + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+    printf("共用时%.2fs\n", secs);
+    return failed ? -1 : secs;
+}
+
+/*--tune：依次用不同的分块大小（copy方式还有send长度）上传，打印最快的组合（配置文件格式）*/
+static void tune(char **files, int nfiles)
+{
+    int64_t auto_bs = blocksize;
+    int64_t sizes[] = {0, 1 << 20, 4 << 20, 16 << 20, 64 << 20, 256 << 20};
+    int sends[] = {32768, 65536, 131072, 262144};
+    int nsends = upload_mode == UPLOAD_COPY ? sizeof(sends) / sizeof(sends[0]) : 1;
+    int64_t best_bs = auto_bs;
+    int best_send = send_size;
+    double best_rate = 0;
+    char report[4096] = {0};
+    int i, j;
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        /*0表示自动选择的分块大小；大于自动分块的取值会让部分线程空闲，不再尝试*/
+        blocksize = sizes[i] ? sizes[i] : auto_bs;
+        if (sizes[i] && sizes[i] >= auto_bs)
+            break;
+        for (j = 0; j < nsends; j++)
+        {
+            if (upload_mode == UPLOAD_COPY)
+                send_size = sends[j];
+            int64_t total;
+            double secs = upload_files(files, nfiles, &total);
+            if (secs < 0)
+                exit(-1);
+            double rate = total / (secs > 0 ? secs : 1e-9) / 1e6;
+            snprintf(report + strlen(report), sizeof(report) - strlen(report), "block %6lldK  send %5dK  %8.2f MB/s%s\n",
+                     (long long)(blocksize >> 10), send_size >> 10, rate, sizes[i] ? "" : "  (auto)");
+            if (rate > best_rate)
+            {
+                best_rate = rate;
+                best_bs = blocksize;
+                best_send = send_size;
+            }
+        }
+    }
+
+    printf("\n--- tune: %d stream(s), %s ---\n%s", nstreams, upload_mode == UPLOAD_COPY ? "copy" : "send size not used", report);
+    printf("# best of --tune, add to the --config file\n");
+    printf("block-size = %lldK\n", (long long)(best_bs >> 10));
+    if (upload_mode == UPLOAD_COPY)
+        printf("send-size = %dK\n", best_send >> 10);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    //Server断开数据连接时send返回错误，文件块重发，不能被SIGPIPE终止
+    signal(SIGPIPE, SIG_IGN);
+
+    //配置文件的内容排在命令行参数之前，命令行覆盖配置文件
+    argv = config_args(argc, argv, &argc);
+
+    //解析命令行参数
+    int do_tune = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:b:u:C", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            nstreams = atoi(optarg);
+            if (nstreams < 1)
+                usage(argv[0]);
+            break;
+        case 'b':
+            blocksize = config_size(optarg);
+            if (blocksize <= 0)
+                usage(argv[0]);
+            break;
+        case 'u':
+            if (strcmp(optarg, "sendfile") == 0)
+                upload_mode = UPLOAD_SENDFILE;
+            else if (strcmp(optarg, "zerocopy") == 0)
+                upload_mode = UPLOAD_ZEROCOPY;
+            else if (strcmp(optarg, "copy") == 0)
+                upload_mode = UPLOAD_COPY;
+            else
+                usage(argv[0]);
+            break;
+        case 'C':
+            persistent = 0;
+            break;
+        case OPT_SEND_SIZE:
+            send_size = config_size(optarg);
+            if (send_size < SEND_MIN || send_size > SEND_MAX)
+                usage(argv[0]);
+            break;
+        case OPT_SERVER:
+            server_ip = optarg;
+            break;
+        case OPT_PORT:
+            port = atoi(optarg);
+            break;
+        case OPT_CONFIG:
+            break;
+        case OPT_TUNE:
+            do_tune = 1;
+            break;
+        case OPT_ACK_TIMEOUT:
+            ack_timeout = atoi(optarg);
+            if (ack_timeout < 1)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        usage(argv[0]);
+    char **files = argv + optind;
+    int nfiles = argc - optind;
+
+    //未指定的参数按核数、文件大小、socket发送缓冲区选择
+    if (nstreams == 0)
+    {
+        int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nstreams = ncpus < STREAMS_AUTO ? ncpus : STREAMS_AUTO;
+        if (nstreams < THREAD_NUM)
+            nstreams = THREAD_NUM;
+    }
+    if (send_size == 0)
+        send_size = config_clamp_pow2(config_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2, SEND_SIZE), SEND_MIN, SEND_MAX);
+    if (blocksize == 0)
+        blocksize = auto_blocksize(files, nfiles);
+
+    if (do_tune)
+        tune(files, nfiles);
+
+    int64_t total;
+    double secs = upload_files(files, nfiles, &total);
     printf("Master prosess exit!\n");
-    printf("共用时%.0fs\n", difftime(t_end, t_start));
 
-    return 0;
+    //进程消耗的CPU时间，比较不同发送方式每GB的开销
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    printf("cpu %.3fs, %.3fs/GB\n", cpu, total > 0 ? cpu * 1073741824.0 / total : 0);
+
+    return secs < 0 ? -1 : 0;
 }
@@ -22,8 +22,8 @@ static void *thread_routine(void *arg)
             pthread_cond_wait(&tpool->queue_ready, &tpool->queue_lock);
         }
 
-        /*查看线程池开关，如果线程池关闭，线程退出*/
-        if (tpool->shutdown)
+        /*线程池关闭且任务链表中的任务都已取走，线程退出*/
+        if (tpool->shutdown && !tpool->queue_head)
         {
             pthread_mutex_unlock(&tpool->queue_lock);
             pthread_exit(NULL);
@@ -91,7 +91,7 @@ int tpool_create(int max_thr_num)
     return 0;
 }
 
-/* 销毁线程池 */
+/* 销毁线程池，等待已添加的任务执行完毕 */
 void tpool_destroy()
 {
     int i;
@@ -101,11 +101,9 @@ void tpool_destroy()
     {
         return;
     }
-    /*关闭线程池开关*/
-    tpool->shutdown = 1;
-
-    /* 唤醒所有阻塞的线程 */
+    /*关闭线程池开关，唤醒所有阻塞的线程*/
     pthread_mutex_lock(&tpool->queue_lock);
+    tpool->shutdown = 1;
     pthread_cond_broadcast(&tpool->queue_ready);
     pthread_mutex_unlock(&tpool->queue_lock);
 
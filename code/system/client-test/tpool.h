@@ -25,7 +25,7 @@ typedef struct tpool
 //创建线程池
 int tpool_create(int max_thr_num);
 
-//销毁线程池
+//销毁线程池，已添加的任务执行完毕后返回
 void tpool_destroy();
 
 //向线程池中添加任务
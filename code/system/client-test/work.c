@@ -1,120 +1,318 @@
 #include "work.h"
+#include "tpool.h"
 
 /*信息交换sockfd*/
 int info_fd;
 
-extern char *mbegin;
+extern char *server_ip;
 extern int port;
+extern int64_t blocksize;
+extern int send_size;
+extern int upload_mode;
+extern int persistent;
+
+/*发送线程的长连接，第一次发送文件块时建立；以及这条连接上MSG_ZEROCOPY send的次数*/
+static __thread int data_fd = -1;
+static __thread int zc_count = 0;
+
+/*发送线程退出时关闭长连接，线程池重建（--tune）时不残留连接；值为fd+1*/
+static pthread_key_t data_key;
+static pthread_once_t data_once = PTHREAD_ONCE_INIT;
 
 /*结构体长度*/
 int fileinfo_len = sizeof(struct fileinfo);
 socklen_t sockaddr_len = sizeof(struct sockaddr);
 int head_len = sizeof(struct head);
 
-int createfile(char *filename, int size)
+int createfile(char *filename, int64_t size)
 {
     int fd = open(filename, O_RDWR | O_CREAT);
     fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    lseek(fd, size - 1, SEEK_SET);
+    lseek(fd, (off_t)size - 1, SEEK_SET);
     write(fd, "", 1);
     close(fd);
     return 0;
 }
 
-struct head *new_fb_head(char *filename, int freeid, int *offset)
+int send_all(int sock_fd, const char *buf, int len)
+{
+    int sent = 0;
+    while (sent < len)
+    {
+        int n = send(sock_fd, buf + sent, len - sent, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+int recv_all(int sock_fd, char *buf, int len)
 {
-    struct head *p_fhead = (struct head *)malloc(head_len);
-    bzero(p_fhead, head_len);
-    strcpy(p_fhead->filename, filename);
-    p_fhead->id = freeid;
-    p_fhead->offset = *offset;
-    p_fhead->bs = BLOCKSIZE;
-    *offset += BLOCKSIZE;
-    return p_fhead;
+    int got = 0;
+    while (got < len)
+    {
+        int n = recv(sock_fd, buf + got, len - got, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
 }
 
-void send_fileinfo(int sock_fd, char *fname, struct stat *p_fstat, struct fileinfo *p_finfo, int *p_last_bs)
+int send_frame(int sock_fd, int type, const void *body, int len)
+{
+    char send_buf[100] = {0};
+    memcpy(send_buf, &type, INT_SIZE);
+    memcpy(send_buf + INT_SIZE, body, len);
+    return send_all(sock_fd, send_buf, INT_SIZE + len);
+}
+
+struct block *new_block(char *filename, int freeid, int64_t *offset, int src_fd, char *mbegin, int *failed)
+{
+    struct block *b = (struct block *)malloc(sizeof(struct block));
+    bzero(b, sizeof(struct block));
+    strcpy(b->fhead.filename, filename);
+    b->fhead.id = freeid;
+    b->fhead.offset = *offset;
+    b->fhead.bs = blocksize;
+    b->src_fd = src_fd;
+    b->mbegin = mbegin;
+    b->failed = failed;
+    *offset += blocksize;
+    return b;
+}
+
+void send_fileinfo(int sock_fd, char *fname, struct stat *p_fstat, struct fileinfo *p_finfo, int64_t *p_last_bs)
 {
     /*初始化fileinfo*/
     bzero(p_finfo, fileinfo_len);
     strcpy(p_finfo->filename, fname);
     p_finfo->filesize = p_fstat->st_size;
+    p_finfo->mtime = p_fstat->st_mtime;
 
     /*最后一个分块可能不足一个标准分块*/
-    int count = p_fstat->st_size / BLOCKSIZE;
-    if (p_fstat->st_size % BLOCKSIZE == 0)
+    int count = p_fstat->st_size / blocksize;
+    if (p_fstat->st_size % blocksize == 0)
     {
         p_finfo->count = count;
     }
     else
     {
         p_finfo->count = count + 1;
-        *p_last_bs = p_fstat->st_size - BLOCKSIZE * count;
+        *p_last_bs = p_fstat->st_size - blocksize * count;
     }
-    p_finfo->bs = BLOCKSIZE;
+    p_finfo->bs = blocksize;
 
     /*发送type和文件信息*/
-    char send_buf[100] = {0};
-    int type = 0;
-    memcpy(send_buf, &type, INT_SIZE);
-    memcpy(send_buf + INT_SIZE, p_finfo, fileinfo_len);
-    send(sock_fd, send_buf, fileinfo_len + INT_SIZE, 0);
+    if (send_frame(sock_fd, FRAME_TYPE(TYPE_FILEINFO), p_finfo, fileinfo_len) < 0)
+    {
+        perror("send fileinfo");
+        exit(-1);
+    }
 
     printf("-------- fileinfo -------\n");
-    printf("filename= %s\nfilesize= %d\ncount= %d\nblocksize= %d\n", p_finfo->filename, p_finfo->filesize, p_finfo->count, p_finfo->bs);
+    printf("filename= %s\nfilesize= %lld\ncount= %d\nblocksize= %lld\n", p_finfo->filename, (long long)p_finfo->filesize, p_finfo->count, (long long)p_finfo->bs);
     printf("-------------------------\n");
     return;
 }
 
-void *send_filedata(void *args)
+int upload_copy(int sock_fd, char *buf, int64_t size)
 {
-    struct head *p_fhead = (struct head *)args;
-    printf("------- blockhead -------\n");
-    printf("filename= %s\nThe filedata id= %d\noffset= %d\nbs= %d\n", p_fhead->filename, p_fhead->id, p_fhead->offset, p_fhead->bs);
-    printf("-------------------------\n");
+    while (size > 0)
+    {
+        int len = size < send_size ? size : send_size;
+        if (send_all(sock_fd, buf, len) < 0)
+            return -1;
+        buf += len;
+        size -= len;
+    }
+    return 0;
+}
 
-    int sock_fd = Client_init(SERVER_IP);
-    //set_fd_noblock(sock_fd);
+int upload_sendfile(int sock_fd, int src_fd, off_t offset, int64_t size)
+{
+    while (size > 0)
+    {
+        /*一次最多发送SENDFILE_MAX，返回值小于请求长度时从新的offset继续*/
+        ssize_t n = sendfile(sock_fd, src_fd, &offset, size < SENDFILE_MAX ? size : SENDFILE_MAX);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        size -= n;
+    }
+    return 0;
+}
 
-    /*发送type和数据块头部*/
-    char send_buf[100] = {0};
-    int type = 255;
-    memcpy(send_buf, &type, INT_SIZE);
-    memcpy(send_buf + INT_SIZE, p_fhead, head_len);
-    int sendsize = 0, len = head_len + INT_SIZE;
-    char *p = send_buf;
+/*读取错误队列中的MSG_ZEROCOPY完成通知，返回已完成的send次数；wait为1时没有通知就等待*/
+static int zerocopy_reap(int sock_fd, int done, int wait)
+{
     while (1)
     {
-        if ((send(sock_fd, p, 1, 0) > 0))
+        char control[128];
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
         {
-            ++sendsize;
-            if (sendsize == len)
-                break;
-            ++p;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || !wait)
+                return done;
+            /*通知到达时socket上报POLLERR*/
+            struct pollfd pfd = {sock_fd, 0, 0};
+            poll(&pfd, 1, -1);
+            continue;
         }
+
+        /*一个通知覆盖[ee_info, ee_data]范围内的send，按顺序完成*/
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                done = serr->ee_data + 1;
+        }
+        return done;
     }
-    //	printf("head_len = %d ; send head: sendsize = %d\n",head_len, sendsize);
+}
 
-    /*发送数据块*/
-    printf("Thread : send filedata\n");
-    int i = 0, send_size = 0, num = p_fhead->bs / SEND_SIZE;
-    char *fp = mbegin + p_fhead->offset;
-    for (i = 0; i < num; i++)
+int upload_zerocopy(int sock_fd, char *buf, int64_t size)
+{
+    int one = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+        return upload_copy(sock_fd, buf, size);
+
+    int sent = zc_count, done = zc_count; //连接上成功的send次数，已完成的send次数
+    while (size > 0)
     {
-        if ((send_size = send(sock_fd, fp, SEND_SIZE, 0)) == SEND_SIZE)
+        int n = send(sock_fd, buf, size < ZEROCOPY_SIZE ? size : ZEROCOPY_SIZE, MSG_ZEROCOPY);
+        if (n == -1 && errno == EINTR)
+            continue;
+        /*未完成的通知过多，内核拒绝固定更多页面，等待一个通知后重试*/
+        if (n == -1 && errno == ENOBUFS)
         {
-            fp += SEND_SIZE;
-            //			printf("fp = %p ; a SEND_SIZE ok\n", fp);
+            done = zerocopy_reap(sock_fd, done, 1);
+            continue;
         }
-        else
+        if (n <= 0)
+            return -1;
+        sent++;
+        buf += n;
+        size -= n;
+        done = zerocopy_reap(sock_fd, done, 0);
+    }
+
+    /*等待所有页面被内核释放*/
+    while (done < sent)
+        done = zerocopy_reap(sock_fd, done, 1);
+    zc_count = sent;
+    return 0;
+}
+
+static void data_close(void *value)
+{
+    close((int)(intptr_t)value - 1);
+}
+
+static void data_key_create()
+{
+    pthread_key_create(&data_key, data_close);
+}
+
+/*取得发送线程的数据连接：长连接模式下复用，否则每个文件块新建*/
+static int data_conn()
+{
+    if (persistent && data_fd >= 0)
+        return data_fd;
+    zc_count = 0;
+    int sock_fd = Client_init(server_ip);
+    if (persistent)
+    {
+        data_fd = sock_fd;
+        pthread_once(&data_once, data_key_create);
+        pthread_setspecific(data_key, (void *)(intptr_t)(sock_fd + 1));
+    }
+    return sock_fd;
+}
+
+/*文件块发送结束：出错时关闭连接，下一个文件块重新建立*/
+static void data_done(int sock_fd, int err)
+{
+    if (persistent && !err)
+        return;
+    close(sock_fd);
+    if (sock_fd == data_fd)
+    {
+        data_fd = -1;
+        pthread_setspecific(data_key, NULL);
+    }
+}
+
+/*文件块发送失败：复制一份重新加入任务队列（原来的由线程池释放），下次从新的数据连接发送；次数用完时标记文件失败*/
+static void block_retry(struct block *b)
+{
+    if (b->retries < BLOCK_RETRIES)
+    {
+        struct block *copy = (struct block *)malloc(sizeof(struct block));
+        if (copy)
         {
-            //			printf("send_size = %d ;  a SEND_SIZE erro\n",send_size);
+            *copy = *b;
+            copy->retries++;
+            printf("%s: resend block at %lld (%d/%d)\n", b->fhead.filename, (long long)b->fhead.offset, copy->retries, BLOCK_RETRIES);
+            if (tpool_add_work(send_filedata, copy) == 0)
+                return;
+            free(copy);
         }
     }
+    printf("%s: block at %lld dropped after %d retries\n", b->fhead.filename, (long long)b->fhead.offset, b->retries);
+    __atomic_store_n(b->failed, 1, __ATOMIC_RELEASE);
+}
+
+void *send_filedata(void *args)
+{
+    struct block *b = (struct block *)args;
+    struct head *p_fhead = &b->fhead;
+    printf("------- blockhead -------\n");
+    printf("filename= %s\nThe filedata id= %d\noffset= %lld\nbs= %lld\n", p_fhead->filename, p_fhead->id, (long long)p_fhead->offset, (long long)p_fhead->bs);
+    printf("-------------------------\n");
+
+    int sock_fd = data_conn();
+
+    /*发送type和数据块头部，一次send*/
+    if (send_frame(sock_fd, FRAME_TYPE(TYPE_DATA), p_fhead, head_len) < 0)
+    {
+        perror("send blockhead");
+        data_done(sock_fd, 1);
+        block_retry(b);
+        return NULL;
+    }
+
+    /*发送数据块*/
+    printf("Thread : send filedata\n");
+    int ret;
+    if (upload_mode == UPLOAD_SENDFILE)
+        ret = upload_sendfile(sock_fd, b->src_fd, p_fhead->offset, p_fhead->bs);
+    else if (upload_mode == UPLOAD_ZEROCOPY)
+        ret = upload_zerocopy(sock_fd, b->mbegin + p_fhead->offset, p_fhead->bs);
+    else
+        ret = upload_copy(sock_fd, b->mbegin + p_fhead->offset, p_fhead->bs);
+    if (ret < 0)
+    {
+        perror("send filedata");
+        data_done(sock_fd, 1);
+        block_retry(b);
+        return NULL;
+    }
 
     printf("### send a fileblock ###\n");
-    close(sock_fd);
-    free(args);
+    data_done(sock_fd, 0);
     return NULL;
 }
 
@@ -20,43 +20,96 @@
 #include <sys/errno.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 
-#define SERVER_IP "127.0.0.1" //server IP
-#define PORT 10000            //Server端口
-#define THREAD_NUM 4          //线程池大小
+/*
+ * 以下为默认值与上下限，可用命令行或配置文件（--config）修改，
+ * 未指定时client按核数、文件大小、socket发送缓冲区大小自动选择
+ */
+#define SERVER_IP "127.0.0.1" //默认server IP（--server）
+#define PORT 10000            //默认Server端口（--port）
+#define THREAD_NUM 4          //发送线程数（-j）的下限，默认取核数，最多STREAMS_AUTO个
+#define STREAMS_AUTO 16       //自动选择的发送线程数上限
 #define FILENAME_MAXLEN 30    //文件名最大长度
 #define INT_SIZE 4            //int类型长度
 
-//#define SEND_SIZE    32768       	//32K
-#define SEND_SIZE 65536 //64K
-//#define SEND_SIZE	131072			//128K
-//#define SEND_SIZE	262144			//256K
+/*copy方式一次send的长度（--send-size），默认取tcp_wmem中发送缓冲区的上限*/
+#define SEND_SIZE 65536  //64K，读不到tcp_wmem时使用
+#define SEND_MIN 16384   //16K
+#define SEND_MAX 1048576 //1M
 
-//#define BLOCKSIZE   134217728		//128M
-//#define BLOCKSIZE   268435456		//256M
+/*文件块的发送方式（-u）*/
+#define UPLOAD_SENDFILE 0 //sendfile()从源文件直接发送，默认
+#define UPLOAD_ZEROCOPY 1 //从map内存send(MSG_ZEROCOPY)，内核不复制数据
+#define UPLOAD_COPY 2     //从map内存send()，每次send_size
+
+#define SENDFILE_MAX 1073741824 //一次sendfile的最大长度，1G
+#define BLOCK_RETRIES 3         //文件块发送失败后在新的数据连接上重发的次数
+#define ACK_TIMEOUT 10          //等待确认的秒数（--ack-timeout），超时后查询Server缺少的分块
+#define UPLOAD_ROUNDS 3         //查询到缺少的分块后重发的轮数
+#define ZEROCOPY_SIZE 1048576   //一次MSG_ZEROCOPY send的长度，1M
+
+/*分块大小（-b）：未指定时把所有文件平均分给各发送线程，每块不超过BLOCKSIZE，按BLOCK_ALIGN向上取整*/
 #define BLOCKSIZE 536870912 //512M
-//#define BLOCKSIZE	1073741824		//1G
+#define BLOCK_ALIGN 1048576 //1M
+
+/*
+ * 协议版本，与Server一致：每个连接开头的type = 版本 << 8 | 类型；版本3支持续传，版本4在文件接收完毕后确认，
+ * 版本5可以在信息交换socket上发送TYPE_QUERY与id查询缺少的分块
+ */
+#define PROTO_VERSION 5
+#define TYPE_FILEINFO 0                             //文件信息
+#define TYPE_QUERY 1                                //查询缺少的分块
+#define TYPE_DATA 255                               //文件块
+#define FRAME_TYPE(kind) (PROTO_VERSION << 8 | (kind)) //本版本的type
+#define ID_BUSY -1                                  //Server传输表已满
+#define ID_BADVERSION -2                            //协议版本不一致
+#define ID_INVALID -3                               //文件信息无效（大小、分块数、分块大小不一致）
 
 /*文件信息*/
 struct fileinfo
 {
     char filename[FILENAME_MAXLEN]; //文件名
-    int filesize;                   //文件大小
+    int64_t filesize;               //文件大小
     int count;                      //分块数量
-    int bs;                         //标准分块大小
+    int64_t bs;                     //标准分块大小
+    int64_t mtime;                  //源文件修改时间，Server据此判断能否续传
+};
+
+/*Server接收完文件后在信息交换socket上发送的确认*/
+#define ACK_MISSING 1 //不是确认：查询的回复，之后是缺少的分块数与位图
+
+struct file_ack
+{
+    int status;  //0表示成功，ACK_MISSING表示查询的回复
+    int durable; //1表示Server已经fdatasync（-d file）
 };
 
 /*分块头部信息*/
 struct head
 {
     char filename[FILENAME_MAXLEN]; //文件名
-    int id;                         //分块所属文件的id，gconn[CONN_MAX]数组的下标
-    int offset;                     //分块在原文件中偏移
-    int bs;                         //本文件块实际大小
+    int id;                         //分块所属文件的id，Server的传输表分配
+    int64_t offset;                 //分块在原文件中偏移
+    int64_t bs;                     //本文件块实际大小
+};
+
+/*发送线程的任务：一个文件块及其源文件*/
+struct block
+{
+    struct head fhead; //文件块头部
+    int src_fd;        //源文件fd，sendfile使用
+    char *mbegin;      //源文件map起始地址，zerocopy/copy使用
+    int retries;       //已经重发的次数
+    int *failed;       //所属文件的失败标记，重发BLOCK_RETRIES次仍失败时置位，之后向Server查询缺少的分块
 };
 
 /*创建大小为size的文件*/
-int createfile(char *filename, int size);
+int createfile(char *filename, int64_t size);
 
 /*设置fd非阻塞*/
 void set_fd_noblock(int fd);
@@ -74,12 +127,28 @@ void send_fileinfo(int sock_fd //要发送文件fd
                    ,
                    struct fileinfo *p_finfo //返回初始化后的文件信息
                    ,
-                   int *flag); //最后一个分块是否时标准分块，0代表是；1代表不是
+                   int64_t *flag); //最后一个分块是否时标准分块，0代表是；1代表不是
 
-/*发送文件数据块*/
+/*
+ * 发送文件数据块（struct block），作为线程池任务执行，args由线程池释放；长连接模式下复用发送线程的数据连接。
+ * 发送失败时关闭数据连接，把文件块重新加入任务队列，在新的连接上重发，最多BLOCK_RETRIES次，之后置位*failed，
+ * 等待确认时不再等到超时，直接查询Server缺少的分块。
+ */
 void *send_filedata(void *args);
 
-/*生成文件块头部*/
-struct head *new_fb_head(char *filename, int freeid, int *offset);
+/*发送文件块数据，处理部分发送与最后不足一次的部分，成功返回0，出错返回-1*/
+int upload_sendfile(int sock_fd, int src_fd, off_t offset, int64_t size);
+int upload_zerocopy(int sock_fd, char *buf, int64_t size);
+int upload_copy(int sock_fd, char *buf, int64_t size);
+
+/*发送/接收len字节，处理部分发送与EINTR，成功返回0，出错返回-1*/
+int send_all(int sock_fd, const char *buf, int len);
+int recv_all(int sock_fd, char *buf, int len);
+
+/*把type与头部拼成一帧，一次发出*/
+int send_frame(int sock_fd, int type, const void *body, int len);
+
+/*生成从*offset开始的标准文件块，*offset移到下一块*/
+struct block *new_block(char *filename, int freeid, int64_t *offset, int src_fd, char *mbegin, int *failed);
 
 #endif
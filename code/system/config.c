@@ -0,0 +1,145 @@
+#include "config.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_LINE 512 //配置文件一行的最大长度
+
+/*去掉首尾空白，返回新的起始位置*/
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+/*读取配置文件，每个有效行追加一个--key=value到args，返回追加后的个数*/
+static int config_read(const char *path, char ***args, int n)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        perror(path);
+        exit(-1);
+    }
+    char line[CONFIG_LINE];
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *key = trim(line);
+        if (*key == '\0')
+            continue;
+
+        char *arg;
+        char *eq = strchr(key, '=');
+        if (eq)
+        {
+            *eq = '\0';
+            char *value = trim(eq + 1);
+            key = trim(key);
+            arg = (char *)malloc(strlen(key) + strlen(value) + 4);
+            sprintf(arg, "--%s=%s", key, value);
+        }
+        else
+        {
+            arg = (char *)malloc(strlen(key) + 3);
+            sprintf(arg, "--%s", key);
+        }
+        *args = (char **)realloc(*args, (n + 2) * sizeof(char *));
+        (*args)[n++] = arg;
+    }
+    fclose(fp);
+    return n;
+}
+
+char **config_args(int argc, char **argv, int *new_argc)
+{
+    const char *path = NULL;
+    int i;
+    for (i = 1; i < argc && !path; i++)
+    {
+        if (strncmp(argv[i], "--config=", 9) == 0)
+            path = argv[i] + 9;
+        else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+            path = argv[i + 1];
+    }
+    *new_argc = argc;
+    if (!path)
+        return argv;
+
+    /*argv[0]，配置文件中的参数，其余命令行参数（包括--config本身，由调用者忽略）*/
+    char **args = (char **)malloc(2 * sizeof(char *));
+    args[0] = argv[0];
+    int n = config_read(path, &args, 1);
+    args = (char **)realloc(args, (n + argc) * sizeof(char *));
+    for (i = 1; i < argc; i++)
+        args[n++] = argv[i];
+    args[n] = NULL;
+    *new_argc = n;
+    return args;
+}
+
+int64_t config_size(const char *s)
+{
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || v < 0)
+        return -1;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        v <<= 10;
+    /*fall through*/
+    case 'M':
+        v <<= 10;
+    /*fall through*/
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case '\0':
+        break;
+    default:
+        return -1;
+    }
+    if (*end != '\0' && !(toupper((unsigned char)*end) == 'B' && end[1] == '\0'))
+        return -1;
+    return v;
+}
+
+long config_sysctl(const char *path, int index, long def)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return def;
+    long v = def;
+    int i;
+    for (i = 0; i <= index; i++)
+    {
+        if (fscanf(fp, "%ld", &v) != 1)
+        {
+            v = def;
+            break;
+        }
+    }
+    fclose(fp);
+    return v;
+}
+
+int64_t config_clamp_pow2(int64_t v, int64_t lo, int64_t hi)
+{
+    if (v < lo)
+        v = lo;
+    if (v > hi)
+        v = hi;
+    int64_t p = 1;
+    while (p * 2 <= v)
+        p *= 2;
+    return p;
+}
@@ -0,0 +1,24 @@
+#ifndef CONFIG_H__
+#define CONFIG_H__
+
+#include <stdint.h>
+
+/*
+ * 可调参数既可以写在命令行上（--key=value），也可以写在配置文件中（每行 key = value，单独的 key 表示开关，#开始注释）。
+ * 配置文件的每一行转换成一个 --key=value 参数，排在命令行参数之前交给getopt_long，命令行上的值覆盖配置文件。
+ * Server与client-test/client共用本文件。
+ */
+
+/*命令行中有--config=文件（或--config 文件）时，返回插入了配置文件内容的新参数表，否则返回argv*/
+char **config_args(int argc, char **argv, int *new_argc);
+
+/*解析带K/M/G后缀的大小，出错返回-1*/
+int64_t config_size(const char *s);
+
+/*读取/proc/sys下的数值，index为一行中第几个字段（从0开始），读不到时返回def*/
+long config_sysctl(const char *path, int index, long def);
+
+/*把v限制在[lo, hi]之内，再向下取整到2的幂*/
+int64_t config_clamp_pow2(int64_t v, int64_t lo, int64_t hi);
+
+#endif
@@ -0,0 +1,230 @@
+#include "conntab.h"
+
+#define SHARD_BITS 4
+#define SHARD_NUM (1 << SHARD_BITS)
+#define SLOT_BITS 16
+#define GEN_MASK 0x7ff                         //代数11位，保证id非负
+#define CHUNK_SLOTS 256                        //每次为分片分配的槽数
+#define SHARD_SLOTS (CONN_LIMIT / SHARD_NUM)   //每个分片槽数的上限，实际上限由conf.conn_max决定
+#define SHARD_CHUNKS (SHARD_SLOTS / CHUNK_SLOTS)
+#define NAME_BUCKETS 1024                      //每个分片文件名索引的桶数
+
+#if SHARD_SLOTS > (1 << SLOT_BITS) || SHARD_SLOTS % CHUNK_SLOTS != 0
+#error "CONN_LIMIT must be a multiple of SHARD_NUM * CHUNK_SLOTS and fit in SLOT_BITS"
+#endif
+
+/*一个分片：锁只在分配、释放槽以及修改、查找本分片的文件名索引时使用*/
+struct shard
+{
+    pthread_mutex_t lock;
+    struct conn *chunks[SHARD_CHUNKS]; //按需分配的槽块
+    int nslots;                        //已分配的槽数
+    int free_head;                     //空闲槽链表，-1表示空
+    int names[NAME_BUCKETS];           //文件名哈希到本分片的传输，桶内经name_next链接，槽可以在任意分片
+};
+
+static struct shard shards[SHARD_NUM];
+static unsigned next_shard; //轮流选择分片
+
+static void __attribute__((constructor)) conntab_init()
+{
+    int i;
+    for (i = 0; i < SHARD_NUM; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].free_head = -1;
+        int b;
+        for (b = 0; b < NAME_BUCKETS; b++)
+            shards[i].names[b] = -1;
+    }
+}
+
+static struct conn *shard_slot(struct shard *p, int idx)
+{
+    struct conn *chunk = __atomic_load_n(&p->chunks[idx / CHUNK_SLOTS], __ATOMIC_ACQUIRE);
+    return chunk ? &chunk[idx % CHUNK_SLOTS] : NULL;
+}
+
+/*id对应的槽，不检查代数；索引中的传输都还没有移除，槽不会被复用*/
+static struct conn *id_slot(int id)
+{
+    return shard_slot(&shards[id & (SHARD_NUM - 1)], (id >> SHARD_BITS) & ((1 << SLOT_BITS) - 1));
+}
+
+/*FNV-1a：低位选择分片，其余位选择桶*/
+static unsigned name_hash(const char *filename)
+{
+    unsigned h = 2166136261u;
+    while (*filename)
+        h = (h ^ (unsigned char)*filename++) * 16777619u;
+    return h;
+}
+
+static int *name_bucket(unsigned h)
+{
+    return &shards[h & (SHARD_NUM - 1)].names[(h >> SHARD_BITS) % NAME_BUCKETS];
+}
+
+/*在一个分片中取一个空闲槽，分片已满时返回-1；调用时持有分片锁*/
+static int shard_alloc(struct shard *p)
+{
+    int idx = p->free_head;
+    if (idx >= 0)
+    {
+        p->free_head = shard_slot(p, idx)->next_free;
+        return idx;
+    }
+    /*conf.conn_max平均分到各分片*/
+    int limit = (conf.conn_max + SHARD_NUM - 1) / SHARD_NUM;
+    if (p->nslots >= limit || p->nslots == SHARD_SLOTS)
+        return -1;
+
+    /*新的槽块，发布后查找不加锁也能看到*/
+    if (p->nslots % CHUNK_SLOTS == 0)
+    {
+        struct conn *chunk = (struct conn *)calloc(CHUNK_SLOTS, sizeof(struct conn));
+        if (!chunk)
+            return -1;
+        conn_heap_grow();
+        __atomic_store_n(&p->chunks[p->nslots / CHUNK_SLOTS], chunk, __ATOMIC_RELEASE);
+    }
+    return p->nslots++;
+}
+
+int conntab_insert(struct conn *c)
+{
+    unsigned start = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+    int i;
+    for (i = 0; i < SHARD_NUM; i++)
+    {
+        int sh = (start + i) % SHARD_NUM;
+        struct shard *p = &shards[sh];
+
+        pthread_mutex_lock(&p->lock);
+        int idx = shard_alloc(p);
+        if (idx < 0)
+        {
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+        struct conn *slot = shard_slot(p, idx);
+        int gen = slot->gen;
+        *slot = *c;
+        slot->gen = gen;
+        slot->refs = 1;
+        __atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&p->lock);
+        int id = (gen << (SHARD_BITS + SLOT_BITS)) | (idx << SHARD_BITS) | sh;
+
+        /*加入文件名哈希所在分片的索引；不同时持有两把锁*/
+        unsigned h = name_hash(slot->filename);
+        struct shard *home = &shards[h & (SHARD_NUM - 1)];
+        pthread_mutex_lock(&home->lock);
+        int *bucket = name_bucket(h);
+        slot->name_next = *bucket;
+        *bucket = id;
+        pthread_mutex_unlock(&home->lock);
+        return id;
+    }
+    return -1;
+}
+
+struct conn *conntab_get(int id)
+{
+    if (id < 0)
+        return NULL;
+    int idx = (id >> SHARD_BITS) & ((1 << SLOT_BITS) - 1);
+    int gen = id >> (SHARD_BITS + SLOT_BITS);
+    if (idx >= SHARD_SLOTS)
+        return NULL;
+
+    struct conn *slot = shard_slot(&shards[id & (SHARD_NUM - 1)], idx);
+    if (!slot || !__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&slot->gen, __ATOMIC_RELAXED) != gen)
+        return NULL;
+    return slot;
+}
+
+int conntab_find(const char *filename)
+{
+    unsigned h = name_hash(filename);
+    struct shard *home = &shards[h & (SHARD_NUM - 1)];
+    pthread_mutex_lock(&home->lock);
+    int id = *name_bucket(h);
+    while (id >= 0 && strcmp(id_slot(id)->filename, filename) != 0)
+        id = id_slot(id)->name_next;
+    pthread_mutex_unlock(&home->lock);
+    return id;
+}
+
+struct conn *conntab_acquire(int id)
+{
+    struct conn *slot = conntab_get(id);
+    if (!slot)
+        return NULL;
+    struct shard *p = &shards[id & (SHARD_NUM - 1)];
+
+    /*加锁后再检查一次，槽可能刚被移除*/
+    pthread_mutex_lock(&p->lock);
+    if (slot->used && slot->gen == id >> (SHARD_BITS + SLOT_BITS))
+        slot->refs++;
+    else
+        slot = NULL;
+    pthread_mutex_unlock(&p->lock);
+    return slot;
+}
+
+/*减少引用计数，已移除且没有引用时交回槽；调用时持有分片锁*/
+static int shard_put(struct shard *p, int idx, struct conn *slot, struct conn *last)
+{
+    if (--slot->refs > 0 || slot->used)
+        return 0;
+    *last = *slot;
+    slot->next_free = p->free_head;
+    p->free_head = idx;
+    return 1;
+}
+
+int conntab_release(int id, struct conn *last)
+{
+    /*移除后代数已经改变，只按槽号查找；持有引用时槽不会被复用*/
+    int idx = (id >> SHARD_BITS) & ((1 << SLOT_BITS) - 1);
+    struct shard *p = &shards[id & (SHARD_NUM - 1)];
+    struct conn *slot = shard_slot(p, idx);
+
+    pthread_mutex_lock(&p->lock);
+    int ret = shard_put(p, idx, slot, last);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int conntab_remove(int id, struct conn *last)
+{
+    struct conn *slot = conntab_get(id);
+    if (!slot)
+        return 0;
+
+    /*先从文件名索引中删除，槽在索引中时一定还没有交回；同一id重复移除时已经找不到*/
+    unsigned h = name_hash(slot->filename);
+    struct shard *home = &shards[h & (SHARD_NUM - 1)];
+    pthread_mutex_lock(&home->lock);
+    int *link = name_bucket(h);
+    while (*link >= 0 && *link != id)
+        link = &id_slot(*link)->name_next;
+    if (*link == id)
+        *link = slot->name_next;
+    pthread_mutex_unlock(&home->lock);
+
+    struct shard *p = &shards[id & (SHARD_NUM - 1)];
+
+    pthread_mutex_lock(&p->lock);
+    int ret = 0;
+    if (slot->used && slot->gen == id >> (SHARD_BITS + SLOT_BITS))
+    {
+        __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->gen, (slot->gen + 1) & GEN_MASK, __ATOMIC_RELAXED);
+        ret = shard_put(p, (id >> SHARD_BITS) & ((1 << SLOT_BITS) - 1), slot, last);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
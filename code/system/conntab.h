@@ -0,0 +1,32 @@
+#ifndef CONNTAB_H__
+#define CONNTAB_H__
+
+#include "work.h"
+
+/*
+ * 传输表：按id分片，每个分片一把锁，槽按块分配，分配后地址不变。
+ * id = 代数(11位) | 槽号(16位) | 分片号(4位)，槽复用时代数加一，旧id查不到新的传输。
+ * 引用计数：表本身持有一个引用，接收文件块的连接各持有一个；移除后查不到，
+ * 最后一个引用释放时才交回槽，由调用者关闭其中的文件，正在写入的连接不会用到已关闭的fd。
+ * 文件名索引：按文件名的哈希选择分片，由该分片的锁保护，插入时加入、移除时删除，查找只锁一个分片。
+ */
+
+/*复制c到一个空闲槽，返回id；表满时返回-1*/
+int conntab_insert(struct conn *c);
+
+/*查找id对应的传输，不加锁；id无效或已释放时返回NULL*/
+struct conn *conntab_get(int id);
+
+/*在文件名索引中查找正在传输的同名文件，返回id；没有时返回-1*/
+int conntab_find(const char *filename);
+
+/*取得id对应的传输并增加引用计数；id无效或已移除时返回NULL*/
+struct conn *conntab_acquire(int id);
+
+/*释放conntab_acquire()取得的引用；最后一个引用时把传输复制到*last并交回槽，返回1*/
+int conntab_release(int id, struct conn *last);
+
+/*从表中移除id，之后查不到；同时释放表持有的引用，返回值同conntab_release()*/
+int conntab_remove(int id, struct conn *last);
+
+#endif
@@ -0,0 +1,132 @@
+#include "durable.h"
+#include "conntab.h"
+
+/*
+ * 成组提交：同步线程每次取走队列中所有等待的传输，先对每个文件发起回写，
+ * 再依次fdatasync，最后fsync一次所在目录（新建的目录项），全部完成后统一确认、写入续传文件。
+ * 同步期间完成的文件、分块在下一批中处理，一次日志提交可以覆盖同一批的多个文件与分块。
+ * 队列链在传输表的槽中（槽的地址不变），每个传输最多排队一次，排队不分配内存。
+ */
+
+#define DURABLE_BATCH 256 //同步线程一次处理的传输数
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_ready = PTHREAD_COND_INITIALIZER;
+static struct conn *commit_head = NULL; //等待同步的传输，后排队的在前
+
+/*同步一批传输；取走sync_flags之后传输可以重新排队，sync_next不再可用*/
+static void durable_batch(struct conn **batch, int n)
+{
+    int ids[n], flags[n];
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        ids[i] = batch[i]->sync_id;
+        flags[i] = __atomic_exchange_n(&batch[i]->sync_flags, 0, __ATOMIC_ACQ_REL);
+    }
+
+    /*所有文件先开始回写，磁盘可以同时处理*/
+    for (i = 0; i < n; i++)
+        sync_file_range(batch[i]->file_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+    /*等待数据与元数据落盘：接收完毕的文件丢弃已经写入磁盘的页缓存；还在接收的文件写入续传文件*/
+    struct file_ack acks[n];
+    int files = 0;
+    for (i = 0; i < n; i++)
+    {
+        struct conn *c = batch[i];
+        if (flags[i] & SYNC_FILE)
+        {
+            acks[i].status = fdatasync(c->file_fd) == 0 ? 0 : -1;
+            acks[i].durable = acks[i].status == 0;
+            posix_fadvise(c->file_fd, 0, 0, POSIX_FADV_DONTNEED);
+            files++;
+        }
+        else
+            part_checkpoint(c);
+    }
+    /*文件都建在server的工作目录中，目录项落盘后新文件才不会在崩溃后消失*/
+    int dirfd = open(".", O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1 || fsync(dirfd) == -1)
+    {
+        perror("fsync directory");
+        for (i = 0; i < n; i++)
+            acks[i].status = -1, acks[i].durable = 0;
+    }
+    if (dirfd >= 0)
+        close(dirfd);
+    printf("durable: %d file(s), %d transfer(s) with blocks in one fdatasync batch\n", files, n - files);
+
+    /*整批确认，释放排队时取得的引用*/
+    for (i = 0; i < n; i++)
+    {
+        if (flags[i] & SYNC_FILE)
+            complete_file(ids[i], &acks[i]);
+        conn_release(ids[i]);
+    }
+}
+
+static void *durable_thread(void *arg)
+{
+    struct conn *batch[DURABLE_BATCH];
+    while (1)
+    {
+        pthread_mutex_lock(&commit_lock);
+        while (!commit_head)
+            pthread_cond_wait(&commit_ready, &commit_lock);
+        struct conn *head = commit_head;
+        commit_head = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        /*取出的链表只有本线程访问；先读出一组的sync_next，再让这组可以重新排队*/
+        while (head)
+        {
+            int n = 0;
+            for (; head && n < DURABLE_BATCH; head = head->sync_next)
+                batch[n++] = head;
+            durable_batch(batch, n);
+        }
+    }
+    return NULL;
+}
+
+void durable_start()
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, durable_thread, NULL) != 0)
+    {
+        printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
+        exit(-1);
+    }
+    pthread_detach(tid);
+}
+
+/*置位sync_flags；第一次置位时取得引用并排队，同步线程取走sync_flags之前不会重复排队*/
+static void durable_queue(int id, struct conn *c, int flag)
+{
+    if (__atomic_fetch_or(&c->sync_flags, flag, __ATOMIC_ACQ_REL))
+        return;
+    /*传输已经中止并移出传输表，中止时已写入续传文件*/
+    if (!conntab_acquire(id))
+    {
+        __atomic_store_n(&c->sync_flags, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    c->sync_id = id;
+
+    pthread_mutex_lock(&commit_lock);
+    c->sync_next = commit_head;
+    commit_head = c;
+    pthread_cond_signal(&commit_ready);
+    pthread_mutex_unlock(&commit_lock);
+}
+
+void durable_commit(int id, struct conn *c)
+{
+    durable_queue(id, c, SYNC_FILE);
+}
+
+void durable_checkpoint(int id, struct conn *c)
+{
+    durable_queue(id, c, SYNC_BLOCKS);
+}
@@ -0,0 +1,19 @@
+#ifndef DURABLE_H__
+#define DURABLE_H__
+
+#include "work.h"
+
+/*struct conn的sync_flags：等待同步线程处理的事项*/
+#define SYNC_BLOCKS 1 //-d range/file：有已接收的分块，fdatasync之后写入续传文件
+#define SYNC_FILE 2   //-d file：文件接收完毕，fdatasync之后确认
+
+/*启动同步线程，-d range/file时在接收连接之前调用*/
+void durable_start();
+
+/*文件接收完毕，交给同步线程：与同时完成的其他文件一起fdatasync，之后调用complete_file()确认*/
+void durable_commit(int id, struct conn *c);
+
+/*分块接收完毕，交给同步线程：同一批中的分块共用一次fdatasync，之后写入续传文件*/
+void durable_checkpoint(int id, struct conn *c);
+
+#endif
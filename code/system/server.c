@@ -1,58 +1,402 @@
 #include "work.h"
 #include "tpool.h"
+#include "uring.h"
+#include "durable.h"
+#include "config.h"
+#include "tune.h"
+#include <getopt.h>
+#include <sys/resource.h>
 
-int main(int argc, char **argv)
+#define STEP_BUDGET (4 * 1024 * 1024) //一次step最多接收的字节数，超过后让出线程
+#define LOCAL_STEPS 8                 //工作线程连续在自己队列上重新提交step的次数上限，之后经epoll重新排队
+
+static __thread int local_steps; //本线程连续重新提交的次数
+
+static int epfd;
+
+/*重新打开连接的EPOLLONESHOT，数据可读时再交给线程池*/
+static void session_rearm(struct session *s)
 {
-    printf("##################### Server #####################\n");
-    int port = PORT;
-    if (argc > 1)
-        port = atoi(argv[1]);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+/*
+ * 注册回复：发不完时等待EPOLLOUT（回复期间连接不在epoll中时重新加入），
+ * 发完后先移出epoll再把info_fd交给传输表，避免fd关闭后被复用
+ */
+static void *session_reply(struct session *s, int ret)
+{
+    while (ret == SESSION_REPLIED)
+    {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        ret = session_attach(s);
+    }
+    if (ret == SESSION_SEND)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev) == -1 && errno == ENOENT)
+            epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+        return NULL;
+    }
+    if (ret == SESSION_ERROR)
+        close(s->fd);
+    session_free(s);
+    return NULL;
+}
+
+/*一次非阻塞接收：文件块数据按-i写入文件，其余收进session的缓冲区*/
+static int session_recv(struct session *s)
+{
+    if (s->stage == STAGE_DATA && conf.ingest == INGEST_SPLICE)
+        return ingest_splice_some(s->fd, s->file_fd, s->pos, s->remain);
+    char *buf;
+    int len = session_want(s, &buf);
+    if (len < 0)
+        return -1;
+    return recv(s->fd, buf, len, 0);
+}
+
+/*还没有收到文件块头部的连接（握手、文件信息、注册回复）是控制面任务，其余是数据面任务*/
+static int session_prio(struct session *s)
+{
+    return s->stage < STAGE_HEAD || s->stage == STAGE_REPLY ? TPOOL_PRIO_CTRL : TPOOL_PRIO_DATA;
+}
+
+/*线程池任务：接收到EAGAIN为止，不在socket上阻塞；EPOLLONESHOT保证同一连接同时只有一个线程处理；数据连接由client关闭*/
+static void *session_step(void *arg)
+{
+    struct session *s = (struct session *)arg;
+    int budget = STEP_BUDGET;
+    int prio = session_prio(s);
+    int drained = 0;
+
+    /*socket可写，继续发送注册回复*/
+    if (s->stage == STAGE_REPLY)
+        return session_reply(s, session_send(s));
+
+    while (budget > 0)
+    {
+        int n = session_recv(s);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            drained = 1;
+            break;
+        }
+        /*对端关闭或出错*/
+        if (n <= 0)
+        {
+            if (n < 0)
+                perror("recv");
+            close(s->fd);
+            session_free(s);
+            return NULL;
+        }
+        budget -= n;
+
+        /*完成的文件块之后，预读缓冲区中可能已经有同一连接上下一个文件块的头部*/
+        int ret = session_advance(s, n);
+        while (ret == SESSION_BLOCK)
+        {
+            session_finish(s);
+            ret = session_advance(s, 0);
+        }
+
+        switch (ret)
+        {
+        case SESSION_MORE:
+            /*控制面任务收完头部后让出线程，文件块数据作为数据面任务接收*/
+            if (prio != session_prio(s))
+                budget = 0;
+            continue;
+        /*注册文件，回复发完后info_fd交给传输表，文件接收完毕时关闭*/
+        case SESSION_FILEINFO:
+            return session_reply(s, session_register(s));
+        default:
+            close(s->fd);
+            session_free(s);
+            return NULL;
+        }
+    }
+
+    /*
+     * 预算用完时socket中可能还有数据，不经过epoll，作为后续step压入本线程的队列（连接仍是EPOLLONESHOT关闭状态），
+     * 空闲线程可以窃取；连续重新提交太多次时经epoll排到其他连接之后，避免一个连接占住线程。
+     */
+    if (!drained && local_steps < LOCAL_STEPS)
+    {
+        local_steps++;
+        tpool_add_work_prio(session_step, s, session_prio(s));
+        return NULL;
+    }
+    local_steps = 0;
+    session_rearm(s);
+    return NULL;
+}
+
+/*每隔conf.stats秒打印线程池的线程数与任务等待时间*/
+static void *stats_thread(void *arg)
+{
+    while (1)
+    {
+        sleep(conf.stats);
+        struct tpool_stats st;
+        tpool_stats(&st);
+        fprintf(stderr, "tpool: threads=%d active=%d queued=%ld tasks=%ld wait avg=%.1fus max=%.1fus\n",
+                st.nthreads, st.nactive, st.queued, st.tasks, st.wait_avg_us, st.wait_max_us);
+    }
+    return NULL;
+}
 
-    /*创建线程池*/
-    if (tpool_create(THREAD_NUM) != 0)
+/*创建线程池：epoll引擎推进所有连接的状态机，io_uring引擎处理会阻塞的写入与注册*/
+static void pool_start()
+{
+    if (tpool_create_elastic(conf.tmin, conf.tmax) != 0)
     {
         printf("tpool_create failed\n");
         exit(-1);
     }
-    printf("--- Thread Pool Strat ---\n");
+    printf("--- Thread Pool Strat: %d-%d threads ---\n", conf.tmin, conf.tmax);
+    if (conf.stats > 0)
+    {
+        pthread_t tid;
+        pthread_create(&tid, NULL, stats_thread, NULL);
+        pthread_detach(tid);
+    }
+}
 
+/*epoll接受连接并监听可读事件，可读的连接交给线程池推进状态机，不返回*/
+static void epoll_run(int port)
+{
     /*初始化server，监听请求*/
     int listenfd = Server_init(port);
     socklen_t sockaddr_len = sizeof(struct sockaddr);
 
-    /*epoll*/
-    static struct epoll_event ev, events[EPOLL_SIZE];
-    int epfd = epoll_create(EPOLL_SIZE);
+    /*epoll，listenfd的data.ptr为NULL，连接的data.ptr为struct session*/
+    static struct epoll_event ev;
+    struct epoll_event *events = (struct epoll_event *)malloc(conf.epoll_events * sizeof(struct epoll_event));
+    epfd = epoll_create1(0);
     ev.events = EPOLLIN;
-    ev.data.fd = listenfd;
+    ev.data.ptr = NULL;
     epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
 
     while (1)
     {
-        int events_count = epoll_wait(epfd, events, EPOLL_SIZE, -1);
+        int events_count = epoll_wait(epfd, events, conf.epoll_events, -1);
         int i = 0;
 
-        /*接受连接，添加work到work-Queue*/
         for (; i < events_count; i++)
         {
-            if (events[i].data.fd == listenfd)
+            /*可读的连接，添加work到work-Queue*/
+            if (events[i].data.ptr)
             {
-                int connfd;
-                struct sockaddr_in clientaddr;
-                while ((connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &sockaddr_len)) > 0)
-                {
-                    printf("EPOLL: Received New Connection Request---connfd= %d\n", connfd);
-                    struct args *p_args = (struct args *)malloc(sizeof(struct args));
-                    p_args->fd = connfd;
-                    p_args->recv_finfo = recv_fileinfo;
-                    p_args->recv_fdata = recv_filedata;
-
-                    /*添加work到work-Queue*/
-                    tpool_add_work(worker, (void *)p_args);
-                }
+                struct session *s = (struct session *)events[i].data.ptr;
+                tpool_add_work_prio(session_step, s, session_prio(s));
+                continue;
             }
+
+            /*接受连接，非阻塞，从type开始接收*/
+            int connfd;
+            struct sockaddr_in clientaddr;
+            while ((connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &sockaddr_len)) > 0)
+            {
+                printf("EPOLL: Received New Connection Request---connfd= %d, heap allocs= %ld\n", connfd, conn_heap_allocs());
+                set_fd_noblock(connfd);
+                struct session *s = session_alloc(connfd);
+                ev.events = EPOLLIN | EPOLLONESHOT;
+                ev.data.ptr = s;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev);
+            }
+        }
+    }
+}
+
+static void usage(char *prog)
+{
+    printf("usage: %s [--config=file] [-e epoll|uring] [-r rings] [-i mmap|splice|direct] [-t min:max] [-S secs]\n"
+           "       [-d none|range|file] [--recvbuf=size] [--listen-queue=n] [--conn-max=n] [--epoll-events=n] [--tune] [port]\n",
+           prog);
+    exit(-1);
+}
+
+/*长选项，配置文件中的key与长选项同名*/
+#define OPT_RECVBUF 256
+#define OPT_LISTEN_QUEUE 257
+#define OPT_CONN_MAX 258
+#define OPT_EPOLL_EVENTS 259
+#define OPT_CONFIG 260
+#define OPT_TUNE 261
+
+static struct option long_options[] = {
+    {"engine", required_argument, NULL, 'e'},
+    {"rings", required_argument, NULL, 'r'},
+    {"ingest", required_argument, NULL, 'i'},
+    {"threads", required_argument, NULL, 't'},
+    {"stats", required_argument, NULL, 'S'},
+    {"durable", required_argument, NULL, 'd'},
+    {"port", required_argument, NULL, 'p'},
+    {"recvbuf", required_argument, NULL, OPT_RECVBUF},
+    {"listen-queue", required_argument, NULL, OPT_LISTEN_QUEUE},
+    {"conn-max", required_argument, NULL, OPT_CONN_MAX},
+    {"epoll-events", required_argument, NULL, OPT_EPOLL_EVENTS},
+    {"config", required_argument, NULL, OPT_CONFIG},
+    {"tune", no_argument, NULL, OPT_TUNE},
+    {NULL, 0, NULL, 0}};
+
+/*命令行与配置文件都没有指定时的取值：按核数、fd上限、socket缓冲区大小选择*/
+static void conf_auto()
+{
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    conf.nrings = ncpus;
+    conf.tmin = ncpus > THREAD_MIN ? ncpus : THREAD_MIN;
+    conf.tmax = 8 * ncpus > THREAD_MAX ? 8 * ncpus : THREAD_MAX;
+
+    /*一次recv取走socket接收缓冲区能容纳的全部数据*/
+    conf.recvbuf = config_clamp_pow2(config_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2, RECVBUF_SIZE), RECVBUF_MIN, RECVBUF_MAX);
+    conf.listen_queue = config_sysctl("/proc/sys/net/core/somaxconn", 0, LISTEN_QUEUE_LEN);
+
+    /*fd软上限提高到硬上限；每个传输至少占用信息交换socket、目标文件与数据连接，按4个fd估计*/
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < CONN_MAX)
+            conf.conn_max = rl.rlim_cur / 4;
+    }
+    conf.epoll_events = 0;
+}
+
+int main(int argc, char **argv)
+{
+    printf("##################### Server #####################\n");
+
+    /*配置文件的内容排在命令行参数之前，命令行覆盖配置文件*/
+    argv = config_args(argc, argv, &argc);
+    conf_auto();
+
+    /*解析命令行参数*/
+    int port = PORT;
+    int tune = 0;
+    int64_t size;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "e:r:i:t:S:d:p:", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0)
+                conf.engine = ENGINE_EPOLL;
+            else if (strcmp(optarg, "uring") == 0)
+                conf.engine = ENGINE_URING;
+            else
+                usage(argv[0]);
+            break;
+        case 'r':
+            conf.nrings = atoi(optarg);
+            break;
+        case 'i':
+            if (strcmp(optarg, "mmap") == 0)
+                conf.ingest = INGEST_MMAP;
+            else if (strcmp(optarg, "splice") == 0)
+                conf.ingest = INGEST_SPLICE;
+            else if (strcmp(optarg, "direct") == 0)
+                conf.ingest = INGEST_DIRECT;
+            else
+                usage(argv[0]);
+            break;
+        case 't':
+            if (sscanf(optarg, "%d:%d", &conf.tmin, &conf.tmax) != 2 || conf.tmin < 1 || conf.tmax < conf.tmin)
+                usage(argv[0]);
+            break;
+        case 'S':
+            conf.stats = atoi(optarg);
+            break;
+        case 'd':
+            if (strcmp(optarg, "none") == 0)
+                conf.durable = DURABLE_NONE;
+            else if (strcmp(optarg, "range") == 0)
+                conf.durable = DURABLE_RANGE;
+            else if (strcmp(optarg, "file") == 0)
+                conf.durable = DURABLE_FILE;
+            else
+                usage(argv[0]);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case OPT_RECVBUF:
+            size = config_size(optarg);
+            if (size < RECVBUF_MIN || size > RECVBUF_MAX)
+                usage(argv[0]);
+            conf.recvbuf = size;
+            break;
+        case OPT_LISTEN_QUEUE:
+            conf.listen_queue = atoi(optarg);
+            if (conf.listen_queue < 1)
+                usage(argv[0]);
+            break;
+        case OPT_CONN_MAX:
+            conf.conn_max = atoi(optarg);
+            if (conf.conn_max < 1 || conf.conn_max > CONN_LIMIT)
+                usage(argv[0]);
+            break;
+        case OPT_EPOLL_EVENTS:
+            conf.epoll_events = atoi(optarg);
+            if (conf.epoll_events < 1)
+                usage(argv[0]);
+            break;
+        case OPT_CONFIG:
+            break;
+        case OPT_TUNE:
+            tune = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (conf.nrings < 1)
+        conf.nrings = 1;
+    /*一次epoll_wait至少能让每个线程拿到一个任务*/
+    if (conf.epoll_events == 0)
+        conf.epoll_events = conf.tmax > EPOLL_EVENTS ? conf.tmax : EPOLL_EVENTS;
+
+    if (optind < argc)
+        port = atoi(argv[optind]);
+
+    if (tune)
+        tune_run();
+
+    printf("--- conf: recvbuf=%dK listen-queue=%d conn-max=%d epoll-events=%d threads=%d:%d ---\n",
+           conf.recvbuf >> 10, conf.listen_queue, conf.conn_max, conf.epoll_events, conf.tmin, conf.tmax);
+
+    /*-d range/file：已接收的分块与接收完毕的文件由同步线程成组fdatasync*/
+    if (conf.durable != DURABLE_NONE)
+        durable_start();
+
+    pool_start();
+
+    /*io_uring引擎，内核不支持时回退到epoll+线程池*/
+    if (conf.engine == ENGINE_URING)
+    {
+        if (uring_probe() == 0)
+        {
+            printf("--- io_uring engine: %d ring(s) ---\n", conf.nrings);
+            uring_run(port, conf.nrings);
         }
+        printf("io_uring is not available, fall back to epoll + thread pool\n");
+        conf.engine = ENGINE_EPOLL;
     }
 
+    epoll_run(port);
     return 0;
 }
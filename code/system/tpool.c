@@ -1,53 +1,472 @@
 #include "tpool.h"
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
-#include <signal.h>
+#include <sched.h>
+#include <time.h>
+
+#define DEQUE_SIZE 4096     /* 每个工作线程双端队列的容量，2的幂 */
+#define INJECT_SIZE 65536   /* 全局注入队列的容量，2的幂 */
+#define SPIN_ROUNDS 64      /* 休眠前重试窃取的轮数 */
+#define CTRL_BURST 16       /* 连续执行的控制面任务数上限，之后先执行一个数据面任务 */
+#define IDLE_TIMEOUT_MS 5000 /* 线程空闲超过该时间后退出，保留最少线程数 */
+#define GROW_WAIT_US 1000   /* 任务等待超过该时间时增加线程 */
+#define GROW_INTERVAL_US 1000 /* 两次增加线程的最小间隔 */
+#define DEPTH_CHECK 64      /* 每执行多少个任务检查一次队列长度 */
+
+/* 任务，按值存放在队列中，提交任务不分配内存 */
+typedef struct tpool_work
+{
+    void *(*routine)(void *); /* 任务函数 */
+    void *arg;                /* 传入任务函数的参数 */
+    long long submit_ns;      /* 提交时间，用于统计等待时间 */
+} tpool_work_t;
+
+/* Chase-Lev双端队列：所有者在bottom端压入、弹出，其他线程在top端窃取 */
+typedef struct deque
+{
+    long top;
+    long bottom;
+    tpool_work_t buf[DEQUE_SIZE];
+} deque_t;
+
+/* Vyukov有界MPMC队列的一个单元，seq表示单元当前可写还是可读 */
+typedef struct cell
+{
+    size_t seq;
+    tpool_work_t work;
+} cell_t;
+
+/* 注入队列：Vyukov有界MPMC队列 */
+typedef struct inject
+{
+    cell_t *cells;
+    size_t enq_pos;
+    size_t deq_pos;
+} inject_t;
+
+/* 工作线程 */
+typedef struct worker
+{
+    pthread_t tid;
+    int index;
+    unsigned rand;            /* 选择窃取对象的随机数状态 */
+    int ctrl_run;             /* 连续执行的控制面任务数 */
+    int used;                 /* 槽是否有线程，在spawn_lock下修改 */
+    int busy;                 /* 是否正在执行任务 */
+    int depth_check;          /* 距离上次检查队列长度执行的任务数 */
+    long tasks;               /* 累计执行的任务数，只由本线程写 */
+    long long wait_ns;        /* 累计等待时间 */
+    long long wait_max_ns;    /* 统计周期内最长等待时间 */
+    deque_t deque;            /* 数据面任务 */
+} worker_t;
+
+/* 线程池 */
+typedef struct tpool
+{
+    int shutdown;             /* 线程池是否销毁 */
+    int min_thr_num;          /* 最少线程数 */
+    int max_thr_num;          /* 最多线程数，workers数组的大小 */
+    int nthreads;             /* 当前线程数，在spawn_lock下修改 */
+    long long last_spawn_ns;  /* 上次增加线程的时间 */
+    worker_t *workers;        /* 工作线程数组 */
+    inject_t lanes[TPOOL_PRIO_NUM]; /* 每个优先级一个注入队列：控制面任务，线程池外提交的数据面任务 */
+    int nsleepers;            /* 休眠的线程数，在park_lock下修改 */
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_cond;
+    pthread_mutex_t spawn_lock; /* 增加、退出线程 */
+    pthread_cond_t exit_cond;   /* 线程退出时通知tpool_destroy() */
+} tpool_t;
 
 static tpool_t *tpool = NULL;
 
-/* 工作者线程函数, 从任务链表中取出任务并执行 */
-static void *thread_routine(void *arg)
+/* 当前线程对应的工作线程，线程池外的线程为NULL */
+static __thread worker_t *self = NULL;
+
+static long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* 队列中的任务可能被窃取者同时读取，逐个字段原子读写；读到被覆盖的任务时窃取者的CAS会失败 */
+static void slot_store(tpool_work_t *slot, tpool_work_t work)
+{
+    __atomic_store_n(&slot->routine, work.routine, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, work.arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->submit_ns, work.submit_ns, __ATOMIC_RELAXED);
+}
+
+static tpool_work_t slot_load(tpool_work_t *slot)
+{
+    tpool_work_t work;
+    work.routine = __atomic_load_n(&slot->routine, __ATOMIC_RELAXED);
+    work.arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    work.submit_ns = __atomic_load_n(&slot->submit_ns, __ATOMIC_RELAXED);
+    return work;
+}
+
+/* 所有者压入任务，队列满时返回-1 */
+static int deque_push(deque_t *d, tpool_work_t work)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= DEQUE_SIZE)
+        return -1;
+    slot_store(&d->buf[b & (DEQUE_SIZE - 1)], work);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* 所有者弹出最近压入的任务，没有任务时返回0 */
+static int deque_pop(deque_t *d, tpool_work_t *work)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    int ok = 0;
+    if (t <= b)
+    {
+        *work = slot_load(&d->buf[b & (DEQUE_SIZE - 1)]);
+        ok = 1;
+        if (t == b)
+        {
+            /* 只剩最后一个任务，与窃取者竞争 */
+            if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                ok = 0;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+/* 其他线程窃取最早压入的任务，队列为空或竞争失败时返回0 */
+static int deque_steal(deque_t *d, tpool_work_t *work)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return 0;
+    *work = slot_load(&d->buf[t & (DEQUE_SIZE - 1)]);
+    return __atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static int deque_empty(deque_t *d)
+{
+    return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* 任务进入注入队列，队列满时返回-1 */
+static int inject_push(inject_t *q, tpool_work_t work)
 {
-    tpool_work_t *work;
+    size_t pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+    cell_t *cell;
+    while (1)
+    {
+        cell = &q->cells[pos & (INJECT_SIZE - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->enq_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&q->enq_pos, __ATOMIC_RELAXED);
+    }
+    cell->work = work;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
+/* 从注入队列取出任务，队列为空时返回0 */
+static int inject_pop(inject_t *q, tpool_work_t *work)
+{
+    size_t pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+    cell_t *cell;
     while (1)
     {
-        /* 如果任务队列为空,且线程池未关闭，线程阻塞等待任务 */
-        pthread_mutex_lock(&tpool->queue_lock);
-        while (!tpool->queue_head && !tpool->shutdown)
+        cell = &q->cells[pos & (INJECT_SIZE - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0)
         {
-            pthread_cond_wait(&tpool->queue_ready, &tpool->queue_lock);
+            if (__atomic_compare_exchange_n(&q->deq_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
         }
+        else if (dif < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&q->deq_pos, __ATOMIC_RELAXED);
+    }
+    *work = cell->work;
+    __atomic_store_n(&cell->seq, pos + INJECT_SIZE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int inject_empty(inject_t *q)
+{
+    return __atomic_load_n(&q->enq_pos, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->deq_pos, __ATOMIC_ACQUIRE);
+}
+
+/* 是否还有任务等待执行 */
+static int has_work()
+{
+    int i;
+    for (i = 0; i < TPOOL_PRIO_NUM; i++)
+    {
+        if (!inject_empty(&tpool->lanes[i]))
+            return 1;
+    }
+    for (i = 0; i < tpool->max_thr_num; i++)
+    {
+        if (!deque_empty(&tpool->workers[i].deque))
+            return 1;
+    }
+    return 0;
+}
+
+/* 有线程休眠时唤醒一个；调用前任务已经入队 */
+static void unpark_one()
+{
+    /* 与park()中的nsleepers++、has_work()配对：要么这里看到休眠者，要么休眠者看到任务 */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tpool->nsleepers, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&tpool->park_lock);
+        pthread_cond_signal(&tpool->park_cond);
+        pthread_mutex_unlock(&tpool->park_lock);
+    }
+}
+
+/* 等待执行的任务数，近似值 */
+static long queue_depth()
+{
+    long depth = 0;
+    int i;
+    for (i = 0; i < TPOOL_PRIO_NUM; i++)
+        depth += __atomic_load_n(&tpool->lanes[i].enq_pos, __ATOMIC_RELAXED) - __atomic_load_n(&tpool->lanes[i].deq_pos, __ATOMIC_RELAXED);
+    for (i = 0; i < tpool->max_thr_num; i++)
+    {
+        long n = __atomic_load_n(&tpool->workers[i].deque.bottom, __ATOMIC_RELAXED) - __atomic_load_n(&tpool->workers[i].deque.top, __ATOMIC_RELAXED);
+        if (n > 0)
+            depth += n;
+    }
+    return depth;
+}
+
+/* 没有任务时休眠，直到被唤醒或线程池关闭；空闲超时返回1 */
+static int park()
+{
+    int idle = 0;
+    pthread_mutex_lock(&tpool->park_lock);
+    __atomic_store_n(&tpool->nsleepers, tpool->nsleepers + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!has_work() && !tpool->shutdown)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += IDLE_TIMEOUT_MS / 1000;
+        ts.tv_nsec += (IDLE_TIMEOUT_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&tpool->park_cond, &tpool->park_lock, &ts) == ETIMEDOUT && !has_work())
+            idle = 1;
+    }
+    __atomic_store_n(&tpool->nsleepers, tpool->nsleepers - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tpool->park_lock);
+    return idle;
+}
+
+static void *thread_routine(void *arg);
+
+/* 在空闲的槽上创建一个线程，已达最多线程数时返回-1；调用时持有spawn_lock */
+static int spawn_worker()
+{
+    if (tpool->nthreads >= tpool->max_thr_num)
+        return -1;
+    int i;
+    for (i = 0; i < tpool->max_thr_num && tpool->workers[i].used; i++)
+        ;
+    worker_t *w = &tpool->workers[i];
+    w->index = i;
+    w->rand = 2463534242u + i * 7919;
+    w->ctrl_run = 0;
+    w->used = 1;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&w->tid, &attr, thread_routine, w);
+    pthread_attr_destroy(&attr);
+    if (ret != 0)
+    {
+        printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, ret, strerror(ret));
+        w->used = 0;
+        return -1;
+    }
+    __atomic_store_n(&tpool->nthreads, tpool->nthreads + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* 任务等待过久或队列过长，并且没有休眠的线程时，增加一个线程 */
+static void maybe_grow(long long now)
+{
+    if (__atomic_load_n(&tpool->nsleepers, __ATOMIC_RELAXED) > 0 ||
+        __atomic_load_n(&tpool->nthreads, __ATOMIC_RELAXED) >= tpool->max_thr_num)
+        return;
+    long long last = __atomic_load_n(&tpool->last_spawn_ns, __ATOMIC_RELAXED);
+    if (now - last < GROW_INTERVAL_US * 1000LL ||
+        !__atomic_compare_exchange_n(&tpool->last_spawn_ns, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&tpool->spawn_lock);
+    if (!tpool->shutdown)
+        spawn_worker();
+    pthread_mutex_unlock(&tpool->spawn_lock);
+}
 
-        /*查看线程池开关，如果线程池关闭，线程退出*/
-        if (tpool->shutdown)
+/* 线程退出：空闲超时且多于最少线程数时（retire为1），或线程池关闭时；不退出返回0 */
+static int worker_exit(worker_t *w, int retire)
+{
+    pthread_mutex_lock(&tpool->spawn_lock);
+    if (retire && (tpool->nthreads <= tpool->min_thr_num || tpool->shutdown))
+    {
+        pthread_mutex_unlock(&tpool->spawn_lock);
+        return 0;
+    }
+    w->used = 0;
+    __atomic_store_n(&tpool->nthreads, tpool->nthreads - 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&tpool->exit_cond);
+    pthread_mutex_unlock(&tpool->spawn_lock);
+    return 1;
+}
+
+/* 依次从自己的队列、数据面注入队列、其他线程的队列中取数据面任务，没有任务时返回0 */
+static int find_data(worker_t *w, tpool_work_t *work)
+{
+    if (deque_pop(&w->deque, work) || inject_pop(&tpool->lanes[TPOOL_PRIO_DATA], work))
+        return 1;
+
+    /* 从随机位置开始窃取 */
+    int n = tpool->max_thr_num, i;
+    w->rand ^= w->rand << 13;
+    w->rand ^= w->rand >> 17;
+    w->rand ^= w->rand << 5;
+    int start = w->rand % n;
+    for (i = 0; i < n; i++)
+    {
+        worker_t *victim = &tpool->workers[(start + i) % n];
+        if (victim != w && deque_steal(&victim->deque, work))
+            return 1;
+    }
+    return 0;
+}
+
+/* 控制面任务优先；连续执行CTRL_BURST个控制面任务后，有数据面任务时先执行一个，避免数据面饥饿 */
+static int find_work(worker_t *w, tpool_work_t *work)
+{
+    if (w->ctrl_run >= CTRL_BURST && find_data(w, work))
+    {
+        w->ctrl_run = 0;
+        return 1;
+    }
+    if (inject_pop(&tpool->lanes[TPOOL_PRIO_CTRL], work))
+    {
+        w->ctrl_run++;
+        return 1;
+    }
+    w->ctrl_run = 0;
+    return find_data(w, work);
+}
+
+/* 工作者线程函数, 取出任务并执行，没有任务时先自旋窃取，再休眠 */
+static void *thread_routine(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    self = w;
+
+    while (1)
+    {
+        tpool_work_t work;
+        int round, found = 0;
+        for (round = 0; round < SPIN_ROUNDS && !found; round++)
         {
-            pthread_mutex_unlock(&tpool->queue_lock);
-            pthread_exit(NULL);
+            /*查看线程池开关，如果线程池关闭，线程退出*/
+            if (__atomic_load_n(&tpool->shutdown, __ATOMIC_ACQUIRE))
+            {
+                worker_exit(w, 0);
+                return NULL;
+            }
+            if (!(found = find_work(w, &work)))
+                sched_yield();
+        }
+        if (!found)
+        {
+            /* 空闲超时，多于最少线程数时退出 */
+            if (park() && worker_exit(w, 1))
+                return NULL;
+            continue;
         }
 
-        /*从任务链表中取出任务，执行任务*/
-        work = tpool->queue_head;
-        tpool->queue_head = tpool->queue_head->next;
-        pthread_mutex_unlock(&tpool->queue_lock);
-        work->routine(work->arg);
+        /* 统计等待时间，等待过久或队列过长时增加线程 */
+        long long now = now_ns(), wait = now - work.submit_ns;
+        __atomic_store_n(&w->tasks, w->tasks + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->wait_ns, w->wait_ns + wait, __ATOMIC_RELAXED);
+        if (wait > __atomic_load_n(&w->wait_max_ns, __ATOMIC_RELAXED))
+            __atomic_store_n(&w->wait_max_ns, wait, __ATOMIC_RELAXED);
+        if (wait > GROW_WAIT_US * 1000LL)
+            maybe_grow(now);
+        else if (++w->depth_check >= DEPTH_CHECK)
+        {
+            w->depth_check = 0;
+            if (queue_depth() > __atomic_load_n(&tpool->nthreads, __ATOMIC_RELAXED))
+                maybe_grow(now);
+        }
 
-        /*线程完成任务后，释放任务*/
-        free(work->arg);
-        free(work);
+        /* 自己的队列中还有任务，唤醒其他线程来窃取 */
+        if (!deque_empty(&w->deque))
+            unpark_one();
+        /* arg由任务函数自己管理 */
+        __atomic_store_n(&w->busy, 1, __ATOMIC_RELAXED);
+        work.routine(work.arg);
+        __atomic_store_n(&w->busy, 0, __ATOMIC_RELAXED);
     }
     return NULL;
 }
 
 /* 创建线程池 */
 int tpool_create(int max_thr_num)
+{
+    return tpool_create_elastic(max_thr_num, max_thr_num);
+}
+
+/* 创建线程数在min_thr_num与max_thr_num之间伸缩的线程池 */
+int tpool_create_elastic(int min_thr_num, int max_thr_num)
 {
     int i;
 
-    /*创建进程池结构体*/
+    if (min_thr_num < 1 || max_thr_num < min_thr_num)
+    {
+        printf("%s:Invalid argument\n", __FUNCTION__);
+        return -1;
+    }
+
+    /*创建线程池结构体*/
     tpool = calloc(1, sizeof(tpool_t));
     if (!tpool)
     {
@@ -55,39 +474,50 @@ int tpool_create(int max_thr_num)
         exit(1);
     }
 
-    /* 初始化任务链表、互斥量、条件变量 */
+    /* 初始化注入队列、互斥量、条件变量 */
+    tpool->min_thr_num = min_thr_num;
     tpool->max_thr_num = max_thr_num;
     tpool->shutdown = 0;
-    tpool->queue_head = NULL;
-    tpool->queue_tail = NULL;
-    if (pthread_mutex_init(&tpool->queue_lock, NULL) != 0)
+    tpool->workers = calloc(max_thr_num, sizeof(worker_t));
+    if (!tpool->workers)
+    {
+        printf("%s: calloc workers failed\n", __FUNCTION__);
+        exit(1);
+    }
+    int prio;
+    for (prio = 0; prio < TPOOL_PRIO_NUM; prio++)
+    {
+        tpool->lanes[prio].cells = calloc(INJECT_SIZE, sizeof(cell_t));
+        if (!tpool->lanes[prio].cells)
+        {
+            printf("%s: calloc queues failed\n", __FUNCTION__);
+            exit(1);
+        }
+        for (i = 0; i < INJECT_SIZE; i++)
+            tpool->lanes[prio].cells[i].seq = i;
+    }
+    if (pthread_mutex_init(&tpool->park_lock, NULL) != 0)
     {
         printf("%s: pthread_mutex_init failed, errno:%d, error:%s\n",
                __FUNCTION__, errno, strerror(errno));
         exit(-1);
     }
-    if (pthread_cond_init(&tpool->queue_ready, NULL) != 0)
+    if (pthread_cond_init(&tpool->park_cond, NULL) != 0 || pthread_cond_init(&tpool->exit_cond, NULL) != 0)
     {
         printf("%s: pthread_cond_init failed, errno:%d, error:%s\n",
                __FUNCTION__, errno, strerror(errno));
         exit(-1);
     }
+    pthread_mutex_init(&tpool->spawn_lock, NULL);
 
-    /* 创建worker线程 */
-    tpool->thr_id = calloc(max_thr_num, sizeof(pthread_t));
-    if (!tpool->thr_id)
-    {
-        printf("%s: calloc thr_id failed\n", __FUNCTION__);
-        exit(1);
-    }
-    for (i = 0; i < max_thr_num; ++i)
+    /* 创建最少数量的worker线程，其余按需创建 */
+    pthread_mutex_lock(&tpool->spawn_lock);
+    for (i = 0; i < min_thr_num; ++i)
     {
-        if (pthread_create(&tpool->thr_id[i], NULL, thread_routine, NULL) != 0)
-        {
-            printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
+        if (spawn_worker() != 0)
             exit(-1);
-        }
     }
+    pthread_mutex_unlock(&tpool->spawn_lock);
     return 0;
 }
 
@@ -95,86 +525,99 @@ int tpool_create(int max_thr_num)
 void tpool_destroy()
 {
     int i;
-    tpool_work_t *member;
 
     if (tpool->shutdown)
     {
         return;
     }
     /*关闭线程池开关*/
-    tpool->shutdown = 1;
+    __atomic_store_n(&tpool->shutdown, 1, __ATOMIC_RELEASE);
 
-    /* 唤醒所有阻塞的线程 */
-    pthread_mutex_lock(&tpool->queue_lock);
-    pthread_cond_broadcast(&tpool->queue_ready);
-    pthread_mutex_unlock(&tpool->queue_lock);
+    /* 唤醒所有休眠的线程 */
+    pthread_mutex_lock(&tpool->park_lock);
+    pthread_cond_broadcast(&tpool->park_cond);
+    pthread_mutex_unlock(&tpool->park_lock);
 
-    /*回收结束线程的剩余资源*/
-    for (i = 0; i < tpool->max_thr_num; ++i)
-    {
-        pthread_join(tpool->thr_id[i], NULL);
-    }
+    /*等待所有线程退出，线程都是分离的*/
+    pthread_mutex_lock(&tpool->spawn_lock);
+    while (tpool->nthreads > 0)
+        pthread_cond_wait(&tpool->exit_cond, &tpool->spawn_lock);
+    pthread_mutex_unlock(&tpool->spawn_lock);
 
-    /*释放threadID数组*/
-    free(tpool->thr_id);
-
-    /*释放未完成的任务*/
-    while (tpool->queue_head)
-    {
-        member = tpool->queue_head;
-        tpool->queue_head = tpool->queue_head->next;
-        free(member->arg);
-        free(member);
-    }
+    /*未完成的任务按值存放在队列中，随队列一起释放*/
 
     /*销毁互斥量、条件变量*/
-    pthread_mutex_destroy(&tpool->queue_lock);
-    pthread_cond_destroy(&tpool->queue_ready);
+    pthread_mutex_destroy(&tpool->park_lock);
+    pthread_cond_destroy(&tpool->park_cond);
+    pthread_mutex_destroy(&tpool->spawn_lock);
+    pthread_cond_destroy(&tpool->exit_cond);
 
-    /*释放进程池结构体*/
+    /*释放线程池结构体*/
+    free(tpool->workers);
+    for (i = 0; i < TPOOL_PRIO_NUM; i++)
+        free(tpool->lanes[i].cells);
     free(tpool);
 }
 
-/* 向线程池添加任务 */
-int tpool_add_work(void *(*routine)(void *), void *arg)
+/* 向线程池添加任务：控制面任务进入控制面注入队列；数据面任务，工作线程提交到自己的队列，其他线程提交到注入队列 */
+int tpool_add_work_prio(void *(*routine)(void *), void *arg, int prio)
 {
-    /*work指向等待加入任务链表的任务*/
-    tpool_work_t *work;
-
-    if (!routine)
+    if (!routine || prio < 0 || prio >= TPOOL_PRIO_NUM)
     {
         printf("%s:Invalid argument\n", __FUNCTION__);
         return -1;
     }
 
-    work = malloc(sizeof(tpool_work_t));
-    if (!work)
-    {
-        printf("%s:malloc failed\n", __FUNCTION__);
-        return -1;
-    }
-    work->routine = routine;
-    work->arg = arg;
-    work->next = NULL;
+    /*任务按值入队，不分配内存*/
+    tpool_work_t work;
+    work.routine = routine;
+    work.arg = arg;
+    work.submit_ns = now_ns();
 
-    /*将任务结点添加到任务链表*/
-    pthread_mutex_lock(&tpool->queue_lock);
-    /*任务链表为空*/
-    if (!tpool->queue_head)
+    if (prio != TPOOL_PRIO_DATA || !self || deque_push(&self->deque, work) != 0)
     {
-        //		printf("first work in work-queue\n");
-        tpool->queue_head = work;
-        tpool->queue_tail = work;
+        /* 注入队列满时让出CPU，等待工作线程取走任务 */
+        while (inject_push(&tpool->lanes[prio], work) != 0)
+        {
+            unpark_one();
+            sched_yield();
+        }
     }
-    /*任务链表非空，查询任务链表末尾*/
-    else
+    /* 通知休眠的工作线程，有新任务添加 */
+    unpark_one();
+    return 0;
+}
+
+int tpool_add_work(void *(*routine)(void *), void *arg)
+{
+    return tpool_add_work_prio(routine, arg, TPOOL_PRIO_DATA);
+}
+
+/* 统计：各线程的计数只由本线程写，这里读取后与上次的值相减 */
+void tpool_stats(struct tpool_stats *st)
+{
+    static long last_tasks;
+    static long long last_wait_ns;
+    long tasks = 0;
+    long long wait_ns = 0, wait_max_ns = 0;
+    int i;
+
+    bzero(st, sizeof(*st));
+    st->nthreads = __atomic_load_n(&tpool->nthreads, __ATOMIC_RELAXED);
+    for (i = 0; i < tpool->max_thr_num; i++)
     {
-        //		printf("not first work in work-queue\n");
-        tpool->queue_tail->next = work;
-        tpool->queue_tail = work;
+        worker_t *w = &tpool->workers[i];
+        st->nactive += __atomic_load_n(&w->busy, __ATOMIC_RELAXED);
+        tasks += __atomic_load_n(&w->tasks, __ATOMIC_RELAXED);
+        wait_ns += __atomic_load_n(&w->wait_ns, __ATOMIC_RELAXED);
+        long long max = __atomic_exchange_n(&w->wait_max_ns, 0, __ATOMIC_RELAXED);
+        if (max > wait_max_ns)
+            wait_max_ns = max;
     }
-    /* 通知工作者线程，有新任务添加 */
-    pthread_cond_signal(&tpool->queue_ready);
-    pthread_mutex_unlock(&tpool->queue_lock);
-    return 0;
+    st->queued = queue_depth();
+    st->tasks = tasks - last_tasks;
+    st->wait_avg_us = st->tasks > 0 ? (wait_ns - last_wait_ns) / 1000.0 / st->tasks : 0;
+    st->wait_max_us = wait_max_ns / 1000.0;
+    last_tasks = tasks;
+    last_wait_ns = wait_ns;
 }
@@ -3,33 +3,45 @@
 
 #include <pthread.h>
 
-/* 任务结点 */
-typedef struct tpool_work
-{
-    void *(*routine)(void *); /* 任务函数 */
-    void *arg;                /* 传入任务函数的参数 */
-    struct tpool_work *next;
-} tpool_work_t;
+/*
+ * 工作窃取线程池：每个工作线程一个双端队列，线程外提交的任务进入全局注入队列，
+ * 空闲线程从其他线程的队列尾部窃取任务，仍然没有任务时休眠。
+ * 控制面任务有单独的注入队列，工作线程总是先检查它。
+ * 线程数在最少与最多之间伸缩：任务等待过久或队列过长时增加线程，空闲超时的线程退出。
+ */
+
+/* 任务优先级：控制面任务先于数据面任务执行；连续执行多个控制面任务后让一个数据面任务执行，避免饥饿 */
+#define TPOOL_PRIO_CTRL 0 /* 控制面：握手、文件信息、确认 */
+#define TPOOL_PRIO_DATA 1 /* 数据面：文件块数据 */
+#define TPOOL_PRIO_NUM 2
 
-/* 线程池 */
-typedef struct tpool
+/* 线程池统计，tpool_stats()每次调用开始一个新的统计周期 */
+struct tpool_stats
 {
-    int shutdown;             /* 线程池是否销毁 */
-    int max_thr_num;          /* 最大线程数 */
-    pthread_t *thr_id;        /* 线程ID数组首地址 */
-    tpool_work_t *queue_head; /* 任务链表队首 */
-    tpool_work_t *queue_tail; /* 任务链表队尾 */
-    pthread_mutex_t queue_lock;
-    pthread_cond_t queue_ready;
-} tpool_t;
-
-/* 创建线程池 */
+    int nthreads;       /* 当前线程数 */
+    int nactive;        /* 正在执行任务的线程数 */
+    long queued;        /* 等待执行的任务数，近似值 */
+    long tasks;         /* 本周期开始执行的任务数 */
+    double wait_avg_us; /* 本周期任务的平均等待时间 */
+    double wait_max_us; /* 本周期任务的最长等待时间 */
+};
+
+/* 创建固定线程数的线程池 */
 int tpool_create(int max_thr_num);
 
+/* 创建线程数在min_thr_num与max_thr_num之间伸缩的线程池 */
+int tpool_create_elastic(int min_thr_num, int max_thr_num);
+
 /* 销毁线程池 */
 void tpool_destroy();
 
-/* 向线程池中添加任务 */
+/* 向线程池中添加数据面任务，线程池不释放arg */
 int tpool_add_work(void *(*routine)(void *), void *arg);
 
+/* 向线程池中添加指定优先级的任务 */
+int tpool_add_work_prio(void *(*routine)(void *), void *arg, int prio);
+
+/* 读取统计，只在一个线程中调用 */
+void tpool_stats(struct tpool_stats *st);
+
 #endif
@@ -0,0 +1,162 @@
+#include "tune.h"
+#include <sys/resource.h>
+#include <time.h>
+
+#define TUNE_FILE "tune.tmp"
+#define TUNE_SIZE (256 * 1024 * 1024) //每次接收的数据量
+#define TUNE_CHUNK 1048576            //发送线程一次send的大小
+
+static char sendbuf[TUNE_CHUNK];
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*本线程消耗的用户态+内核态CPU时间（秒）*/
+static double thread_cpu()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*发送线程：连接回环地址，发送TUNE_SIZE字节*/
+static void *sender(void *arg)
+{
+    struct sockaddr_in addr = *(struct sockaddr_in *)arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        perror("connect");
+        exit(-1);
+    }
+    int remain = TUNE_SIZE;
+    while (remain > 0)
+    {
+        int n = send(fd, sendbuf, remain < TUNE_CHUNK ? remain : TUNE_CHUNK, 0);
+        if (n <= 0)
+        {
+            perror("send");
+            exit(-1);
+        }
+        remain -= n;
+    }
+    close(fd);
+    return NULL;
+}
+
+/*按当前的conf.recvbuf把TUNE_SIZE字节作为bs大小的文件块逐块接收一次，返回MB/s，cpu为接收线程的CPU时间*/
+static double tune_once(int64_t bs, double *cpu)
+{
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listenfd, 1) == -1)
+    {
+        perror("bind/listen");
+        exit(-1);
+    }
+    getsockname(listenfd, (struct sockaddr *)&addr, &addrlen);
+
+    unlink(TUNE_FILE);
+    createfile(TUNE_FILE, TUNE_SIZE);
+    int fd = open(TUNE_FILE, O_RDWR);
+    if (fd == -1)
+    {
+        perror("open");
+        exit(-1);
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, sender, &addr);
+    int sockfd = accept(listenfd, NULL, NULL);
+    int direct_fd = conf.ingest == INGEST_DIRECT ? open(TUNE_FILE, O_RDWR | O_DIRECT) : -1;
+
+    /*与server相同，每个文件块单独映射窗口（或单独经O_DIRECT写入），分块大小决定每块的固定开销*/
+    double t0 = now(), c0 = thread_cpu();
+    int ret = 0;
+    int64_t off;
+    for (off = 0; off < TUNE_SIZE && ret == 0; off += bs)
+    {
+        int64_t len = TUNE_SIZE - off < bs ? TUNE_SIZE - off : bs;
+        if (conf.ingest == INGEST_DIRECT)
+        {
+            ret = ingest_direct(sockfd, direct_fd, fd, off, len);
+            continue;
+        }
+        char *win = (char *)mmap(NULL, len, PROT_WRITE | PROT_READ, MAP_SHARED, fd, off);
+        if (win == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(-1);
+        }
+        ret = ingest_mmap(sockfd, win, len);
+        munmap(win, len);
+    }
+    double wall = now() - t0;
+    *cpu = thread_cpu() - c0;
+
+    pthread_join(tid, NULL);
+    close(sockfd);
+    close(listenfd);
+    if (direct_fd >= 0)
+        close(direct_fd);
+    close(fd);
+    unlink(TUNE_FILE);
+
+    if (ret < 0)
+    {
+        printf("tune: receive failed\n");
+        exit(-1);
+    }
+    return TUNE_SIZE / wall / 1e6;
+}
+
+void tune_run()
+{
+    /*splice不经过用户态缓冲区，recvbuf只影响mmap与direct*/
+    if (conf.ingest == INGEST_SPLICE)
+    {
+        printf("tune: recvbuf does not apply to -i splice, tuning -i mmap instead\n");
+        conf.ingest = INGEST_MMAP;
+    }
+
+    int i;
+    for (i = 0; i < TUNE_CHUNK; i++)
+        sendbuf[i] = i * 131 + (i >> 12);
+
+    /*接收缓冲区与分块大小一起决定每次recv与每个文件块的开销，两者组合成一张表一起比较*/
+    int64_t sizes[] = {1 << 20, 4 << 20, 16 << 20, 64 << 20};
+    printf("tune: %d MB over loopback per run, receiver cpu time only\n", TUNE_SIZE >> 20);
+    int best = conf.recvbuf;
+    int64_t best_bs = sizes[0];
+    double best_rate = 0;
+    int recvbuf;
+    for (recvbuf = RECVBUF_MIN; recvbuf <= RECVBUF_MAX; recvbuf *= 4)
+    {
+        conf.recvbuf = recvbuf;
+        for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+        {
+            double cpu;
+            double rate = tune_once(sizes[i], &cpu);
+            printf("recvbuf %5dK  block %6lldK  %8.2f MB/s  cpu %6.3f s\n", recvbuf >> 10, (long long)(sizes[i] >> 10), rate, cpu);
+            if (rate > best_rate)
+            {
+                best_rate = rate;
+                best = recvbuf;
+                best_bs = sizes[i];
+            }
+        }
+    }
+    printf("# best of --tune: recvbuf %dK with block %lldK, %.2f MB/s\n", best >> 10, (long long)(best_bs >> 10), best_rate);
+    printf("# add to the server's --config file\n");
+    printf("recvbuf = %dK\n", best >> 10);
+    printf("# add to the client's --config file\n");
+    printf("block-size = %lldK\n", (long long)(best_bs >> 10));
+    exit(0);
+}
@@ -0,0 +1,12 @@
+#ifndef TUNE_H__
+#define TUNE_H__
+
+#include "work.h"
+
+/*
+ * --tune：在回环地址上按conf.ingest逐块接收，比较conf.recvbuf与分块大小的所有组合，
+ * 打印最快的一组（server与client的配置文件格式），不返回
+ */
+void tune_run();
+
+#endif
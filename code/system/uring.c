@@ -0,0 +1,457 @@
+#include "work.h"
+#include "uring.h"
+#include "tpool.h"
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+#define URING_ENTRIES 256              //每个ring的SQ大小
+#define URING_RECV_MAX (4 * 1024 * 1024) //文件块数据一次recv的最大长度
+#define ACCEPT_TAG 1                   //accept请求的user_data，其余请求为struct session指针
+#define BACK_TAG 2                     //eventfd读请求的user_data：线程池交还了session
+
+/*用mmap映射的SQ/CQ，不依赖liburing*/
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit; //已填写但还未提交的SQE数量
+    char *sq_ptr;       //映射的区域，用于uring_exit()
+    size_t sq_sz;
+    char *cq_ptr;
+    size_t cq_sz;
+};
+
+/*每个ring线程的参数*/
+struct ring_ctx
+{
+    int id;
+    int port;
+    pthread_t tid;
+    int efd;               //线程池交还session后写入，唤醒ring
+    uint64_t efd_val;      //eventfd读请求的缓冲区
+    struct session *back;  //线程池交还的session，无锁栈
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*创建ring并映射SQ、CQ和SQE数组*/
+static int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    bzero(&p, sizeof(p));
+    bzero(r, sizeof(struct uring));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    size_t sring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cring_sz > sring_sz)
+            sring_sz = cring_sz;
+        cring_sz = sring_sz;
+    }
+
+    char *sq_ptr = mmap(NULL, sring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+    char *cq_ptr = sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_ptr = mmap(NULL, cring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    r->sq_ptr = sq_ptr;
+    r->sq_sz = sring_sz;
+    r->cq_ptr = cq_ptr;
+    r->cq_sz = cring_sz;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(r->fd);
+    return -1;
+}
+
+/*解除映射，关闭ring*/
+static void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_sz);
+    munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+}
+
+/*提交所有已填写的SQE，并等待至少wait_nr个完成事件*/
+static int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    int ret;
+    do
+    {
+        ret = sys_io_uring_enter(r->fd, r->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+    {
+        perror("io_uring_enter");
+        exit(-1);
+    }
+    /*ret已经不是负数*/
+    r->to_submit -= (unsigned)ret < r->to_submit ? (unsigned)ret : r->to_submit;
+    return ret;
+}
+
+/*取一个空闲的SQE，SQ满时先提交*/
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+        uring_submit(r, 0);
+
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+/*multishot accept：一次提交，每个新连接产生一个完成事件*/
+static void prep_accept(struct uring *r, int listenfd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ACCEPT_TAG;
+}
+
+/*按状态机的要求接收：头部收进session的缓冲区，文件块数据直接收进映射的窗口*/
+static void prep_recv(struct uring *r, struct session *s)
+{
+    char *buf;
+    int len = session_want(s, &buf);
+    if (len < 0)
+    {
+        perror("mmap window");
+        close(s->fd);
+        session_free(s);
+        return;
+    }
+    if (len > URING_RECV_MAX)
+        len = URING_RECV_MAX;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = (unsigned long)s;
+}
+
+/*注册回复没有发完：等待socket可写*/
+static void prep_pollout(struct uring *r, struct session *s)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->fd;
+    sqe->poll_events = POLLOUT;
+    sqe->user_data = (unsigned long)s;
+}
+
+/*等待线程池交还session*/
+static void prep_back(struct uring *r, struct ring_ctx *ctx)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ctx->efd;
+    sqe->addr = (unsigned long)&ctx->efd_val;
+    sqe->len = sizeof(ctx->efd_val);
+    sqe->user_data = BACK_TAG;
+}
+
+/*线程池处理完的session压入所属ring的交还栈，写eventfd唤醒ring继续接收*/
+static void ring_back(struct session *s)
+{
+    struct ring_ctx *ctx = (struct ring_ctx *)s->ring;
+    s->next_free = __atomic_load_n(&ctx->back, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ctx->back, &s->next_free, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    uint64_t one = 1;
+    if (write(ctx->efd, &one, sizeof(one)) != sizeof(one))
+        perror("eventfd write");
+}
+
+/*注册回复发不完时交还ring等待可写，发完后info_fd交给传输表，文件接收完毕时关闭*/
+static void uring_reply(struct session *s, int ret)
+{
+    while (ret == SESSION_REPLIED)
+        ret = session_attach(s);
+    if (ret == SESSION_SEND)
+    {
+        ring_back(s);
+        return;
+    }
+    if (ret == SESSION_ERROR)
+        close(s->fd);
+    session_free(s);
+}
+
+/*线程池任务：创建、预分配文件，开始发送注册回复*/
+static void *uring_register(void *arg)
+{
+    struct session *s = (struct session *)arg;
+    uring_reply(s, session_register(s));
+    return NULL;
+}
+
+/*线程池任务：socket可写，继续发送注册回复*/
+static void *uring_send(void *arg)
+{
+    struct session *s = (struct session *)arg;
+    uring_reply(s, session_send(s));
+    return NULL;
+}
+
+/*
+ * 推进状态机，需要继续接收时返回1，否则连接已经交给传输表或关闭。
+ * on_ring：在ring线程上调用，注册文件交给线程池的控制面，不阻塞ring。
+ */
+static int session_process(struct session *s, int res, int on_ring)
+{
+    /*同一连接上可以连续发送多个文件块，完成一块后继续解析预读缓冲区*/
+    int ret = session_advance(s, res);
+    while (ret == SESSION_BLOCK)
+    {
+        session_finish(s);
+        ret = session_advance(s, 0);
+    }
+
+    switch (ret)
+    {
+    case SESSION_MORE:
+        return 1;
+    case SESSION_FILEINFO:
+        if (on_ring)
+            tpool_add_work_prio(uring_register, s, TPOOL_PRIO_CTRL);
+        else
+            uring_register(s);
+        return 0;
+    default:
+        close(s->fd);
+        session_free(s);
+        return 0;
+    }
+}
+
+/*线程池任务：写入、回写等待可以阻塞，处理完交还ring*/
+static void *uring_step(void *arg)
+{
+    struct session *s = (struct session *)arg;
+    if (session_process(s, s->ring_res, 0))
+        ring_back(s);
+    return NULL;
+}
+
+/*注册回复的socket可写（或出错）：与注册相同，由线程池的控制面发送，交给传输表时要取register_lock*/
+static void on_pollout(struct session *s, int res)
+{
+    if (res < 0)
+    {
+        fprintf(stderr, "io_uring poll: %s\n", strerror(-res));
+        close(s->fd);
+        session_free(s);
+        return;
+    }
+    tpool_add_work_prio(uring_send, s, TPOOL_PRIO_CTRL);
+}
+
+/*处理一个recv完成事件*/
+static void on_recv(struct uring *r, struct session *s, int res)
+{
+    /*对端关闭或出错*/
+    if (res <= 0)
+    {
+        if (res < 0)
+            fprintf(stderr, "io_uring recv: %s\n", strerror(-res));
+        close(s->fd);
+        session_free(s);
+        return;
+    }
+
+    /*
+     * -d range/file要等待回写、fdatasync，-i direct同步写入文件，都会阻塞ring上的其他连接，
+     * 交给线程池推进状态机；-d none -i mmap时数据已经收进映射的窗口，在ring线程上处理。
+     */
+    if (conf.durable != DURABLE_NONE || conf.ingest == INGEST_DIRECT)
+    {
+        s->ring_res = res;
+        tpool_add_work_prio(uring_step, s, s->stage < STAGE_HEAD ? TPOOL_PRIO_CTRL : TPOOL_PRIO_DATA);
+        return;
+    }
+    if (session_process(s, res, 1))
+        prep_recv(r, s);
+}
+
+/*ring线程：一个ring，一个listenfd，所有请求批量提交*/
+static void *ring_thread(void *arg)
+{
+    struct ring_ctx *ctx = (struct ring_ctx *)arg;
+    struct uring r;
+    if (uring_init(&r, URING_ENTRIES) < 0)
+    {
+        perror("io_uring_setup");
+        exit(-1);
+    }
+    int listenfd = Server_init_reuseport(ctx->port);
+    prep_accept(&r, listenfd);
+    ctx->efd = eventfd(0, EFD_CLOEXEC);
+    if (ctx->efd < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
+    prep_back(&r, ctx);
+    printf("URING: ring %d listening\n", ctx->id);
+
+    while (1)
+    {
+        /*提交上一轮产生的所有请求，等待至少一个完成事件*/
+        uring_submit(&r, 1);
+
+        unsigned head = *r.cq_head;
+        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+            if (cqe->user_data == ACCEPT_TAG)
+            {
+                if (cqe->res >= 0)
+                {
+                    printf("URING: ring %d received New Connection Request---connfd= %d, heap allocs= %ld\n", ctx->id, cqe->res, conn_heap_allocs());
+                    struct session *s = session_alloc(cqe->res);
+                    s->ring = ctx;
+                    prep_recv(&r, s);
+                }
+                else
+                {
+                    fprintf(stderr, "io_uring accept: %s\n", strerror(-cqe->res));
+                }
+                /*multishot accept被内核终止时重新提交*/
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    prep_accept(&r, listenfd);
+            }
+            else if (cqe->user_data == BACK_TAG)
+            {
+                /*一次取走整个交还栈，继续接收，或等待可写后继续发送注册回复*/
+                struct session *s = __atomic_exchange_n(&ctx->back, NULL, __ATOMIC_ACQUIRE);
+                while (s)
+                {
+                    struct session *next = s->next_free;
+                    if (s->stage == STAGE_REPLY)
+                        prep_pollout(&r, s);
+                    else
+                        prep_recv(&r, s);
+                    s = next;
+                }
+                prep_back(&r, ctx);
+            }
+            else if (((struct session *)cqe->user_data)->stage == STAGE_REPLY)
+            {
+                on_pollout((struct session *)cqe->user_data, cqe->res);
+            }
+            else
+            {
+                on_recv(&r, (struct session *)cqe->user_data, cqe->res);
+            }
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int uring_probe()
+{
+    /*multishot accept需要5.19以上的内核*/
+    struct utsname u;
+    int major = 0, minor = 0;
+    if (uname(&u) != 0 || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return -1;
+    if (major < 5 || (major == 5 && minor < 19))
+        return -1;
+
+    struct uring r;
+    if (uring_init(&r, 4) < 0)
+        return -1;
+
+    /*确认内核支持accept和recv操作*/
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ret = -1;
+    if (probe && sys_io_uring_register(r.fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_RECV &&
+        (probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED))
+        ret = 0;
+    free(probe);
+    uring_exit(&r);
+    return ret;
+}
+
+void uring_run(int port, int nrings)
+{
+    struct ring_ctx *ctx = calloc(nrings, sizeof(struct ring_ctx));
+    int i;
+    for (i = 0; i < nrings; i++)
+    {
+        ctx[i].id = i;
+        ctx[i].port = port;
+        if (i > 0 && pthread_create(&ctx[i].tid, NULL, ring_thread, &ctx[i]) != 0)
+        {
+            printf("%s:pthread_create failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
+            exit(-1);
+        }
+    }
+    /*ring 0 在主线程上运行*/
+    ring_thread(&ctx[0]);
+}
@@ -0,0 +1,10 @@
+#ifndef URING_H__
+#define URING_H__
+
+/*检查内核是否支持io_uring引擎所需的功能（multishot accept、recv），支持返回0*/
+int uring_probe();
+
+/*运行io_uring引擎：nrings个线程，每个线程一个ring和一个SO_REUSEPORT的listenfd，不返回*/
+void uring_run(int port, int nrings);
+
+#endif
@@ -1,203 +1,1122 @@
 #include "work.h"
+#include "conntab.h"
+#include "durable.h"
 
-/*gconn[]数组存放连接信息，带互斥锁*/
-int freeid = 0;
-struct conn gconn[CONN_MAX];
-pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+/*运行时配置*/
+struct server_conf conf = {ENGINE_EPOLL, 0, INGEST_MMAP, THREAD_MIN, THREAD_MAX, 0, DURABLE_NONE,
+                           RECVBUF_SIZE, LISTEN_QUEUE_LEN, CONN_MAX, EPOLL_EVENTS};
 
 /*结构体长度*/
 int fileinfo_len = sizeof(struct fileinfo);
 socklen_t sockaddr_len = sizeof(struct sockaddr);
 int head_len = sizeof(struct head);
-int conn_len = sizeof(struct conn);
 
-int createfile(char *filename, int size)
+int createfile(char *filename, int64_t size)
 {
-    int fd = open(filename, O_RDWR | O_CREAT);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC);
     fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    lseek(fd, size - 1, SEEK_SET);
-    write(fd, "", 1);
+    /*一次分配全部磁盘空间，乱序到达的文件块不会产生碎片*/
+    if (fallocate(fd, 0, 0, size) == -1)
+    {
+        lseek(fd, (off_t)size - 1, SEEK_SET);
+        write(fd, "", 1);
+    }
     close(fd);
     return 0;
 }
 
-/*工作线程，分析type，选择工种*/
-void *worker(void *argc)
+/*打开并映射续传文件；已有同一文件的续传文件时返回1，否则新建空位图返回0，出错返回-1*/
+static int part_open(char *partpath, struct fileinfo *finfo, char **part, int64_t *part_len)
 {
-    struct args *pw = (struct args *)argc;
-    int conn_fd = pw->fd;
+    int64_t len = sizeof(struct part_header) + (finfo->count + 7) / 8;
+    int resume = 0;
+    int fd = open(partpath, O_RDWR);
+    if (fd >= 0)
+    {
+        struct part_header h;
+        struct stat st;
+        resume = fstat(fd, &st) == 0 && st.st_size == len &&
+                 pread(fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, PART_MAGIC, sizeof(h.magic)) == 0 &&
+                 h.filesize == finfo->filesize && h.bs == finfo->bs && h.mtime == finfo->mtime && h.count == finfo->count;
+        if (!resume)
+            close(fd);
+    }
+    if (!resume)
+    {
+        /*新的传输：换一个新文件，被替换的传输可能还映射着原来的位图*/
+        unlink(partpath);
+        fd = open(partpath, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        struct part_header h;
+        bzero(&h, sizeof(h));
+        memcpy(h.magic, PART_MAGIC, sizeof(h.magic));
+        h.filesize = finfo->filesize;
+        h.bs = finfo->bs;
+        h.mtime = finfo->mtime;
+        h.count = finfo->count;
+        if (fd < 0 || ftruncate(fd, len) == -1 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+        {
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+    }
 
-    char type_buf[INT_SIZE] = {0};
-    char *p = type_buf;
-    int recv_size = 0;
-    while (1)
+    /*位图很小，整体映射，分块完成时直接置位*/
+    char *map = (char *)mmap(NULL, len, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    *part = map;
+    *part_len = len;
+    return resume;
+}
+
+/*阻塞发送len字节，位图可能超过socket缓冲区*/
+static int send_all(int fd, const char *buf, int64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*位图中已置位的分块数*/
+static int part_received(unsigned char *bitmap, int count)
+{
+    int i, n = 0;
+    for (i = 0; i < (count + 7) / 8; i++)
+        n += __builtin_popcount(bitmap[i]);
+    return n;
+}
+
+/*
+ * 注册、中止、确认都要改变传输的info_fd，用register_lock串行：
+ * 同名文件不会同时注册两次，监视线程不会中止刚刚换了info_fd的传输。
+ */
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long heap_allocs = 0;
+
+void conn_heap_grow()
+{
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+}
+
+long conn_heap_allocs()
+{
+    return __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
+
+/*
+ * 缓冲池（dbuf、位图）：放回时无锁压栈，可以在任意线程调用；取出时用pop_lock串行，
+ * 栈顶在比较之前不会被别的线程取走再放回，没有ABA问题。不用线程私有链表，
+ * 缓冲区不会积压在不再分配的线程上，池的大小只取决于同时使用的数量。
+ */
+struct bufstack
+{
+    void *head;
+    pthread_mutex_t pop_lock;
+};
+
+#define BUFSTACK_INITIALIZER {NULL, PTHREAD_MUTEX_INITIALIZER}
+
+/*池为空时返回NULL，由调用者从堆上分配*/
+static void *bufstack_pop(struct bufstack *st)
+{
+    pthread_mutex_lock(&st->pop_lock);
+    void *buf = __atomic_load_n(&st->head, __ATOMIC_ACQUIRE);
+    while (buf && !__atomic_compare_exchange_n(&st->head, &buf, *(void **)buf, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        ;
+    pthread_mutex_unlock(&st->pop_lock);
+    return buf;
+}
+
+static void bufstack_push(struct bufstack *st, void *buf)
+{
+    *(void **)buf = __atomic_load_n(&st->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&st->head, (void **)buf, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*内存位图按BITMAP_MIN乘2的幂分级缓存：传输关闭时放回，之后注册的文件复用*/
+#define BITMAP_MIN 64
+#define BITMAP_CLASSES 32
+static struct bufstack free_bitmaps[BITMAP_CLASSES] = {[0 ... BITMAP_CLASSES - 1] = BUFSTACK_INITIALIZER};
+
+static int bitmap_class(int len)
+{
+    int k = 0;
+    while (((int64_t)BITMAP_MIN << k) < len)
+        k++;
+    return k;
+}
+
+static unsigned char *bitmap_alloc(int len)
+{
+    int k = bitmap_class(len);
+    unsigned char *bitmap = (unsigned char *)bufstack_pop(&free_bitmaps[k]);
+    if (!bitmap)
     {
-        if (recv(conn_fd, p, 1, 0) == 1)
+        bitmap = (unsigned char *)malloc((int64_t)BITMAP_MIN << k);
+        if (!bitmap)
         {
-            ++recv_size;
-            if (recv_size == INT_SIZE)
-                break;
-            ++p;
+            printf("bitmap_alloc(): malloc failed\n");
+            exit(-1);
         }
+        conn_heap_grow();
+    }
+    return bitmap;
+}
+
+static void bitmap_free(unsigned char *bitmap, int len)
+{
+    bufstack_push(&free_bitmaps[bitmap_class(len)], bitmap);
+}
+
+/*传输的最后一个引用释放后解除映射，关闭文件，位图放回缓存*/
+static void conn_close(struct conn *c)
+{
+    munmap(c->part, c->part_len);
+    bitmap_free(c->bitmap, (c->count + 7) / 8);
+    close(c->file_fd);
+    if (c->direct_fd >= 0)
+        close(c->direct_fd);
+}
+
+void conn_release(int id)
+{
+    struct conn last;
+    if (conntab_release(id, &last))
+        conn_close(&last);
+}
+
+static void conn_remove(int id)
+{
+    struct conn last;
+    if (conntab_remove(id, &last))
+        conn_close(&last);
+}
+
+void part_checkpoint(struct conn *c)
+{
+    int len = (c->count + 7) / 8;
+    unsigned char snap[len];
+    int i;
+    for (i = 0; i < len; i++)
+        snap[i] = __atomic_load_n(&c->bitmap[i], __ATOMIC_ACQUIRE);
+    if (fdatasync(c->file_fd) == -1)
+    {
+        perror("fdatasync");
+        return;
+    }
+    unsigned char *bitmap = (unsigned char *)c->part + sizeof(struct part_header);
+    for (i = 0; i < len; i++)
+        __atomic_fetch_or(&bitmap[i], snap[i], __ATOMIC_RELAXED);
+    msync(c->part, c->part_len, MS_SYNC);
+}
+
+/*info_fd还连着client：没有数据可读（client在等待确认），或者有还没有回复的查询；注册回复还在发送时也算*/
+static int conn_alive(struct conn *c)
+{
+    char b;
+    if (c->info_fd < 0)
+        return !__atomic_load_n(&c->done, __ATOMIC_ACQUIRE);
+    ssize_t n = recv(c->info_fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/*
+ * 中止client已经退出的传输：关闭info_fd，从传输表中移除，续传文件保留；调用时持有register_lock。
+ * 已接收完毕、正在同步或确认的传输不中止，返回0。
+ */
+static int conn_abort(int id, struct conn *c)
+{
+    if (c->info_fd >= 0)
+        close(c->info_fd);
+    c->info_fd = -1;
+    if (__atomic_exchange_n(&c->done, 1, __ATOMIC_ACQ_REL))
+        return 0;
+    printf("register_file(): client of %s is gone, transfer %d aborted\n", c->filename, id);
+    conn_remove(id);
+    return 1;
+}
+
+/*
+ * 信息交换socket的监视线程：注册之后client在info_fd上只发送查询（TYPE_QUERY与id），
+ * 回复缺少的分块；info_fd上EOF或出错说明client已经退出，中止没有完成的传输，已落盘的分块写入续传文件。
+ */
+static int watch_epfd = -1;
+static pthread_once_t watch_once = PTHREAD_ONCE_INIT;
+
+static void watch_add(int id, int fd, int op);
+
+/*
+ * 回复查询：缺少的分块数与已接收分块的位图，client据此重发；调用时持有register_lock，
+ * 在确认之前发出，不会与确认交错。文件已接收完毕、正在同步时缺少0块，client继续等待确认。
+ */
+static void watch_reply(struct conn *c, int fd)
+{
+    struct file_ack reply = {ACK_MISSING, 0};
+    int missing = c->count - __atomic_load_n(&c->recvcount, __ATOMIC_ACQUIRE);
+    if (send_all(fd, (char *)&reply, sizeof(reply)) == 0 && send_all(fd, (char *)&missing, INT_SIZE) == 0 && missing > 0)
+        send_all(fd, (char *)c->bitmap, (c->count + 7) / 8);
+    printf("query of %s: %d block(s) missing\n", c->filename, missing);
+}
+
+static void watch_event(int id, int fd, unsigned events)
+{
+    pthread_mutex_lock(&register_lock);
+    struct conn *c = conntab_acquire(id);
+    /*info_fd已经换成重连的socket或已经确认关闭，fd可能已被复用，不能再读*/
+    if (!c || c->info_fd != fd)
+    {
+        pthread_mutex_unlock(&register_lock);
+        if (c)
+            conn_release(id);
+        return;
     }
 
-    int type = *((int *)type_buf);
-    switch (type)
+    /*client还连着时是查询：回复后继续监视，只到达一部分时等待其余部分；其他数据视为client出错*/
+    if (!(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
     {
-    /*接收文件信息*/
-    case 0:
-        printf("## worker ##\nCase %d: the work is recv file-info\n", type);
-        pw->recv_finfo(conn_fd);
-        break;
-    /*接收文件块*/
-    case 255:
-        printf("## worker ##\nCase %d: the work is recv file-data\n", type);
-        pw->recv_fdata(conn_fd);
-        break;
-    default:
-        printf("unknown type!");
-        return NULL;
+        int query[2];
+        ssize_t n = recv(fd, query, sizeof(query), MSG_PEEK | MSG_DONTWAIT);
+        int asked = n == (ssize_t)sizeof(query) && query[0] == FRAME_TYPE(TYPE_QUERY) && query[1] == id;
+        if (asked || (n > 0 && n < (ssize_t)sizeof(query)))
+        {
+            if (asked)
+            {
+                recv(fd, query, sizeof(query), MSG_DONTWAIT);
+                watch_reply(c, fd);
+            }
+            watch_add(id, fd, EPOLL_CTL_MOD);
+            pthread_mutex_unlock(&register_lock);
+            conn_release(id);
+            return;
+        }
     }
+    int aborted = conn_abort(id, c);
+    pthread_mutex_unlock(&register_lock);
+
+    if (aborted)
+        part_checkpoint(c);
+    conn_release(id);
+}
 
+static void *watch_thread(void *arg)
+{
+    struct epoll_event events[EPOLL_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(watch_epfd, events, EPOLL_EVENTS, -1);
+        int i;
+        for (i = 0; i < n; i++)
+            watch_event((int)(events[i].data.u64 >> 32), (int)(uint32_t)events[i].data.u64, events[i].events);
+    }
     return NULL;
 }
 
-/*接收文件信息，添加连接到gobalconn[]数组，创建填充文件，map到内存*/
-void recv_fileinfo(int sockfd)
+static void watch_start()
 {
-    /*接收文件信息*/
-    char fileinfo_buf[100] = {0};
-    bzero(fileinfo_buf, fileinfo_len);
-    int n = 0;
-    for (n = 0; n < fileinfo_len; n++)
+    pthread_t tid;
+    watch_epfd = epoll_create1(0);
+    if (watch_epfd == -1 || pthread_create(&tid, NULL, watch_thread, NULL) != 0)
     {
-        recv(sockfd, &fileinfo_buf[n], 1, 0);
+        printf("%s: start watch thread failed, errno:%d, error:%s\n", __FUNCTION__, errno, strerror(errno));
+        exit(-1);
     }
+    pthread_detach(tid);
+}
 
-    struct fileinfo finfo;
-    memcpy(&finfo, fileinfo_buf, fileinfo_len);
+/*监视info_fd（op为EPOLL_CTL_ADD，回复查询后EPOLL_CTL_MOD重新打开），只触发一次；info_fd关闭时自动从epoll中移除*/
+static void watch_add(int id, int fd, int op)
+{
+    pthread_once(&watch_once, watch_start);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.u64 = (uint64_t)(uint32_t)id << 32 | (uint32_t)fd;
+    epoll_ctl(watch_epfd, op, fd, &ev);
+}
 
+/*创建填充文件与续传文件，添加连接到传输表，返回时持有传输的引用；文件不整体映射，每个数据连接映射自己的窗口*/
+int register_file(struct fileinfo *finfo, int *seq)
+{
     printf("------- fileinfo -------\n");
-    printf("filename = %s\nfilesize = %d\ncount = %d\nbs = %d\n", finfo.filename, finfo.filesize, finfo.count, finfo.bs);
+    printf("filename = %s\nfilesize = %lld\ncount = %d\nbs = %lld\n", finfo->filename, (long long)finfo->filesize, finfo->count, (long long)finfo->bs);
     printf("------------------------\n");
 
-    /*创建填充文件，map到虚存*/
+    finfo->filename[FILENAME_MAXLEN - 1] = 0;
+    if (finfo->filesize <= 0 || finfo->count <= 0 || finfo->bs <= 0 ||
+        finfo->count != (finfo->filesize + finfo->bs - 1) / finfo->bs)
+    {
+        printf("invalid fileinfo\n");
+        return ID_INVALID;
+    }
+
+    pthread_mutex_lock(&register_lock);
+    /*同一文件正在传输：client断开后重连，沿用原来的槽，关闭原来的info_fd，新的连接发完注册回复后接管*/
+    int id = conntab_find(finfo->filename);
+    if (id >= 0)
+    {
+        struct conn *c = conntab_get(id);
+        if (c && c->filesize == finfo->filesize && c->bs == finfo->bs && c->mtime == finfo->mtime)
+        {
+            printf("register_file(): resume transfer %d\n", id);
+            if (c->info_fd >= 0)
+                close(c->info_fd);
+            c->info_fd = -1;
+            *seq = ++c->info_seq;
+            conntab_acquire(id);
+            pthread_mutex_unlock(&register_lock);
+            return id;
+        }
+        /*文件信息不同（例如分块大小改变）：原来的client还在时拒绝，已经退出时替换*/
+        if (c && (conn_alive(c) || !conn_abort(id, c)))
+        {
+            printf("register_file(): %s is being received\n", finfo->filename);
+            pthread_mutex_unlock(&register_lock);
+            return ID_BUSY;
+        }
+    }
+
+    /*续传文件与目标文件都存在时从位图继续，否则重新创建填充文件*/
     char filepath[100] = {0};
-    strcpy(filepath, finfo.filename);
-    createfile(filepath, finfo.filesize);
+    char partpath[100] = {0};
+    strcpy(filepath, finfo->filename);
+    sprintf(partpath, "%s%s", finfo->filename, PART_SUFFIX);
+    char *part;
+    int64_t part_len;
+    int resume = part_open(partpath, finfo, &part, &part_len);
+    if (resume < 0)
+    {
+        printf("open part file erro\n");
+        pthread_mutex_unlock(&register_lock);
+        return ID_BUSY;
+    }
+    struct stat st;
+    if (resume && (stat(filepath, &st) != 0 || st.st_size != finfo->filesize))
+    {
+        bzero(part + sizeof(struct part_header), part_len - sizeof(struct part_header));
+        resume = 0;
+    }
+    /*新文件换一个inode，被替换的传输中还没有结束的连接写不到新文件中*/
+    if (!resume)
+    {
+        unlink(filepath);
+        createfile(filepath, finfo->filesize);
+    }
     int fd = 0;
     if ((fd = open(filepath, O_RDWR)) == -1)
     {
         printf("open file erro\n");
         exit(-1);
     }
-    //   printf("fd = %d\n", fd);
-    char *map = (char *)mmap(NULL, finfo.filesize, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
-    //   printf("mbegin = %p\n", map);
-    close(fd);
+    /*文件系统不支持O_DIRECT时（如tmpfs）经页缓存写入*/
+    int direct_fd = -1;
+    if (conf.ingest == INGEST_DIRECT && (direct_fd = open(filepath, O_RDWR | O_DIRECT)) == -1)
+        perror("open O_DIRECT");
+
+    /*向传输表中添加连接*/
+    struct conn c;
+    bzero(&c, sizeof(c));
+    c.info_fd = -1;
+    strcpy(c.filename, finfo->filename);
+    c.filesize = finfo->filesize;
+    c.count = finfo->count;
+    c.bs = finfo->bs;
+    c.mtime = finfo->mtime;
+    c.file_fd = fd;
+    c.direct_fd = direct_fd;
+    c.part = part;
+    c.part_len = part_len;
+    c.bitmap = bitmap_alloc((finfo->count + 7) / 8);
+    memcpy(c.bitmap, part + sizeof(struct part_header), (finfo->count + 7) / 8);
+    c.recvcount = part_received(c.bitmap, finfo->count);
+    if (resume)
+        printf("register_file(): resume %s, %d of %d blocks received\n", finfo->filename, c.recvcount, c.count);
 
-    /*向gconn[]中添加连接*/
-    pthread_mutex_lock(&conn_lock);
+    id = conntab_insert(&c);
+    if (id >= 0)
+        conntab_acquire(id);
+    pthread_mutex_unlock(&register_lock);
+    *seq = 0;
+    if (id < 0)
+    {
+        /*传输表已满，拒绝本次传输；续传文件保留*/
+        printf("register_file(): transfer table is full\n");
+        conn_close(&c);
+    }
+    return id;
+}
 
-    printf("recv_fileinfo(): Lock conn_lock, enter gconn[]\n");
-    while (gconn[freeid].used)
+int ingest_mmap(int sockfd, char *dst, int64_t size)
+{
+    int64_t remain_size = size; //数据块中待接收数据大小
+    int n = 0;              //一次recv接受数据大小
+    while (remain_size > 0)
     {
-        ++freeid;
-        freeid = freeid % CONN_MAX;
+        n = recv(sockfd, dst, remain_size < conf.recvbuf ? remain_size : conf.recvbuf, 0);
+        if (n > 0)
+        {
+            dst += n;
+            remain_size -= n;
+        }
+        else if (n == 0 || errno != EINTR)
+            return -1;
     }
+    return 0;
+}
 
-    bzero(&gconn[freeid].filename, FILENAME_MAXLEN);
-    gconn[freeid].info_fd = sockfd;
-    strcpy(gconn[freeid].filename, finfo.filename);
-    gconn[freeid].filesize = finfo.filesize;
-    gconn[freeid].count = finfo.count;
-    gconn[freeid].bs = finfo.bs;
-    gconn[freeid].mbegin = map;
-    gconn[freeid].recvcount = 0;
-    gconn[freeid].used = 1;
+/*每个线程一个管道，第一次使用时创建*/
+static __thread int splice_pipe[2] = {-1, -1};
 
-    pthread_mutex_unlock(&conn_lock);
+int ingest_splice_some(int sockfd, int file_fd, off_t offset, int64_t size)
+{
+    if (splice_pipe[0] < 0)
+    {
+        if (pipe(splice_pipe) == -1)
+            return -1;
+        /*扩大管道，减少splice次数；失败时使用默认容量*/
+        fcntl(splice_pipe[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+    }
 
-    printf("recv_fileinfo(): Unock conn_lock, exit gconn[]\n");
+    /*socket -> 管道，每次调用开始时管道为空*/
+    ssize_t n = splice(sockfd, NULL, splice_pipe[1], NULL, size < SPLICE_CHUNK ? size : SPLICE_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n <= 0)
+        return n;
 
-    /*向client发送分配的freeid（gconn[]数组下标），作为确认，每个分块都将携带id*/
-    char freeid_buf[INT_SIZE] = {0};
-    memcpy(freeid_buf, &freeid, INT_SIZE);
-    send(sockfd, freeid_buf, INT_SIZE, 0);
-    printf("freeid = %d\n", *(int *)freeid_buf);
+    /*管道 -> 文件，把管道中的数据全部写出*/
+    ssize_t left = n;
+    while (left > 0)
+    {
+        ssize_t m = splice(splice_pipe[0], NULL, file_fd, &offset, left, SPLICE_F_MOVE);
+        if (m == -1 && errno == EINTR)
+            continue;
+        if (m <= 0)
+        {
+            /*管道中残留数据，关闭后下次重新创建*/
+            close(splice_pipe[0]);
+            close(splice_pipe[1]);
+            splice_pipe[0] = splice_pipe[1] = -1;
+            errno = EIO;
+            return -1;
+        }
+        left -= m;
+    }
+    return n;
+}
 
-    return;
+int ingest_splice(int sockfd, int file_fd, off_t offset, int64_t size)
+{
+    int64_t remain_size = size;
+    while (remain_size > 0)
+    {
+        int n = ingest_splice_some(sockfd, file_fd, offset, remain_size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        offset += n;
+        remain_size -= n;
+    }
+    return 0;
+}
+
+int direct_write(int direct_fd, int file_fd, char *buf, int64_t len, off_t offset)
+{
+    /*偏移不对齐时整段经页缓存写入*/
+    int64_t aligned = 0;
+    if (direct_fd >= 0 && offset % DIRECT_ALIGN == 0)
+        aligned = len & ~(int64_t)(DIRECT_ALIGN - 1);
+
+    int64_t done = 0;
+    while (done < len)
+    {
+        int fd = done < aligned ? direct_fd : file_fd;
+        int64_t end = done < aligned ? aligned : len;
+        ssize_t n = pwrite(fd, buf + done, end - done, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
 }
 
-/*接收文件块*/
-void recv_filedata(int sockfd)
+int ingest_direct(int sockfd, int direct_fd, int file_fd, off_t offset, int64_t size)
 {
-    // set_fd_noblock(sockfd);
+    char *buf = dbuf_alloc();
+    int ret = 0;
+    while (size > 0 && ret == 0)
+    {
+        int len = size < DIRECT_BUF ? size : DIRECT_BUF;
+        ret = ingest_mmap(sockfd, buf, len);
+        if (ret == 0)
+            ret = direct_write(direct_fd, file_fd, buf, len, offset);
+        offset += len;
+        size -= len;
+    }
+    dbuf_free(buf);
+    return ret;
+}
+
+/*空闲的O_DIRECT缓冲区，链表指针存放在缓冲区开头*/
+static struct bufstack free_dbufs = BUFSTACK_INITIALIZER;
 
-    /*读取分块头部信息*/
-    int recv_size = 0;
-    char head_buf[100] = {0};
-    char *p = head_buf;
+char *dbuf_alloc()
+{
+    void *buf = bufstack_pop(&free_dbufs);
+    if (!buf)
+    {
+        if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUF) != 0)
+        {
+            printf("dbuf_alloc(): posix_memalign failed\n");
+            exit(-1);
+        }
+        conn_heap_grow();
+    }
+    return (char *)buf;
+}
+
+void dbuf_free(char *buf)
+{
+    bufstack_push(&free_dbufs, buf);
+}
+
+void complete_file(int id, struct file_ack *ack)
+{
+    struct conn *c = conntab_get(id);
+    if (!c)
+        return;
+    char partpath[100] = {0};
+    sprintf(partpath, "%s%s", c->filename, PART_SUFFIX);
+    unlink(partpath);
+
+    /*
+     * 先移出传输表再确认，client收到确认后立即重传同一文件时是新的传输；
+     * 与register_file()互斥，重连的client不会换上一个已经移出的传输；文件在最后一个引用释放时关闭
+     */
+    pthread_mutex_lock(&register_lock);
+    int info_fd = c->info_fd;
+    c->info_fd = -1;
+    /*注册回复还没有发完，确认暂存，由回复的session接着发送*/
+    if (info_fd < 0)
+    {
+        c->ack = *ack;
+        c->acked = 1;
+    }
+    conn_remove(id);
+    pthread_mutex_unlock(&register_lock);
+    printf("-----------------  Recv a File ----------------- \n ");
+
+    if (info_fd >= 0)
+    {
+        send_all(info_fd, (char *)ack, sizeof(struct file_ack));
+        close(info_fd);
+    }
+}
+
+/*文件接收完毕：-d file时交给同步线程，否则直接确认；同一文件只结束一次*/
+static void finish_file(int id, struct conn *c)
+{
+    if (__atomic_exchange_n(&c->done, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (conf.durable == DURABLE_FILE)
+    {
+        durable_commit(id, c);
+        return;
+    }
+    struct file_ack ack = {0, 0};
+    complete_file(id, &ack);
+}
+
+/*
+ * 在内存位图中置位，第一次收到的分块才增加recv_count；最后一个分块时结束文件。
+ * -d range/file：交给同步线程，与同一批的其他分块、文件共用一次fdatasync，之后才写入续传文件，
+ * 崩溃后不会跳过没有落盘的分块；最后一个分块之后文件整体同步并删除续传文件，不用再单独同步。
+ */
+void finish_block(int recv_id, int64_t offset)
+{
+    struct conn *c = conntab_get(recv_id);
+    if (!c)
+        return;
+    int block = offset / c->bs;
+    unsigned char bit = 1 << (block % 8);
+    if (__atomic_fetch_or(&c->bitmap[block / 8], bit, __ATOMIC_ACQ_REL) & bit)
+        return;
+    if (__atomic_add_fetch(&c->recvcount, 1, __ATOMIC_ACQ_REL) == c->count)
+    {
+        finish_file(recv_id, c);
+        return;
+    }
+    if (conf.durable != DURABLE_NONE)
+        durable_checkpoint(recv_id, c);
+}
+
+void session_init(struct session *s, int fd)
+{
+    bzero(s, sizeof(struct session));
+    s->fd = fd;
+    s->stage = STAGE_TYPE;
+    s->need = INT_SIZE;
+    s->conn_id = -1;
+}
+
+/*
+ * 空闲的session：任意线程session_free()时压入全局栈；
+ * 分配时先用线程私有链表，为空时一次取走整个全局栈，只用交换，没有ABA问题。
+ */
+static struct session *free_sessions = NULL;
+static __thread struct session *local_sessions = NULL;
+
+struct session *session_alloc(int fd)
+{
+    if (!local_sessions)
+        local_sessions = __atomic_exchange_n(&free_sessions, NULL, __ATOMIC_ACQUIRE);
+    if (!local_sessions)
+    {
+        struct session *slab = (struct session *)malloc(SESSION_SLAB * sizeof(struct session));
+        if (!slab)
+        {
+            printf("session_alloc(): malloc failed\n");
+            exit(-1);
+        }
+        conn_heap_grow();
+        int i;
+        for (i = 0; i < SESSION_SLAB - 1; i++)
+            slab[i].next_free = &slab[i + 1];
+        slab[SESSION_SLAB - 1].next_free = NULL;
+        local_sessions = slab;
+    }
+
+    struct session *s = local_sessions;
+    local_sessions = s->next_free;
+    session_init(s, fd);
+    return s;
+}
+
+void session_free(struct session *s)
+{
+    /*注册回复没有发完client就断开：与监视线程相同，回复的还是最后一次注册时中止传输*/
+    if (s->stage == STAGE_REPLY && s->conn)
+    {
+        struct conn *c = s->conn;
+        pthread_mutex_lock(&register_lock);
+        int aborted = s->reply_seq == c->info_seq && c->info_fd < 0 && conn_abort(s->conn_id, c);
+        pthread_mutex_unlock(&register_lock);
+        if (aborted)
+            part_checkpoint(c);
+        s->conn = NULL;
+    }
+    /*文件块没有收完就断开，释放传输的引用*/
+    if (s->conn_id >= 0)
+    {
+        conn_release(s->conn_id);
+        s->conn_id = -1;
+    }
+    if (s->win)
+    {
+        munmap(s->win, s->win_len);
+        s->win = NULL;
+    }
+    if (s->dbuf)
+    {
+        dbuf_free(s->dbuf);
+        s->dbuf = NULL;
+    }
+    s->next_free = __atomic_load_n(&free_sessions, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&free_sessions, &s->next_free, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+/*让窗口覆盖s->pos：窗口从pos所在的页开始，最长SESSION_WINDOW，不超过文件块末尾*/
+static int session_slide(struct session *s)
+{
+    if (s->win && s->pos >= s->win_off && s->pos < s->win_off + s->win_len)
+        return 0;
+    if (s->win)
+    {
+        munmap(s->win, s->win_len);
+        s->win = NULL;
+    }
+
+    static long page_size = 0;
+    if (page_size == 0)
+        page_size = sysconf(_SC_PAGESIZE);
+    int64_t off = s->pos & ~(int64_t)(page_size - 1);
+    int64_t len = s->pos + s->remain - off;
+    if (len > SESSION_WINDOW)
+        len = SESSION_WINDOW;
+
+    char *map = (char *)mmap(NULL, len, PROT_WRITE | PROT_READ, MAP_SHARED, s->file_fd, off);
+    if (map == MAP_FAILED)
+        return -1;
+    s->win = map;
+    s->win_off = off;
+    s->win_len = len;
+    return 0;
+}
+
+int session_want(struct session *s, char **buf)
+{
+    /*O_DIRECT：收进对齐的缓冲区，满了再写入*/
+    if (s->stage == STAGE_DATA && s->dbuf)
+    {
+        *buf = s->dbuf + s->dlen;
+        int64_t len = s->remain < DIRECT_BUF - s->dlen ? s->remain : DIRECT_BUF - s->dlen;
+        return len < conf.recvbuf ? len : conf.recvbuf;
+    }
+
+    /*预读缓冲区中的数据已经交给文件块，直接收进窗口*/
+    if (s->stage == STAGE_DATA)
+    {
+        if (session_slide(s) < 0)
+            return -1;
+        *buf = s->win + (s->pos - s->win_off);
+        int64_t len = s->win_off + s->win_len - s->pos;
+        if (len > s->remain)
+            len = s->remain;
+        return len < conf.recvbuf ? len : conf.recvbuf;
+    }
+
+    /*未处理的数据移到缓冲区开头，尽量多读*/
+    if (s->rpos > 0)
+    {
+        memmove(s->rbuf, s->rbuf + s->rpos, s->rlen - s->rpos);
+        s->rlen -= s->rpos;
+        s->rpos = 0;
+    }
+    *buf = s->rbuf + s->rlen;
+    return SESSION_RBUF - s->rlen;
+}
+
+/*等待[off, off + len)写完后丢弃其页缓存；映射中的页面丢弃不了，先解除覆盖这一段的窗口，之后按需重新映射*/
+static void session_drop(struct session *s, int64_t off, int64_t len)
+{
+    sync_file_range(s->file_fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    if (s->win && s->win_off < off + len && off < s->win_off + s->win_len)
+    {
+        munmap(s->win, s->win_len);
+        s->win = NULL;
+    }
+    int64_t start = off & ~(int64_t)(DROP_ALIGN - 1);
+    posix_fadvise(s->file_fd, start, off + len - start, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * -d range/file：[wb_off, pos)满SYNC_WINDOW时开始回写，等待上一个窗口写完后丢弃其页缓存，
+ * 磁盘写入保持平稳，脏页不会堆积；文件块结束时等待全部写完。
+ */
+static void session_writeback(struct session *s)
+{
+    if (conf.durable == DURABLE_NONE)
+        return;
+    int last = s->remain == 0;
+    int64_t len = s->pos - s->wb_off;
+    if (len < SYNC_WINDOW && !last)
+        return;
+
+    if (len > 0)
+        sync_file_range(s->file_fd, s->wb_off, len, SYNC_FILE_RANGE_WRITE);
+    if (s->wb_prev_len > 0)
+        session_drop(s, s->wb_prev_off, s->wb_prev_len);
+    s->wb_prev_off = s->wb_off;
+    s->wb_prev_len = len;
+    s->wb_off = s->pos;
+
+    if (last && len > 0)
+    {
+        session_drop(s, s->wb_prev_off, s->wb_prev_len);
+        s->wb_prev_len = 0;
+    }
+}
+
+/*O_DIRECT：dbuf中增加了n字节，缓冲区满或文件块结束时写入文件，pos是dbuf开头在文件中的偏移*/
+static int session_put(struct session *s, int n)
+{
+    s->dlen += n;
+    s->remain -= n;
+    if (s->dlen == DIRECT_BUF || s->remain == 0)
+    {
+        if (direct_write(s->direct_fd, s->file_fd, s->dbuf, s->dlen, s->pos) < 0)
+        {
+            perror("direct_write");
+            return SESSION_ERROR;
+        }
+        s->pos += s->dlen;
+        s->dlen = 0;
+        session_writeback(s);
+    }
+    return s->remain == 0 ? SESSION_BLOCK : SESSION_MORE;
+}
+
+/*从预读缓冲区中解析头部；进入文件块阶段后，把已读到的数据交给文件块*/
+static int session_parse(struct session *s)
+{
     while (1)
     {
-        if (recv(sockfd, p, 1, 0) == 1)
+        if (s->stage == STAGE_DATA)
+        {
+            /*预读到的数据不足一页，直接写入文件，窗口在session_want()中按需映射*/
+            int take = s->rlen - s->rpos;
+            if (take > s->remain)
+                take = s->remain;
+            if (s->dbuf)
+            {
+                memcpy(s->dbuf + s->dlen, s->rbuf + s->rpos, take);
+                s->rpos += take;
+                return session_put(s, take);
+            }
+            if (take > 0 && pwrite(s->file_fd, s->rbuf + s->rpos, take, s->pos) != take)
+            {
+                perror("pwrite");
+                return SESSION_ERROR;
+            }
+            s->rpos += take;
+            s->pos += take;
+            s->remain -= take;
+            session_writeback(s);
+            return s->remain == 0 ? SESSION_BLOCK : SESSION_MORE;
+        }
+
+        if (s->rlen - s->rpos < s->need)
+            return SESSION_MORE;
+        char *p = s->rbuf + s->rpos;
+        s->rpos += s->need;
+
+        switch (s->stage)
         {
-            ++recv_size;
-            if (recv_size == head_len)
+        /*分析type，选择下一阶段*/
+        case STAGE_TYPE:
+        {
+            int type = *((int *)p);
+            int version = type >> 8 ? type >> 8 : 1;
+            if (version != PROTO_VERSION)
+            {
+                /*文件信息连接等待id，告诉client版本不一致*/
+                printf("protocol version %d is not supported (server: %d)\n", version, PROTO_VERSION);
+                int reply = ID_BADVERSION;
+                if ((type & 0xff) == TYPE_FILEINFO)
+                    send(s->fd, &reply, INT_SIZE, MSG_DONTWAIT | MSG_NOSIGNAL);
+                return SESSION_ERROR;
+            }
+            type &= 0xff;
+            if (type == TYPE_FILEINFO)
+            {
+                printf("## session ##\nCase %d: the work is recv file-info\n", type);
+                s->stage = STAGE_FILEINFO;
+                s->need = fileinfo_len;
+                break;
+            }
+            if (type == TYPE_DATA)
+            {
+                printf("## session ##\nCase %d: the work is recv file-data\n", type);
+                s->stage = STAGE_HEAD;
+                s->need = head_len;
                 break;
-            ++p;
+            }
+            printf("unknown type!\n");
+            return SESSION_ERROR;
+        }
+        case STAGE_FILEINFO:
+            memcpy(&s->finfo, p, fileinfo_len);
+            return SESSION_FILEINFO;
+        case STAGE_HEAD:
+        {
+            memcpy(&s->fhead, p, head_len);
+            /*接收文件块期间持有传输的引用，传输结束或中止时文件不会被关闭*/
+            struct conn *c = conntab_acquire(s->fhead.id);
+            if (!c)
+            {
+                printf("invalid blockhead: id = %d\n", s->fhead.id);
+                return SESSION_ERROR;
+            }
+            s->conn_id = s->fhead.id;
+            /*文件块必须是完整的一个分块，位图才能记录*/
+            if (s->fhead.offset < 0 || s->fhead.offset >= c->filesize || s->fhead.offset % c->bs != 0 ||
+                s->fhead.bs != (c->filesize - s->fhead.offset < c->bs ? c->filesize - s->fhead.offset : c->bs))
+            {
+                printf("invalid blockhead: id = %d\n", s->fhead.id);
+                return SESSION_ERROR;
+            }
+            /*本块从文件的offset处开始写*/
+            s->file_fd = c->file_fd;
+            s->pos = s->fhead.offset;
+            s->remain = s->fhead.bs;
+            s->wb_off = s->pos;
+            s->wb_prev_len = 0;
+            s->stage = STAGE_DATA;
+            if (conf.ingest == INGEST_DIRECT)
+            {
+                s->direct_fd = c->direct_fd;
+                s->dbuf = dbuf_alloc();
+                s->dlen = 0;
+            }
+
+            printf("------- blockhead -------\n");
+            printf("filename = %s\nThe filedata id = %d\noffset=%lld\nbs = %lld\n", s->fhead.filename, s->fhead.id, (long long)s->fhead.offset, (long long)s->fhead.bs);
+            printf("-------------------------\n");
+            break;
+        }
+        default:
+            return SESSION_ERROR;
         }
     }
+}
 
-    struct head fhead;
-    memcpy(&fhead, head_buf, head_len);
-    int recv_id = fhead.id;
+int session_advance(struct session *s, int n)
+{
+    if (s->stage == STAGE_DATA && s->dbuf)
+        return session_put(s, n);
 
-    /*计算本块在map中起始地址fp*/
-    int recv_offset = fhead.offset;
-    char *fp = gconn[recv_id].mbegin + recv_offset;
+    /*接收文件块数据，已经写入窗口或文件*/
+    if (s->stage == STAGE_DATA)
+    {
+        s->pos += n;
+        s->remain -= n;
+        session_writeback(s);
+        return s->remain == 0 ? SESSION_BLOCK : SESSION_MORE;
+    }
 
-    printf("------- blockhead -------\n");
-    printf("filename = %s\nThe filedata id = %d\noffset=%d\nbs = %d\nstart addr= %p\n", fhead.filename, fhead.id, fhead.offset, fhead.bs, fp);
-    printf("-------------------------\n");
+    s->rlen += n;
+    return session_parse(s);
+}
 
-    /*接受数据，往map内存写*/
-    int remain_size = fhead.bs; //数据块中待接收数据大小
-    int size = 0;               //一次recv接受数据大小
-    while (remain_size > 0)
+int session_register(struct session *s)
+{
+    int seq;
+    int id = register_file(&s->finfo, &seq);
+    printf("freeid = %d\n", id);
+
+    /*向client发送分配的id作为确认，每个分块都将携带id；拒绝时只发送id，发完后关闭*/
+    s->stage = STAGE_REPLY;
+    memcpy(s->rbuf, &id, INT_SIZE);
+    s->rpos = 0;
+    s->rlen = INT_SIZE;
+    s->bm_pos = s->bm_len = 0;
+    s->reply_seq = -1;
+    if (id < 0)
+        return session_send(s);
+
+    /*缺少的分块数，大于0时随后发送已接收分块的位图，client只发送位为0的分块*/
+    struct conn *c = conntab_get(id);
+    s->conn_id = id;
+    s->conn = c;
+    s->reply_seq = seq;
+    int missing = c->count - __atomic_load_n(&c->recvcount, __ATOMIC_ACQUIRE);
+    memcpy(s->rbuf + INT_SIZE, &missing, INT_SIZE);
+    s->rlen += INT_SIZE;
+    if (missing > 0)
+        s->bm_len = (c->count + 7) / 8;
+    printf("missing blocks = %d\n", missing);
+
+    /*上次所有分块都已写完，只差删除续传文件；确认暂存到回复发完*/
+    if (missing == 0)
+        finish_file(id, c);
+    return session_send(s);
+}
+
+int session_send(struct session *s)
+{
+    while (s->rpos < s->rlen || s->bm_pos < s->bm_len)
     {
-        if ((size = recv(sockfd, fp, RECVBUF_SIZE, 0)) > 0)
+        int head = s->rpos < s->rlen;
+        char *buf = head ? s->rbuf + s->rpos : (char *)s->conn->bitmap + s->bm_pos;
+        int len = head ? s->rlen - s->rpos : s->bm_len - s->bm_pos;
+        ssize_t n = send(s->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return SESSION_SEND;
+        if (n <= 0)
         {
-            fp += size;
-            remain_size -= size;
-            //                printf("recv size = %d      ",size);
-            //                printf("remain size = %d\n",remain_size);
+            perror("send reply");
+            return SESSION_ERROR;
         }
+        if (head)
+            s->rpos += n;
+        else
+            s->bm_pos += n;
     }
+    return SESSION_REPLIED;
+}
 
-    printf("----------------- Recv a fileblock ----------------- \n");
+int session_attach(struct session *s)
+{
+    struct conn *c = s->conn;
+    int ret = SESSION_DONE;
+    if (!c || s->reply_seq < 0)
+    {
+        close(s->fd);
+        return ret;
+    }
 
-    /*增加recv_count，判断是否是最后一个分块，如果是最后一个分块，同步map与文件，释放gconn*/
-    pthread_mutex_lock(&conn_lock);
-    gconn[recv_id].recvcount++;
-    if (gconn[recv_id].recvcount == gconn[recv_id].count)
+    /*
+     * 与register_file()、complete_file()互斥：回复期间被重连的client替换时关闭；
+     * 文件已经接收完毕时接着发送暂存的确认；否则info_fd交给传输，开始监视client是否退出
+     */
+    pthread_mutex_lock(&register_lock);
+    if (s->reply_seq != c->info_seq)
     {
-        munmap((void *)gconn[recv_id].mbegin, gconn[recv_id].filesize);
+        close(s->fd);
+    }
+    else if (c->acked)
+    {
+        memcpy(s->rbuf, &c->ack, sizeof(struct file_ack));
+        s->rpos = 0;
+        s->rlen = sizeof(struct file_ack);
+        s->bm_pos = s->bm_len = 0;
+        s->reply_seq = -1;
+        ret = SESSION_SEND;
+    }
+    else
+    {
+        c->info_fd = s->fd;
+        watch_add(s->conn_id, s->fd, EPOLL_CTL_ADD);
+    }
+    pthread_mutex_unlock(&register_lock);
 
-        printf("-----------------  Recv a File ----------------- \n ");
+    /*暂存的确认发完后关闭，不再需要传输*/
+    conn_release(s->conn_id);
+    s->conn_id = -1;
+    s->conn = NULL;
+    return ret;
+}
 
-        int fd = gconn[recv_id].info_fd;
-        close(fd);
-        bzero(&gconn[recv_id], conn_len);
-    }
-    pthread_mutex_unlock(&conn_lock);
+void session_finish(struct session *s)
+{
+    printf("----------------- Recv a fileblock ----------------- \n");
+    finish_block(s->fhead.id, s->fhead.offset);
 
-    close(sockfd);
-    return;
+    /*连接可以继续发送下一个文件块，回到type；释放传输的引用，窗口和缓冲区也不再使用*/
+    if (s->win)
+    {
+        munmap(s->win, s->win_len);
+        s->win = NULL;
+    }
+    if (s->dbuf)
+    {
+        dbuf_free(s->dbuf);
+        s->dbuf = NULL;
+    }
+    s->file_fd = -1;
+    conn_release(s->conn_id);
+    s->conn_id = -1;
+    s->stage = STAGE_TYPE;
+    s->need = INT_SIZE;
 }
 
 /*初始化Server，监听Client*/
-int Server_init(int port)
+static int server_listen(int port, int reuseport)
 {
     int listen_fd;
     struct sockaddr_in server_addr;
@@ -208,6 +1127,14 @@ int Server_init(int port)
     }
     set_fd_noblock(listen_fd);
 
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+    {
+        fprintf(stderr, "Server setsockopt SO_REUSEPORT failed.");
+        exit(-1);
+    }
+
     bzero(&server_addr, sockaddr_len);
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
@@ -219,7 +1146,7 @@ int Server_init(int port)
         exit(-1);
     }
 
-    if (listen(listen_fd, LISTEN_QUEUE_LEN) == -1)
+    if (listen(listen_fd, conf.listen_queue) == -1)
     {
         fprintf(stderr, "Server listen failed.");
         exit(-1);
@@ -227,6 +1154,16 @@ int Server_init(int port)
     return listen_fd;
 }
 
+int Server_init(int port)
+{
+    return server_listen(port, 0);
+}
+
+int Server_init_reuseport(int port)
+{
+    return server_listen(port, 1);
+}
+
 void set_fd_noblock(int fd)
 {
     int flag = fcntl(fd, F_GETFL, 0);
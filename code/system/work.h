@@ -1,6 +1,8 @@
 #ifndef SERVER_H__
 #define SERVER_H__
 
+#define _GNU_SOURCE /*splice(), F_SETPIPE_SZ*/
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -16,77 +18,310 @@
 #include <sys/errno.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <stdint.h>
 
+/*
+ * 以下为默认值与上下限，运行时的取值在struct server_conf中，
+ * 可用命令行或配置文件修改（--recvbuf=256K等），未指定时server按核数、fd上限、socket缓冲区大小自动选择
+ */
 #define PORT 10000           //监听端口
-#define LISTEN_QUEUE_LEN 100 //listen队列长度
-#define THREAD_NUM 8         //线程池大小
-#define CONN_MAX 10          //支持最大连接数，一个连接包含多个socket连接（多线程）
-#define EPOLL_SIZE 50        //epoll最大监听fd数量
+#define LISTEN_QUEUE_LEN 100 //listen队列长度，读不到somaxconn时使用
+#define THREAD_MIN 2         //线程池最少线程数的下限
+#define THREAD_MAX 64        //线程池最多线程数的下限
+#define CONN_MAX 16384       //默认最大同时传输文件数，一个文件包含多个socket连接（多线程）
+#define CONN_LIMIT 1048576   //--conn-max的上限，传输表的id中槽号16位、分片号4位
+#define EPOLL_EVENTS 64      //epoll_wait一次最多返回的事件数的下限
 #define FILENAME_MAXLEN 30   //文件名最大长度
 #define INT_SIZE 4           //int类型长度
 
-/*一次rece接收数据大小*/
-//#define RECVBUF_SIZE    4096        //4K
-//#define RECVBUF_SIZE    32768       //32K
-//#define RECVBUF_SIZE    131072      //128K
-//#define RECVBUF_SIZE    262144      //256K
-#define RECVBUF_SIZE 65536 //64K
+/*一次recv接收文件块数据的最大长度，默认取tcp_rmem中接收缓冲区的上限：一次recv不会超过socket缓冲区中的数据*/
+#define RECVBUF_SIZE 65536    //64K，读不到tcp_rmem时使用
+#define RECVBUF_MIN 16384     //16K
+#define RECVBUF_MAX 4194304   //4M
+
+/*splice每次从socket移入管道的最大长度，同时作为管道容量*/
+#define SPLICE_CHUNK 1048576 //1M
+
+/*-d range/file：文件块数据每写满SYNC_WINDOW开始回写，等待上一个窗口写完后丢弃其页缓存*/
+#define SYNC_WINDOW 8388608 //8M
+/*丢弃页缓存的起点向下取整到DROP_ALIGN：跨过范围边界的大页（large folio）只有整个落在范围内才会被丢弃*/
+#define DROP_ALIGN 2097152 //2M
+
+/*O_DIRECT写入：缓冲区大小与对齐要求，文件偏移、长度、内存地址都按DIRECT_ALIGN对齐*/
+#define DIRECT_BUF 1048576 //1M
+#define DIRECT_ALIGN 4096
+
+/*
+ * 协议版本：每个连接开头的type = 版本 << 8 | 类型。
+ * 版本1的type就是0/255（高位为0），文件大小与偏移是int，不再支持；
+ * 版本2的文件大小、偏移、分块大小都是64位；
+ * 版本3的文件信息带有源文件修改时间，id之后返回缺少的分块数与已接收分块的位图，用于续传；
+ * 版本4在文件接收完毕（-d file时同步到磁盘）后，在信息交换socket上发送struct file_ack；
+ * 版本5的client可以在信息交换socket上发送TYPE_QUERY与id，查询缺少的分块，
+ * Server回复status为ACK_MISSING的struct file_ack，之后是缺少的分块数与已接收分块的位图。
+ */
+#define PROTO_VERSION 5
+#define TYPE_FILEINFO 0                             //文件信息
+#define TYPE_QUERY 1                                //查询缺少的分块，在信息交换socket上发送
+#define TYPE_DATA 255                               //文件块
+#define FRAME_TYPE(kind) (PROTO_VERSION << 8 | (kind)) //本版本的type
+#define ID_BUSY -1                                  //传输表已满
+#define ID_BADVERSION -2                            //协议版本不一致
+#define ID_INVALID -3                               //文件信息无效（大小、分块数、分块大小不一致）
 
 /*文件信息*/
 struct fileinfo
 {
     char filename[FILENAME_MAXLEN]; //文件名
-    int filesize;                   //文件大小
+    int64_t filesize;               //文件大小
     int count;                      //分块数量
-    int bs;                         //标准分块大小
+    int64_t bs;                     //标准分块大小
+    int64_t mtime;                  //源文件修改时间，与文件名、大小、分块大小一起标识续传的文件
+};
+
+/*文件接收完毕的确认*/
+#define ACK_MISSING 1 //不是确认：回复TYPE_QUERY，之后是缺少的分块数与位图
+
+struct file_ack
+{
+    int status;  //0表示成功，-1表示同步失败，ACK_MISSING表示查询的回复
+    int durable; //1表示文件已经fdatasync
 };
 
 /*分块头部信息*/
 struct head
 {
     char filename[FILENAME_MAXLEN]; //文件名
-    int id;                         //分块所属文件的id，gconn[CONN_MAX]数组的下标
-    int offset;                     //分块在原文件中偏移
-    int bs;                         //本文件块实际大小
+    int id;                         //分块所属文件的id，传输表分配
+    int64_t offset;                 //分块在原文件中偏移
+    int64_t bs;                     //本文件块实际大小
 };
 
-//与客户端关联的连接，每次传输建立一个，在多线程之间共享
+//与客户端关联的连接，每次传输建立一个，存放在传输表中，在多线程之间共享
 struct conn
 {
     int info_fd;                    //信息交换socket：接收文件信息、文件传送通知client
     char filename[FILENAME_MAXLEN]; //文件名
-    int filesize;                   //文件大小
-    int bs;                         //分块大小
+    int64_t filesize;               //文件大小
+    int64_t bs;                     //分块大小
     int count;                      //分块数量
-    int recvcount;                  //已接收块数量，recv_count == count表示传输完毕
-    char *mbegin;                   //mmap起始地址
+    int64_t mtime;                  //源文件修改时间
+    int recvcount;                  //已接收块数量，原子递增，recv_count == count表示传输完毕
+    int file_fd;                    //目标文件fd，各连接映射自己的窗口或splice写入
+    int direct_fd;                  //O_DIRECT打开的目标文件，-1表示不使用
+    char *part;                     //映射的续传文件：struct part_header + 已落盘分块的位图
+    int64_t part_len;               //续传文件长度
+    unsigned char *bitmap;          //已接收分块的位图（内存），数据落盘后才写入续传文件
+    int done;                       //文件已接收完毕，正在同步或确认，原子置位，只结束一次
     int used;                       //使用标记，1代表使用，0代表可用
+    int gen;                        //槽的代数，写入id，槽复用时加一
+    int refs;                       //引用计数，传输表与接收文件块的连接各持有一个
+    int info_seq;                   //注册次数：注册回复发完时，只有最后一次注册的连接接管info_fd
+    int acked;                      //接收完毕时注册回复还没有发完（info_fd为-1）：确认暂存在ack中，由回复的session发送
+    struct file_ack ack;
+    int sync_flags;                 //-d range/file：等待同步线程处理的事项，SYNC_BLOCKS|SYNC_FILE，原子置位
+    int sync_id;                    //在同步线程的队列中时，传输的id
+    struct conn *sync_next;         //同步线程的队列，排队期间持有一个引用
+    int next_free;                  //空闲槽链表
+    int name_next;                  //文件名索引中同一个桶的下一个传输id，-1表示没有
 };
 
-/*线程参数*/
-struct args
+/*
+ * 续传文件：目标文件名加PART_SUFFIX，与目标文件放在同一目录。
+ * 头部之后每个分块一位，分块数据fdatasync之后才置位：-d range/file由同步线程成组fdatasync之后置位
+ * （最后一个分块除外，文件随后整体同步），-d none只在client退出、中止传输时置位；server崩溃后，位图中的分块一定已经落盘。
+ * 同一文件（文件名、大小、分块大小、修改时间都相同）重新注册时从位图继续。
+ */
+#define PART_SUFFIX ".part"
+#define PART_MAGIC "TFPART3"
+
+struct part_header
+{
+    char magic[8];    //PART_MAGIC
+    int64_t filesize; //文件大小
+    int64_t bs;       //标准分块大小
+    int64_t mtime;    //源文件修改时间
+    int count;        //分块数量
+};
+
+/*接收引擎*/
+#define ENGINE_EPOLL 0 //epoll监听非阻塞连接，可读时由线程池推进状态机
+#define ENGINE_URING 1 //io_uring，每个核一个ring
+
+/*文件块数据的写入方式*/
+#define INGEST_MMAP 0   //recv到MAP_SHARED映射中
+#define INGEST_SPLICE 1 //socket -> 线程私有管道 -> 文件，不经过用户内存
+#define INGEST_DIRECT 2 //recv到对齐的缓冲区，满1M后O_DIRECT写入，不经过页缓存
+
+/*持久化方式*/
+#define DURABLE_NONE 0  //由内核决定何时回写
+#define DURABLE_RANGE 1 //文件块按SYNC_WINDOW窗口sync_file_range回写，回写后丢弃页缓存
+#define DURABLE_FILE 2  //同DURABLE_RANGE，文件接收完毕后由同步线程成组fdatasync，再确认
+
+/*运行时配置*/
+struct server_conf
+{
+    int engine;  //接收引擎
+    int nrings;  //io_uring引擎的ring数量，默认等于核数
+    int ingest;  //文件块数据的写入方式，splice只用于epoll引擎
+    int tmin;    //线程池最少线程数
+    int tmax;    //线程池最多线程数
+    int stats;   //每隔stats秒打印线程池统计，0表示不打印
+    int durable; //持久化方式
+    int recvbuf;      //一次recv的最大长度
+    int listen_queue; //listen队列长度
+    int conn_max;     //最大同时传输文件数
+    int epoll_events; //epoll_wait一次最多返回的事件数
+};
+
+extern struct server_conf conf;
+
+/*连接的接收阶段：type -> fileinfo/head -> 文件块数据 -> type（数据连接可以连续发送多个文件块）*/
+#define STAGE_TYPE 0
+#define STAGE_FILEINFO 1
+#define STAGE_HEAD 2
+#define STAGE_DATA 3
+#define STAGE_REPLY 4 //注册之后向client发送id、缺少的分块数与位图，不阻塞
+
+/*session_advance()的返回值*/
+#define SESSION_MORE 0     //继续接收
+#define SESSION_FILEINFO 1 //文件信息接收完毕，调用session_register()
+#define SESSION_BLOCK 2    //文件块接收完毕，调用session_finish()
+#define SESSION_SEND 3     //回复没有发完，socket可写时调用session_send()
+#define SESSION_REPLIED 4  //回复发完，引擎不再监视fd之后调用session_attach()
+#define SESSION_DONE 5     //fd已经交给传输表或关闭，释放session
+#define SESSION_ERROR -1   //协议错误
+
+/*头部预读缓冲区大小：一次recv取得type与头部，多读到的文件块数据交给文件块*/
+#define SESSION_RBUF 4096
+
+/*每个连接映射的文件窗口大小，文件块数据收到窗口末尾时滑动到下一段*/
+#define SESSION_WINDOW (64 * 1024 * 1024) //64M
+
+/*一个socket连接的接收状态机，不关心数据如何从socket读出*/
+struct session
 {
     int fd;
-    void (*recv_finfo)(int fd);
-    void (*recv_fdata)(int fd);
+    int stage;
+    char rbuf[SESSION_RBUF];   //预读缓冲区
+    int rpos;                  //rbuf中已处理的位置
+    int rlen;                  //rbuf中数据的长度
+    int need;                  //当前阶段头部的长度
+    struct fileinfo finfo;     //STAGE_FILEINFO的结果
+    struct head fhead;         //STAGE_HEAD的结果
+    int file_fd;               //目标文件fd
+    int64_t pos;               //下一个字节在文件中的偏移
+    int64_t remain;            //文件块中待接收数据大小
+    char *win;                 //当前映射的窗口，NULL表示没有映射
+    int64_t win_off;           //窗口在文件中的偏移，页对齐
+    int64_t win_len;           //窗口长度
+    int direct_fd;             //INGEST_DIRECT：O_DIRECT打开的目标文件
+    char *dbuf;                //INGEST_DIRECT：从缓冲池取得的对齐缓冲区，写入文件的pos处
+    int dlen;                  //dbuf中的数据长度
+    int64_t wb_off;            //-d range/file：还没有开始回写的数据在文件中的起始偏移
+    int64_t wb_prev_off;       //正在回写的上一个窗口
+    int64_t wb_prev_len;
+    int conn_id;               //接收文件块、发送注册回复期间持有引用的传输id，-1表示没有
+    struct conn *conn;         //STAGE_REPLY：conn_id对应的传输
+    int reply_seq;             //STAGE_REPLY：注册时的info_seq，-1表示发送的是暂存的确认，发完后关闭
+    int bm_pos;                //STAGE_REPLY：rbuf中[rpos, rlen)发完之后，发送位图中[bm_pos, bm_len)
+    int bm_len;
+    void *ring;                //io_uring引擎：连接所属的ring，线程池处理完后交还给它
+    int ring_res;              //io_uring引擎：交给线程池处理的recv结果
+    struct session *next_free; //空闲链表；io_uring引擎中也用作交还ring的链表
 };
 
-/*创建大小为size的文件*/
-int createfile(char *filename, int size);
+/*session每次从堆上分配的个数*/
+#define SESSION_SLAB 64
+
+/*创建大小为size的文件，用fallocate预分配连续的磁盘空间，文件系统不支持时创建稀疏文件*/
+int createfile(char *filename, int64_t size);
 
 /*初始化Server：监听请求，返回listenfd*/
 int Server_init(int port);
 
-/*设置fd非阻塞*/
-void set_fd_noblock(int fd);
+/*初始化带SO_REUSEPORT的Server，同一端口可以有多个listenfd*/
+int Server_init_reuseport(int port);
+
+/*
+ * 创建填充文件与续传文件，添加到传输表，返回分配的id；表满时返回ID_BUSY，文件信息无效时返回ID_INVALID。
+ * 已有同一文件的续传文件时继续接收；同一文件正在传输时（client重连）沿用原来的id，关闭原来的info_fd；
+ * 正在传输的同名文件信息不同时，原来的client已经退出则替换原来的传输，否则返回ID_BUSY。
+ * 新的info_fd在注册回复发完后由session_attach()交给传输，*seq返回本次注册的序号。
+ */
+int register_file(struct fileinfo *finfo, int *seq);
+
+/*recv size字节到dst，返回0表示成功，-1表示连接出错*/
+int ingest_mmap(int sockfd, char *dst, int64_t size);
+
+/*经线程私有管道把最多size字节从socket splice到file_fd的offset处，返回写入的字节数，语义同recv()*/
+int ingest_splice_some(int sockfd, int file_fd, off_t offset, int64_t size);
+
+/*循环调用ingest_splice_some()直到写完size字节，返回值同ingest_mmap()*/
+int ingest_splice(int sockfd, int file_fd, off_t offset, int64_t size);
+
+/*把buf中len字节写入offset处：对齐的部分用direct_fd，末尾不足DIRECT_ALIGN的部分用file_fd；成功返回0*/
+int direct_write(int direct_fd, int file_fd, char *buf, int64_t len, off_t offset);
+
+/*经对齐的缓冲区把size字节从socket写入文件的offset处，返回值同ingest_mmap()*/
+int ingest_direct(int sockfd, int direct_fd, int file_fd, off_t offset, int64_t size);
+
+/*从缓冲池取一个DIRECT_BUF大小、DIRECT_ALIGN对齐的缓冲区，放回可以在任意线程调用*/
+char *dbuf_alloc();
+void dbuf_free(char *buf);
+
+/*offset处的文件块接收完毕，在位图中置位；最后一个分块时结束文件*/
+void finish_block(int id, int64_t offset);
+
+/*把内存位图中已接收的分块写入续传文件：先取位图再fdatasync，写入续传文件的分块都已落盘*/
+void part_checkpoint(struct conn *c);
+
+/*释放conntab_acquire()取得的引用，最后一个引用时关闭文件*/
+void conn_release(int id);
 
-/*接收文件信息，向Client返回本次文件传输使用的freeid*/
-void recv_fileinfo(int sockfd);
+/*发送确认，删除续传文件，关闭文件，从传输表中释放；-d file时由同步线程在fdatasync之后调用*/
+void complete_file(int id, struct file_ack *ack);
 
-/*接收文件块*/
-void recv_filedata(int sockfd);
+/*初始化连接状态机，从type开始接收*/
+void session_init(struct session *s, int fd);
 
-/*线程函数*/
-void *worker(void *argc);
+/*从空闲链表取出一个session并初始化，空闲链表为空时从堆上分配SESSION_SLAB个*/
+struct session *session_alloc(int fd);
+
+/*解除窗口映射，session放回空闲链表，可以在任意线程调用*/
+void session_free(struct session *s);
+
+/*连接路径上的池（session、传输表的槽块、dbuf、位图）为空时从堆上分配，调用conn_heap_grow()计数*/
+void conn_heap_grow();
+
+/*连接路径上从堆分配的次数，稳定运行时不再增加*/
+long conn_heap_allocs();
+
+/*下一次接收的目标地址，返回最多可以接收的长度；文件块数据需要滑动窗口而映射失败时返回-1*/
+int session_want(struct session *s, char **buf);
+
+/*处理接收到的n个字节，一次可能完成多个阶段；n为0时只解析预读缓冲区中剩余的数据*/
+int session_advance(struct session *s, int n);
+
+/*
+ * SESSION_FILEINFO：注册文件，开始向client发送id、缺少的分块数与位图（STAGE_REPLY），socket不阻塞；
+ * 返回SESSION_SEND或SESSION_REPLIED。
+ */
+int session_register(struct session *s);
+
+/*STAGE_REPLY：socket可写时继续发送，返回值同session_register()*/
+int session_send(struct session *s);
+
+/*
+ * SESSION_REPLIED：info_fd交给传输表（拒绝或被之后的注册替换时关闭），开始监视client是否退出；
+ * 回复期间文件已经接收完毕时接着发送暂存的确认，返回SESSION_SEND，否则返回SESSION_DONE。
+ */
+int session_attach(struct session *s);
+
+/*SESSION_BLOCK：完成文件块，连接回到type，继续接收同一连接上的下一个文件块*/
+void session_finish(struct session *s);
+
+/*设置fd非阻塞*/
+void set_fd_noblock(int fd);
 
 #endif